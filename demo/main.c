@@ -10,6 +10,19 @@
 
 #define KHAX_lengthof(...) (sizeof(__VA_ARGS__) / sizeof((__VA_ARGS__)[0]))
 
+// System tick rate, for converting to microseconds.
+#define BENCH_TICKS_PER_SECOND 268111856ULL
+// CPU clock rate, for converting cycle counts to microseconds.  The demo never switches a New 3DS
+// to its 804 MHz mode, so this is the base clock.
+#define BENCH_CYCLES_PER_SECOND 268111856ULL
+// Number of timed iterations for each repeated benchmark.
+#define BENCH_ITERATIONS 1000
+// Where khaxBenchmark writes its results.
+#define BENCH_CSV_PATH "sdmc:/khaxbench.csv"
+
+// Process ID system call number, for looking it up in the SVC profile.
+#define SVC_GET_PROCESS_ID 0x35
+
 s32 g_backdoorResult = -1;
 
 s32 dump_chunk_wrapper()
@@ -19,6 +32,130 @@ s32 dump_chunk_wrapper()
 	return 0;
 }
 
+// Empty svcBackdoor target, for timing the kernel round trip alone.
+s32 backdoor_nop()
+{
+	return 0;
+}
+
+// Convert system ticks to microseconds.
+double ticks_to_us(u64 ticks)
+{
+	return (double) ticks * 1000000.0 / (double) BENCH_TICKS_PER_SECOND;
+}
+
+// Convert CPU cycles to microseconds.
+double cycles_to_us(u64 cycles)
+{
+	return (double) cycles * 1000000.0 / (double) BENCH_CYCLES_PER_SECOND;
+}
+
+// Time a function with libkhax's benchmark harness and print its min, median and 99th percentile.
+void bench_function(const char *name, Result (*function)(void *context), void *context)
+{
+	KhaxBenchmarkResult summary;
+
+	Result result = khaxBenchmarkFunction(function, context, BENCH_ITERATIONS, &summary);
+	if (result == 0)
+	{
+		result = summary.result;
+	}
+	if (result != 0)
+	{
+		printf("%-10s %08lx\n", name, result);
+		return;
+	}
+
+	printf("%-10s min %7.2f med %7.2f p99 %7.2f us\n", name, ticks_to_us(summary.minTicks),
+		ticks_to_us(summary.medianTicks), ticks_to_us(summary.p99Ticks));
+}
+
+// svcBackdoor with an empty payload: the cost of one trip into the kernel.
+Result call_backdoor(void *context)
+{
+	(void) context;
+	svcBackdoor(backdoor_nop);
+	return 0;
+}
+
+// A cheap system call, for measuring the SVC profiler's overhead.
+Result call_getpid(void *context)
+{
+	u32 pid;
+
+	(void) context;
+	return svcGetProcessId(&pid, 0xFFFF8001);
+}
+
+// khaxGetStats.
+Result call_getstats(void *context)
+{
+	KhaxStats stats;
+
+	(void) context;
+	return khaxGetStats(&stats);
+}
+
+// Print what libkhax measured during khaxInit.
+void print_init_stats()
+{
+	KhaxStats stats;
+	unsigned x;
+
+	Result result = khaxGetStats(&stats);
+	if (result != 0)
+	{
+		printf("khaxGetStats:%08lx\n", result);
+		return;
+	}
+
+	for (x = 0; x < KHAX_lengthof(stats.stepTicks); ++x)
+	{
+		printf("step%u %9.1f us\n", x + 1, ticks_to_us(stats.stepTicks[x]));
+	}
+	if (stats.gspwnCount)
+	{
+		printf("gspwn x%lu avg %.1f us\n", stats.gspwnCount,
+			ticks_to_us(stats.gspwnTicks / stats.gspwnCount));
+	}
+	if (stats.dataCacheNukeCount)
+	{
+		printf("nuke x%lu avg %.1f us\n", stats.dataCacheNukeCount,
+			ticks_to_us(stats.dataCacheNukeTicks / stats.dataCacheNukeCount));
+	}
+	printf("irqoff x%lu max %.2f p99 %.2f us\n", stats.interruptsOffWindowCount,
+		cycles_to_us(stats.interruptsOffMaxTicks), cycles_to_us(stats.interruptsOffP99Ticks));
+	printf("corrupt window %.1f us\n", ticks_to_us(stats.corruptWindowTicks));
+}
+
+// Time the SVC profiler: the overhead it adds to a system call, and whether it counted.
+void bench_svc_profiler()
+{
+	const volatile KhaxSVCProfile *profile = NULL;
+	Result result;
+	u64 start;
+	u32 timed;
+
+	bench_function("getpid", call_getpid, NULL);
+
+	start = svcGetSystemTick();
+	result = khaxSVCProfilerInstall(&profile);
+	printf("profiler install %08lx %.1f us\n", result, ticks_to_us(svcGetSystemTick() - start));
+	if (result != 0)
+	{
+		return;
+	}
+
+	khaxSVCProfilerReset();
+	bench_function("getpid+pr", call_getpid, NULL);
+	timed = profile->calls[SVC_GET_PROCESS_ID] - profile->untimed[SVC_GET_PROCESS_ID];
+	printf("profiled getpid x%lu %.2f us\n", profile->calls[SVC_GET_PROCESS_ID],
+		timed ? cycles_to_us(profile->ticks[SVC_GET_PROCESS_ID] / timed) : 0.0);
+
+	result = khaxSVCProfilerUninstall();
+	printf("profiler uninstall %08lx\n", result);
+}
+
 // Test access to "am" service, which we shouldn't have access to, unless khax succeeds.
 Result test_am_access_inner(char *productCode)
 {
@@ -70,30 +207,41 @@ void test_am_access_outer(int testNumber)
 
 int main()
 {
-	// Initialize services
-/*	srvInit();			// mandatory
-	aptInit();			// mandatory
-	hidInit(NULL);	// input (buttons, screen)*/
-	gfxInitDefault();			// graphics
-/*	fsInit();
-	sdmcInit();
-	hbInit();
-	qtmInit();*/
+	Result result;
+	u64 start;
 
+	gfxInitDefault();
 	consoleInit(GFX_BOTTOM, NULL);
-
 	consoleClear();
 
 	test_am_access_outer(1); // test before libkhax
 
-	Result result = khaxInit();
-	printf("khaxInit returned %08lx\n", result);
+	start = svcGetSystemTick();
+	result = khaxInit();
+	printf("khaxInit returned %08lx in %.1f us\n", result, ticks_to_us(svcGetSystemTick() - start));
 
-	printf("backdoor returned %08lx\n", (svcBackdoor(dump_chunk_wrapper), g_backdoorResult));
+	print_init_stats();
 
-	test_am_access_outer(2); // test after libkhax
+	if (result == 0)
+	{
+		printf("backdoor returned %08lx\n", (svcBackdoor(dump_chunk_wrapper), g_backdoorResult));
+
+		test_am_access_outer(2); // test after libkhax
+
+		bench_function("backdoor", call_backdoor, NULL);
+		bench_function("getstats", call_getstats, NULL);
+		bench_svc_profiler();
+	}
 
-	printf("khax demo main finished\n");
+	// libkhax's own primitives, written to SD for the host.
+	if (sdmcInit() == 0)
+	{
+		result = khaxBenchmark(BENCH_CSV_PATH, BENCH_ITERATIONS);
+		printf("khaxBenchmark:%08lx -> %s\n", result, BENCH_CSV_PATH);
+		sdmcExit();
+	}
+
+	printf("khax benchmark finished\n");
 	printf("Press X to exit\n");
 
 	khaxExit();
@@ -103,34 +251,21 @@ int main()
 		// Wait next screen refresh
 		gspWaitForVBlank();
 
-		// Read which buttons are currently pressed 
+		// Read which buttons are currently pressed
 		hidScanInput();
 		u32 kDown = hidKeysDown();
-		(void) kDown;
-		u32 kHeld = hidKeysHeld();
-		(void) kHeld;
 
-		// If START is pressed, break loop and quit
+		// If X is pressed, break loop and quit
 		if (kDown & KEY_X){
 			break;
 		}
 
-		//consoleClear();
-
 		// Flush and swap framebuffers
 		gfxFlushBuffers();
 		gfxSwapBuffers();
 	}
 
-	// Exit services
-/*	qtmExit();
-	hbExit();
-	sdmcExit();
-	fsExit();*/
 	gfxExit();
-/*	hidExit();
-	aptExit();
-	srvExit();*/
 
 	// Return to hbmenu
 	return 0;
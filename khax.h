@@ -11,6 +11,385 @@ Result khaxInit();
 // Shut down libkhax
 Result khaxExit();
 
+// How GSPwn makes the CPU see memory that the GPU has just copied.
+typedef enum KhaxCachePolicy
+{
+	// Evict the whole data cache by reading through a 2 MB buffer.  Covers every mapping of the
+	// copied memory, including the kernel's.
+	KHAX_CACHE_NUKE = 0,
+	// Invalidate only this process's view of the destination.  Much faster, but lines held
+	// through the kernel's mapping of the same memory are left alone.
+	KHAX_CACHE_RANGE = 1,
+} KhaxCachePolicy;
+
+// How GSPwn waits for the GPU copy.
+typedef enum KhaxGPUCopyMode
+{
+	// Wait for the copy to finish, then do the cache maintenance.
+	KHAX_GPU_COPY_SYNC = 0,
+	// Do the cache maintenance while the copy is in flight, then wait.  Hides most of the cost
+	// of KHAX_CACHE_NUKE, at the risk of the CPU pulling in a line before the copy reaches it.
+	KHAX_GPU_COPY_OVERLAPPED = 1,
+} KhaxGPUCopyMode;
+
+// Where libkhax's diagnostic messages go.  Messages are only produced by KHAX_DEBUG builds.
+typedef enum KhaxLogSink
+{
+	// printf to the console, waiting for a VBlank and swapping buffers after each message.  The
+	// wait also happens in non-debug builds, which has paced the exploit since it was written.
+	KHAX_LOG_CONSOLE = 0,
+	// No messages, and no waits.
+	KHAX_LOG_NONE = 1,
+	// Pass each message to logCallback, without waiting.
+	KHAX_LOG_CALLBACK = 2,
+} KhaxLogSink;
+
+// What khaxInitEx grants once it has kernel access, in addition to all system calls.
+enum
+{
+	// Access to all services (Step7).
+	KHAX_GRANT_SERVICES = 1 << 0,
+};
+
+// When khaxInitEx gains kernel access.
+typedef enum KhaxInitMode
+{
+	// Before khaxInitEx returns.
+	KHAX_INIT_NOW = 0,
+	// On the first call that needs kernel access, such as khaxResolveHandles or
+	// khaxBoostThreadPriorities.  khaxInitEx only records the options and returns.  That first
+	// call then takes the time that khaxInitEx would have, and fails with khaxInitEx's error if
+	// the exploit fails.  The exploit is attempted only once; concurrent callers wait for it.
+	// It runs on a thread of its own, with a 64 KB stack and the caller's priority, so the
+	// calling thread's stack size doesn't matter.  The process's SVC access is widened for
+	// threads created afterward, and the calling thread is given the same access; other threads
+	// that already existed get none.
+	KHAX_INIT_LAZY = 1,
+} KhaxInitMode;
+
+// Options for khaxInitEx.  Start from khaxGetDefaultOptions and change what's needed.
+typedef struct KhaxOptions
+{
+	// sizeof(KhaxOptions).
+	u32 size;
+	KhaxCachePolicy cachePolicy;
+	KhaxGPUCopyMode gpuCopyMode;
+	KhaxLogSink logSink;
+	// For KHAX_LOG_CALLBACK: called with each message, and logContext.
+	void (*logCallback)(const char *message, void *context);
+	void *logContext;
+	// How many times Step4 may start over after finding an unexpected heap layout.
+	u32 layoutRetries;
+	// Give up if the heap isn't ready to corrupt (Step5) within this many ticks; 0 for no limit.
+	// This is not a bound on how long khaxInitEx takes.  The budget is only checked before each
+	// of Steps 1 to 5, so a step that starts in time can overrun it.  Once Step5 has started,
+	// the budget can no longer abort anything: the heap is corrupt, and the remaining steps run
+	// to completion however long they take, because stopping there would crash the system.
+	u32 timeBudgetTicks;
+	// KHAX_GRANT_* flags.
+	u32 grants;
+	KhaxInitMode initMode;
+} KhaxOptions;
+
+// Fill in the options that khaxInit uses, including any retry limit set with
+// khaxSetLayoutRetryLimit.
+void khaxGetDefaultOptions(KhaxOptions *options);
+// khaxInit with a choice of strategies.  The options stay in effect afterward, for the cache
+// policy and copy mode of later GPU copies, and for logging.
+Result khaxInitEx(const KhaxOptions *options);
+
+// Statistics gathered by libkhax.  Times come in two units.  The interruptsOff fields are in CPU
+// cycles, from the ARM11 cycle counter, whose rate follows the CPU clock: 268 MHz normally, 804 MHz
+// in a New 3DS's high clock mode.  Everything else is in system ticks, the unit of
+// svcGetSystemTick, which are 268,111,856 per second whatever the CPU clock.
+typedef struct KhaxStats
+{
+	// Number of interrupts-disabled windows opened by kernel-mode code so far.
+	u32 interruptsOffWindowCount;
+	// Longest interrupts-disabled window seen, in CPU cycles.
+	u32 interruptsOffMaxTicks;
+	// 99th percentile of the most recent interrupts-disabled windows, in CPU cycles.
+	u32 interruptsOffP99Ticks;
+	// Current budget for a single interrupts-disabled window, in CPU cycles.
+	u32 interruptsOffBudgetTicks;
+	// Time taken by each step of the last khaxInit; index 0 is Step1.
+	u32 stepTicks[7];
+	// Number of GSPwn copies done, and their total time including the data cache nuke.
+	u32 gspwnCount;
+	u64 gspwnTicks;
+	// Number of data cache nukes done, and their total time.
+	u32 dataCacheNukeCount;
+	u64 dataCacheNukeTicks;
+	// Number of heap layout attempts made by the last khaxInit (1 if Step4 passed first time),
+	// and the time from the first Step2 until Step4 passed.
+	u32 layoutAttempts;
+	u32 layoutTicks;
+	// Step that failed in the last khaxInit (1-7), 0 if none, or 0xFF if the kernel version wasn't
+	// recognized; and the Result it returned.
+	u32 lastFailedStep;
+	Result lastResult;
+	// Time the last khaxInit ran with svcCreateThread patched and the kernel heap corrupt, from
+	// Step5 freeing the page until Step6 returned; 0 if it didn't get that far.
+	u32 corruptWindowTicks;
+	// Time the first call needing kernel access spent running a KHAX_INIT_LAZY khaxInitEx; 0 if
+	// none has.
+	u32 lazyInitTicks;
+} KhaxStats;
+
+// Retrieve the statistics gathered so far.
+Result khaxGetStats(KhaxStats *stats);
+// Append a record of each khaxInit attempt to a binary log file, in the format described in
+// khaxlog.h.  The path is typically on SD, which the caller must have mounted.  Null disables.
+Result khaxSetAttemptLog(const char *path);
+// Set how many times khaxInit may free its pages and try again when Step4 finds an unexpected
+// heap layout.  Defaults to 4.
+Result khaxSetLayoutRetryLimit(u32 retries);
+// Set the budget for a single interrupts-disabled window, in CPU cycles.  Batched kernel-mode
+// operations that exceed it are split into several windows.  Zero restores the default, which is
+// 50 microseconds at 268 MHz; at 804 MHz the same count of cycles lasts a third as long.
+Result khaxSetInterruptBudget(u32 ticks);
+
+// Per-system call profile gathered by the kernel-side SVC profiler.  The kernel updates it as
+// calls happen, so it can be read directly without making a system call.  Only calls made by
+// threads of this process are counted.  Calls are timed with the per-core cycle counter, in CPU
+// cycles rather than svcGetSystemTick's system ticks: the two agree at 268 MHz, but a New 3DS at
+// 804 MHz counts three cycles per tick.  A call that returns on a different core than it started on
+// is counted as untimed instead; the average time of a call is ticks / (calls - untimed).  The
+// counter is 32 bits, so a single call blocking for longer than it takes to wrap (about 16 seconds
+// at 268 MHz, 5 at 804 MHz) is timed modulo that.
+typedef struct KhaxSVCProfile
+{
+	// Cumulative time spent inside each system call, in CPU cycles.
+	u64 ticks[128];
+	// Number of calls made to each system call.
+	u32 calls[128];
+	// Number of those calls whose time isn't included in ticks.
+	u32 untimed[128];
+} KhaxSVCProfile;
+
+// Install the SVC profiler, which hooks the kernel's system call dispatch.  Requires a successful
+// khaxInit, and that the application can create threads on core 1 (APT_SetAppCpuTimeLimit), so
+// that both cores' instruction caches can be prepared.  *profile receives a pointer to the live
+// profile.  The hooks run code in this process's memory, so they must be removed before the
+// process ends: khaxExit and an atexit handler do so, but ending the process any other way (such
+// as calling svcExitProcess directly) with the profiler installed will crash the system.
+Result khaxSVCProfilerInstall(const volatile KhaxSVCProfile **profile);
+// Remove the SVC profiler hooks.  The profile remains readable afterward.
+Result khaxSVCProfilerUninstall();
+// Zero the SVC profile's counters.
+Result khaxSVCProfilerReset();
+
+// Address spaces for khaxConvertAddresses.
+typedef enum KhaxAddressSpace
+{
+	// This process's virtual addresses.
+	KHAX_ADDRESS_USER = 0,
+	// The ARM11 kernel's virtual addresses.
+	KHAX_ADDRESS_KERNEL = 1,
+	// Physical addresses.
+	KHAX_ADDRESS_PHYSICAL = 2,
+} KhaxAddressSpace;
+
+// Convert count addresses from one address space to another.  Known regions are FCRAM, VRAM,
+// DSP memory and AXI WRAM.  Each input address starts a range of size bytes that must lie within
+// one region, and within the part of it that is mapped in the target space.  Failed addresses
+// are converted to 0, and an error is returned after converting the rest.
+Result khaxConvertAddresses(KhaxAddressSpace from, KhaxAddressSpace to, const u32 *in, u32 *out,
+	u32 count, u32 size);
+
+// Flags for khaxEnableNew3DSPerformanceMode.
+enum
+{
+	// Run the CPU at 804 MHz instead of 268 MHz.
+	KHAX_NEW3DS_HIGH_CLOCK = 1 << 0,
+	// Request the L2 cache.  Not verified; see khaxEnableNew3DSPerformanceMode.
+	KHAX_NEW3DS_L2_CACHE = 1 << 1,
+};
+
+// On a New 3DS, configure the CPU clock and L2 cache through ptm:sysm, which khaxInit makes
+// reachable.  Flags not given are switched off.  If KHAX_NEW3DS_HIGH_CLOCK is given, the clock
+// change is confirmed by timing, and an error is returned if it didn't take effect.  The L2
+// cache setting can't be observed, so success only means that ptm:sysm accepted it.  Fails on an
+// Old 3DS.
+Result khaxEnableNew3DSPerformanceMode(u32 flags);
+
+// Attributes for khaxMapPhysicalMemory: one memory type, plus access flags.
+enum
+{
+	// Strongly ordered device memory, for hardware registers.
+	KHAX_MAP_DEVICE = 0 << 0,
+	// Normal memory, not cached; writes may be combined.  Suits streaming data into VRAM.
+	KHAX_MAP_UNCACHED = 1 << 0,
+	// Normal memory, write-through cached.
+	KHAX_MAP_WRITE_THROUGH = 2 << 0,
+	// Normal memory, write-back cached.  Cache maintenance is then the caller's job.
+	KHAX_MAP_WRITE_BACK = 3 << 0,
+	KHAX_MAP_TYPE_MASK = 3 << 0,
+
+	// Map read-only rather than read/write.
+	KHAX_MAP_READ_ONLY = 1 << 2,
+	// Allow instruction fetches.
+	KHAX_MAP_EXECUTE = 1 << 3,
+};
+
+// Map VRAM or ARM11 I/O registers directly into this process, so that the CPU can write straight
+// to them.  Addresses and size must be multiples of 1 MB.  The kernel doesn't know about the
+// mapping, so userAddress has to be in space that it never hands out, which is limited to
+// 0x04000000-0x08000000, 0x1C000000-0x1E800000 and 0x20000000-0x30000000, and which is unmapped
+// now.  khaxExit removes any mappings left, and so does exit() if khaxExit isn't called.
+Result khaxMapPhysicalMemory(u32 userAddress, u32 physicalAddress, u32 size, u32 attributes);
+
+// Remove a mapping made by khaxMapPhysicalMemory.  The arguments must match that call.  The
+// translation entries are cleared, then each application core invalidates its own TLB.  If a core
+// can't be reached, an error is returned and *pendingCores, if given, has a bit set for each core
+// that may still translate through the mapping.  The range stays reserved until a later call for
+// the same mapping reaches those cores too.
+Result khaxUnmapPhysicalMemory(u32 userAddress, u32 size, u32 *pendingCores);
+
+// One thread snapshot taken by the sampling profiler.
+typedef struct KhaxSample
+{
+	// svcGetSystemTick when the snapshot was taken.
+	u64 tick;
+	u32 threadID;
+	s32 priority;
+	// Kernel address of the object the thread is waiting on, or 0 if runnable.
+	u32 waitObject;
+	// User-mode address the thread will resume at, or 0 if it couldn't be found.
+	u32 pc;
+	// Kernel address at which the thread was last switched out.
+	u32 kernelLR;
+	u32 reserved;
+} KhaxSample;
+
+// Start a thread that snapshots every registered thread once per interval, in one kernel trip,
+// into a ring buffer.  The main thread is registered automatically.
+Result khaxSamplerStart(u32 intervalMicroseconds, s32 priority);
+
+// Stop the sampling thread.  Samples not yet read are kept.
+Result khaxSamplerStop();
+
+// Include or exclude the calling thread from the sampling profiler and the wait-graph analyzer.
+// The registry holds a handle to each registered thread.  Threads that exit without
+// unregistering are dropped, and their handles closed, before the next snapshot.
+Result khaxSamplerRegisterThread();
+Result khaxSamplerUnregisterThread();
+
+// Take up to maxCount samples out of the ring, returning how many were taken.  Samples that
+// arrived while the ring was full are dropped and counted in *dropped, if given.
+u32 khaxSamplerRead(KhaxSample *samples, u32 maxCount, u32 *dropped);
+
+// Drain the ring into a file of folded stacks, one "stack count" line each, as taken by
+// flamegraph.pl.  Addresses are given relative to our code segments, for addr2line.
+Result khaxSamplerWriteFolded(const char *path);
+
+// Snapshot what each registered thread is waiting on, which other registered threads wait on the
+// same objects, and who owns the mutexes among them, in one kernel trip.  Only registered threads
+// are looked at: an owner outside the registry is shown as unregistered and not followed.  Waits
+// seen across snapshots are timed into per-object histograms; up to 64 objects are tracked, and
+// beyond that the least recently seen is evicted with its histogram, which the graph reports.
+// *cycles, if given, receives the number of deadlock cycles found.
+// The first call briefly runs a helper thread to learn how to recognize kernel mutexes.  If that
+// fails, the snapshot is still taken without following mutex owners, and the next call tries again.
+Result khaxWaitGraphSnapshot(u32 *cycles);
+
+// Write the latest snapshot as a Graphviz graph.  Deadlock cycles and blocked-time histograms
+// are included as comments.
+Result khaxWaitGraphWrite(const char *path);
+
+// Kernel object types that khaxResolveHandles recognizes.
+typedef enum KhaxObjectType
+{
+	KHAX_OBJECT_UNKNOWN = 0,
+	KHAX_OBJECT_PROCESS = 1,
+	KHAX_OBJECT_THREAD = 2,
+	KHAX_OBJECT_EVENT = 3,
+	KHAX_OBJECT_MUTEX = 4,
+	KHAX_OBJECT_SEMAPHORE = 5,
+	KHAX_OBJECT_TIMER = 6,
+	KHAX_OBJECT_ADDRESS_ARBITER = 7,
+} KhaxObjectType;
+
+// The kernel object behind a handle.
+typedef struct KhaxHandleInfo
+{
+	// Kernel address of the object, or 0 if the handle isn't open.
+	u32 object;
+	// Kernel address of the object's vtable, which also tells apart types not listed above.
+	u32 vtable;
+	KhaxObjectType type;
+} KhaxHandleInfo;
+
+// Resolve count handles of this process to kernel objects.  Results are cached, and all misses
+// are read from the process handle table together in one kernel trip.  A handle value includes
+// the generation of its table slot, so a reused slot never hits the entry of an earlier handle.
+// The current thread and process pseudo-handles are accepted but never cached.  Handles that
+// aren't open resolve to 0, and an error is returned after resolving the rest.  The first call
+// briefly creates one object of each type to learn their vtables; if that fails, the call fails,
+// and the next call tries again.  The handles must stay open until this returns.
+Result khaxResolveHandles(const Handle *handles, KhaxHandleInfo *info, u32 count);
+
+// svcCloseHandle, also dropping the handle from khaxResolveHandles's cache.  A handle closed by
+// other means may still resolve to its old object until its slot is reused.
+Result khaxCloseHandle(Handle handle);
+
+// Most threads one khaxBoostThreadPriorities call can change.
+#define KHAX_PRIORITY_BOOST_MAX 16
+
+// Priorities saved by khaxBoostThreadPriorities, for khaxRestoreThreadPriorities.
+typedef struct KhaxPriorityBoost
+{
+	u32 count;
+	Handle threads[KHAX_PRIORITY_BOOST_MAX];
+	s32 priorities[KHAX_PRIORITY_BOOST_MAX];
+} KhaxPriorityBoost;
+
+// Set the priority of count threads of this process, ignoring the process's priority limit, so
+// that they can be given priorities as high as system threads have.  Everything happens in one
+// kernel call: the kernel's own svcSetThreadPriority makes the changes, so its scheduler queues
+// stay consistent, while this process alone sees a priority limit lifted to the highest priority
+// in priorities.  The resource limit object that the rest of this process's category shares is
+// not modified.  The threads' KThread priorities are then checked against the priorities
+// requested, still in the same call.  The previous priorities of all of the threads are saved in
+// *saved, if given, before any is changed.
+Result khaxBoostThreadPriorities(const Handle *threads, const s32 *priorities, u32 count,
+	KhaxPriorityBoost *saved);
+
+// Put back the priorities saved by khaxBoostThreadPriorities.  The handles must still be open.
+Result khaxRestoreThreadPriorities(const KhaxPriorityBoost *saved);
+
+// Drain the trace records left by libkhax code running at SVC privilege, decoded as text, into a
+// file.  Fails unless libkhax was built with KHAX_DEBUG_TRACE.  Times are in cycles of the core
+// that wrote each record, counted from that core's first record in the drain; they don't compare
+// across cores.  Safe to call while other threads are in libkhax's kernel code: a record still
+// being written ends the drain and is picked up by the next.
+Result khaxTraceWrite(const char *path);
+
+// Time libkhax's internal primitives: cache maintenance, GSPwn under each policy, version lookup,
+// address conversion and svcBackdoor round trips.  Each is warmed up and then run iterations
+// times.  The results are written to a CSV file with a header line, in ticks.  Primitives that
+// need kernel access are skipped before khaxInit has succeeded.  The GSPwn and cache counts in
+// KhaxStats include the benchmark's.
+Result khaxBenchmark(const char *path, u32 iterations);
+
+// Summary of one function timed by khaxBenchmarkFunction, in ticks.
+typedef struct KhaxBenchmarkResult
+{
+	u32 iterations;
+	// What the function returned; the run stops at the first failure, with no times.
+	Result result;
+	u32 minTicks;
+	u32 medianTicks;
+	u32 p99Ticks;
+	u64 meanTicks;
+} KhaxBenchmarkResult;
+
+// Time a function with the harness that khaxBenchmark uses: warmed up, then run iterations
+// times, each timed with svcGetSystemTick.  The function's own result is in summary->result;
+// this fails only for bad arguments or lack of memory.
+Result khaxBenchmarkFunction(Result (*function)(void *context), void *context, u32 iterations,
+	KhaxBenchmarkResult *summary);
+
 #ifdef __cplusplus
 }
 #endif
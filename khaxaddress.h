@@ -0,0 +1,233 @@
+#pragma once
+
+// Translation between user, kernel and physical addresses.  The region table is supplied by the
+// caller, and user-mode lookups go through a function that it supplies, so that this has no
+// dependency on ctrulib and tools/khaxaddrtest.cpp can exercise it on the host.
+
+#include <stdint.h>
+
+#include <algorithm>
+
+namespace KHAX
+{
+	//------------------------------------------------------------------------------------------------
+	// Translation between address spaces, covering every memory region whose mappings we know
+	// rather than just FCRAM.  Lookups are binary searches over tables sorted at construction.
+	class AddressTranslator
+	{
+	public:
+		// The address spaces.  Same values as KhaxAddressSpace.
+		enum Space : unsigned
+		{
+			USER = 0,
+			KERNEL = 1,
+			PHYSICAL = 2,
+		};
+
+		// One physically contiguous region, and where it is mapped.
+		struct Region
+		{
+			uint32_t m_physicalAddress;
+			uint32_t m_size;
+			uint32_t m_kernelAddress;
+			// Linear user-mode mapping, and how much of the region it covers; zero size if none.
+			uint32_t m_userAddress;
+			uint32_t m_userSize;
+		};
+
+		enum : unsigned { REGION_COUNT = 4 };
+
+		// Converts a user-mode address to physical, or returns 0 if it isn't mapped.
+		typedef uint32_t (*UserToPhysical)(uint32_t address);
+
+		// An empty translator, which converts nothing.
+		AddressTranslator();
+		// Build the lookup tables for a set of regions.
+		AddressTranslator(const Region (&regions)[REGION_COUNT], UserToPhysical userToPhysical);
+
+		// Convert a range of size bytes starting at address.  Returns 0 if the range is not
+		// entirely within one region and its mapping in the target space.  hint is the region
+		// that the previous conversion used, which is checked before searching; it is updated.
+		uint32_t Convert(Space from, Space to, uint32_t address, uint32_t size, const Region *&hint) const;
+
+	private:
+		// Find the region containing a range.  The table is sorted by the address searched.
+		const Region *Find(const unsigned char *table, uint32_t Region::*base, uint32_t address,
+			uint32_t size, const Region *hint) const;
+		// Check that a user-mode range is physically contiguous, given where it starts.
+		bool IsUserRangeContiguous(const Region *region, uint32_t address, uint32_t size,
+			uint32_t physical) const;
+
+		// Granularity of user-mode mappings.
+		enum : uint32_t { PAGE_SIZE = 0x1000 };
+
+		Region m_regions[REGION_COUNT];
+		unsigned m_regionCount;
+		// Indices into m_regions sorted by physical address and by kernel address.  Indices rather
+		// than pointers, so that the object can be copied.
+		unsigned char m_byPhysical[REGION_COUNT];
+		unsigned char m_byKernel[REGION_COUNT];
+		UserToPhysical m_userToPhysical;
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// An empty translator, which converts nothing.
+	inline AddressTranslator::AddressTranslator()
+	:	m_regions(),
+		m_regionCount(0),
+		m_byPhysical(),
+		m_byKernel(),
+		m_userToPhysical(nullptr)
+	{
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Build the lookup tables for a set of regions.
+	inline AddressTranslator::AddressTranslator(const Region (&regions)[REGION_COUNT],
+		UserToPhysical userToPhysical)
+	:	m_regionCount(REGION_COUNT),
+		m_userToPhysical(userToPhysical)
+	{
+		for (unsigned x = 0; x < REGION_COUNT; ++x)
+		{
+			m_regions[x] = regions[x];
+			m_byPhysical[x] = static_cast<unsigned char>(x);
+			m_byKernel[x] = static_cast<unsigned char>(x);
+		}
+
+		std::sort(m_byPhysical, m_byPhysical + REGION_COUNT, [this](unsigned left, unsigned right)
+			{ return m_regions[left].m_physicalAddress < m_regions[right].m_physicalAddress; });
+		std::sort(m_byKernel, m_byKernel + REGION_COUNT, [this](unsigned left, unsigned right)
+			{ return m_regions[left].m_kernelAddress < m_regions[right].m_kernelAddress; });
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Convert a range of size bytes starting at address.
+	inline uint32_t AddressTranslator::Convert(Space from, Space to, uint32_t address, uint32_t size,
+		const Region *&hint) const
+	{
+		// A zero-sized range still has to have a valid start.
+		if (size == 0)
+		{
+			size = 1;
+		}
+		if (address + (size - 1) < address)
+		{
+			return 0;
+		}
+
+		// Get to a physical address and its region first.
+		uint32_t physical;
+		const Region *region;
+		switch (from)
+		{
+			case USER:
+				physical = m_userToPhysical ? m_userToPhysical(address) : 0;
+				if (physical == 0)
+				{
+					return 0;
+				}
+				region = Find(m_byPhysical, &Region::m_physicalAddress, physical, size, hint);
+				if (region && !IsUserRangeContiguous(region, address, size, physical))
+				{
+					return 0;
+				}
+				break;
+
+			case KERNEL:
+				region = Find(m_byKernel, &Region::m_kernelAddress, address, size, hint);
+				physical = region ? region->m_physicalAddress + (address - region->m_kernelAddress) : 0;
+				break;
+
+			case PHYSICAL:
+				physical = address;
+				region = Find(m_byPhysical, &Region::m_physicalAddress, physical, size, hint);
+				break;
+
+			default:
+				return 0;
+		}
+
+		if (!region)
+		{
+			return 0;
+		}
+		hint = region;
+
+		uint32_t offset = physical - region->m_physicalAddress;
+		switch (to)
+		{
+			case USER:
+				if ((size > region->m_userSize) || (offset > region->m_userSize - size))
+				{
+					return 0;
+				}
+				return region->m_userAddress + offset;
+
+			case KERNEL:
+				return region->m_kernelAddress + offset;
+
+			case PHYSICAL:
+				return physical;
+
+			default:
+				return 0;
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Find the region containing a range.
+	inline const AddressTranslator::Region *AddressTranslator::Find(const unsigned char *table,
+		uint32_t Region::*base, uint32_t address, uint32_t size, const Region *hint) const
+	{
+		auto contains = [&](const Region *region)
+		{
+			uint32_t offset = address - region->*base;
+			return (address >= region->*base) && (size <= region->m_size) && (offset <= region->m_size - size);
+		};
+
+		// Batches tend to stay within one region.
+		if (hint && contains(hint))
+		{
+			return hint;
+		}
+
+		// Last region starting at or below the address.
+		const unsigned char *end = table + m_regionCount;
+		const unsigned char *found = std::upper_bound(table, end, address,
+			[this, base](uint32_t value, unsigned index) { return value < m_regions[index].*base; });
+		if (found == table)
+		{
+			return nullptr;
+		}
+
+		const Region *region = &m_regions[found[-1]];
+		return contains(region) ? region : nullptr;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Check that a user-mode range is physically contiguous, given where it starts.  Within the
+	// region's own linear mapping that holds by construction.  Anywhere else, such as the normal
+	// heap, every page boundary that the range crosses has to be checked.
+	inline bool AddressTranslator::IsUserRangeContiguous(const Region *region, uint32_t address,
+		uint32_t size, uint32_t physical) const
+	{
+		uint32_t userOffset = address - region->m_userAddress;
+		if ((address >= region->m_userAddress) && (size <= region->m_userSize) &&
+			(userOffset <= region->m_userSize - size) &&
+			(physical - region->m_physicalAddress == userOffset))
+		{
+			return true;
+		}
+
+		// The loop ends when the next boundary is past the range, including when it wraps.
+		for (uint32_t page = (address | (PAGE_SIZE - 1)) + 1; page - address < size; page += PAGE_SIZE)
+		{
+			if (m_userToPhysical(page) != physical + (page - address))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+// The timing loop and statistics for khaxBenchmark and khaxBenchmarkFunction.  The clock is a
+// parameter, so that this has no dependency on ctrulib and tools/khaxbenchtest.cpp can check it
+// on the host.
+
+#include <stdint.h>
+
+#include <algorithm>
+
+namespace KHAX
+{
+	//------------------------------------------------------------------------------------------------
+	// Summary statistics of a set of per-iteration timings.
+	class BenchmarkStats
+	{
+	public:
+		// Same fields as KhaxBenchmarkResult's times.
+		struct Summary
+		{
+			uint32_t m_minTicks;
+			uint32_t m_medianTicks;
+			uint32_t m_p99Ticks;
+			uint64_t m_meanTicks;
+		};
+
+		// Summarize count timings, sorting them in place.  count must not be 0.
+		static void Summarize(uint32_t *samples, uint32_t count, Summary *summary);
+		// Index of the median and of the 99th percentile in count sorted timings.  The median of an
+		// even count is the upper of the middle two; the percentile is the nearest rank at or below.
+		static uint32_t MedianIndex(uint32_t count);
+		static uint32_t P99Index(uint32_t count);
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// The timing loop: warm up, then time each iteration on its own.
+	class BenchmarkLoop
+	{
+	public:
+		// Run function, which returns 0 on success, warmup times untimed and then iterations times
+		// timed with clock, and summarize the timings.  samples has room for iterations entries,
+		// which must not be 0.  A failing function stops the run, and its result is returned with
+		// a zeroed summary.
+		template <typename Function, typename Clock>
+		static int32_t Measure(uint32_t *samples, uint32_t iterations, uint32_t warmup, Function function,
+			Clock clock, BenchmarkStats::Summary *summary);
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Summarize count timings, sorting them in place.
+	inline void BenchmarkStats::Summarize(uint32_t *samples, uint32_t count, Summary *summary)
+	{
+		uint64_t total = 0;
+		for (uint32_t x = 0; x < count; ++x)
+		{
+			total += samples[x];
+		}
+
+		std::sort(samples, samples + count);
+		summary->m_minTicks = samples[0];
+		summary->m_medianTicks = samples[MedianIndex(count)];
+		summary->m_p99Ticks = samples[P99Index(count)];
+		summary->m_meanTicks = total / count;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	inline uint32_t BenchmarkStats::MedianIndex(uint32_t count)
+	{
+		return count / 2;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	inline uint32_t BenchmarkStats::P99Index(uint32_t count)
+	{
+		return static_cast<uint32_t>((static_cast<uint64_t>(count) - 1) * 99 / 100);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Run and time a function.
+	template <typename Function, typename Clock>
+	inline int32_t BenchmarkLoop::Measure(uint32_t *samples, uint32_t iterations, uint32_t warmup,
+		Function function, Clock clock, BenchmarkStats::Summary *summary)
+	{
+		*summary = BenchmarkStats::Summary();
+
+		int32_t result = 0;
+		for (uint32_t x = 0; (result == 0) && (x < warmup); ++x)
+		{
+			result = function();
+		}
+
+		for (uint32_t x = 0; (result == 0) && (x < iterations); ++x)
+		{
+			uint64_t start = clock();
+			result = function();
+			samples[x] = static_cast<uint32_t>(clock() - start);
+		}
+
+		if (result == 0)
+		{
+			BenchmarkStats::Summarize(samples, iterations, summary);
+		}
+		return result;
+	}
+}
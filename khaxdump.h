@@ -0,0 +1,40 @@
+#pragma once
+
+// On-disk format of the facts file written next to the KHAX_DEBUG_DUMP_DATA object dumps.  It
+// records values known independently of the dumped objects' layout, so that host tools can find
+// where those values live in the dumps.  Only fixed-width types, like khaxlog.h.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// "KHXF"
+#define KHAX_DUMP_FACTS_MAGIC 0x46584B48u
+#define KHAX_DUMP_FACTS_VERSION 1
+
+// Facts about one set of dumps.  Little-endian, 64 bytes.
+typedef struct KhaxDumpFacts
+{
+	uint32_t magic;                                 // +00 KHAX_DUMP_FACTS_MAGIC
+	uint16_t version;                               // +04 KHAX_DUMP_FACTS_VERSION
+	uint16_t size;                                  // +06 sizeof(KhaxDumpFacts)
+	uint32_t kernelVersion;                         // +08
+	uint8_t new3DS;                                 // +0C
+	uint8_t reserved0D[3];                          // +0D
+	uint32_t processID;                             // +10 svcGetProcessId
+	uint32_t threadID;                              // +14 svcGetThreadId of the khaxInit thread
+	int32_t threadPriority;                         // +18 svcGetThreadPriority of the same
+	uint32_t tlsUserMode;                           // +1C thread local storage of the same
+	uint32_t kprocessAddress;                       // +20 kernel address of the dumped KProcess
+	uint32_t kthreadAddress;                        // +24 kernel address of the dumped KThread
+	uint32_t svcRegisterState;                      // +28 KThread::m_svcRegisterState
+	uint32_t kprocessSize;                          // +2C bytes of KProcess dumped
+	uint32_t kthreadSize;                           // +30 bytes of KThread dumped
+	uint32_t reserved34[3];                         // +34
+} KhaxDumpFacts;
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,133 @@
+#pragma once
+
+// The kernel heap arithmetic behind memchunkhax, and the repairs that undo it.  Kernel memory is
+// described by addresses and offsets rather than pointers, so that this has no dependency on
+// ctrulib and tools/khaxheaptest.cpp can exercise it on the host against a simulated heap.
+
+#include <stdint.h>
+
+namespace KHAX
+{
+	//------------------------------------------------------------------------------------------------
+	// What Step5 does to the kernel's free list, and the writes that put it right again.  Step5
+	// frees the second overwrite page ("left") in front of the free third page ("right"), whose
+	// m_next the exploit has pointed into svcCreateThread.  The fifth page is the free block that
+	// Step4 verified right->m_next really points at.
+	class HeapRepair
+	{
+	public:
+		// The kernel's free block header.  Same layout as MemChunkHax::HeapFreeBlock.
+		enum : uint32_t { FREE_BLOCK_COUNT = 0x00, FREE_BLOCK_NEXT = 0x04, FREE_BLOCK_PREV = 0x08,
+			FREE_BLOCK_SIZE = 0x14 };
+		// Overwrite pages that take part.
+		enum : unsigned { LEFT_PAGE = 1, RIGHT_PAGE = 2, NEXT_PAGE = 4, PAGE_COUNT = 6 };
+
+		// One 32-bit write to kernel memory.
+		struct Write
+		{
+			uint32_t m_address;
+			uint32_t m_value;
+		};
+
+		// One repair: the link at m_offset in m_page's free block gets the kernel address of
+		// m_targetPage's free block.  Once it is done, the corruption level drops by m_weight.
+		struct FixUp
+		{
+			unsigned m_page;
+			uint32_t m_offset;
+			unsigned m_targetPage;
+			int m_weight;
+		};
+
+		// What can be done about a corruption level.
+		enum Plan : unsigned
+		{
+			// Nothing known; the caller has to freeze rather than exit.
+			PLAN_NONE,
+			// The exploit write landed, but the free that coalesces didn't happen (level 2).
+			PLAN_RESTORE_RIGHT,
+			// The coalesce happened, but Step6 didn't get to fix the heap (level 3).  Leaves level 1,
+			// the svcCreateThread patch, for Step6b to undo.
+			PLAN_REPAIR_COALESCE,
+		};
+
+		enum : unsigned { MAX_FIXUPS = 2 };
+
+		// What to store in right's m_next so that the coalesce writes over target.  The kernel
+		// writes to m_prev of the block that m_next points at.
+		static uint32_t ExploitLink(uint32_t target);
+		// The writes the kernel makes when the free block at left absorbs the one after it, given
+		// the two counts and right's m_next.
+		static void Coalesce(uint32_t left, uint32_t leftCount, uint32_t rightCount, uint32_t rightNext,
+			Write (&writes)[3]);
+		// Choose a plan, given m_corrupted and whether the left page is still allocated, that is,
+		// whether the free that coalesces never happened.
+		static Plan Choose(int corrupted, bool leftAllocated);
+		// The repairs for a plan, in the order they must be done.  Returns how many there are.
+		static unsigned FixUps(Plan plan, FixUp (&fixUps)[MAX_FIXUPS]);
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// What to store in right's m_next so that the coalesce writes over target.
+	inline uint32_t HeapRepair::ExploitLink(uint32_t target)
+	{
+		return target - FREE_BLOCK_PREV;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The writes the kernel makes when the free block at left absorbs the one after it.  The
+	// kernel's coalesce seems to be:
+	//
+	// (1)  left->m_count += right->m_count;
+	// (2)  left->m_next = right->m_next;
+	// (3)  right->m_next->m_prev = left;
+	//
+	// (3) is the exploit; (2) copies the exploit's link into left, which is why left needs fixing.
+	inline void HeapRepair::Coalesce(uint32_t left, uint32_t leftCount, uint32_t rightCount, uint32_t rightNext,
+		Write (&writes)[3])
+	{
+		writes[0].m_address = left + FREE_BLOCK_COUNT;
+		writes[0].m_value = leftCount + rightCount;
+		writes[1].m_address = left + FREE_BLOCK_NEXT;
+		writes[1].m_value = rightNext;
+		writes[2].m_address = rightNext + FREE_BLOCK_PREV;
+		writes[2].m_value = left;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Choose a plan.  Any other combination means Step5 stopped somewhere we can't reason about.
+	inline HeapRepair::Plan HeapRepair::Choose(int corrupted, bool leftAllocated)
+	{
+		if ((corrupted == 2) && leftAllocated)
+		{
+			return PLAN_RESTORE_RIGHT;
+		}
+		if ((corrupted == 3) && !leftAllocated)
+		{
+			return PLAN_REPAIR_COALESCE;
+		}
+		return PLAN_NONE;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The repairs for a plan.  Restoring right's m_next undoes both of the exploit's corruptions
+	// at once.  After a coalesce, left's m_next gets what (2) should have copied, then the fifth
+	// page's m_prev gets what (3) should have written.
+	inline unsigned HeapRepair::FixUps(Plan plan, FixUp (&fixUps)[MAX_FIXUPS])
+	{
+		switch (plan)
+		{
+			case PLAN_RESTORE_RIGHT:
+				fixUps[0] = { RIGHT_PAGE, FREE_BLOCK_NEXT, NEXT_PAGE, 2 };
+				return 1;
+
+			case PLAN_REPAIR_COALESCE:
+				fixUps[0] = { LEFT_PAGE, FREE_BLOCK_NEXT, NEXT_PAGE, 1 };
+				fixUps[1] = { NEXT_PAGE, FREE_BLOCK_PREV, LEFT_PAGE, 1 };
+				return 2;
+
+			default:
+				return 0;
+		}
+	}
+}
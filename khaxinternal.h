@@ -1,9 +1,11 @@
 #pragma once
 
+// Diagnostic messages, sent wherever KhaxOptions::logSink says.  Non-debug builds drop the
+// message but keep the console sink's VBlank wait.
 #ifdef KHAX_DEBUG
-	#define KHAX_printf(...) printf(__VA_ARGS__), gspWaitForVBlank(), gfxFlushBuffers(), gfxSwapBuffers()
+	#define KHAX_printf(...) KHAX::LogPrintf(__VA_ARGS__)
 #else
-	#define KHAX_printf(...) gspWaitForVBlank(), gfxFlushBuffers(), gfxSwapBuffers()
+	#define KHAX_printf(...) KHAX::LogPace()
 #endif
 
 // Shut up IntelliSense warnings when using MSVC as an IDE, even though MSVC will obviously never
@@ -19,6 +21,15 @@
 	#define KHAX_ATTRIBUTE(...) __VA_ARGS__
 #endif
 
+// Trace from code running at SVC privilege, which can't use KHAX_printf.  Records go into
+// KHAX::TraceBuffer and are decoded in user mode afterward.  Compiled out unless KHAX_DEBUG_TRACE
+// is defined, in which case the arguments aren't evaluated either.
+#ifdef KHAX_DEBUG_TRACE
+	#define KHAX_trace(event, arg0, arg1) KHAX::TraceBuffer::Add(KHAX::TraceBuffer::event, (arg0), (arg1))
+#else
+	#define KHAX_trace(event, arg0, arg1) static_cast<void>(0)
+#endif
+
 #define KHAX_lengthof(...) (sizeof(__VA_ARGS__) / sizeof((__VA_ARGS__)[0]))
 #define KHAX_UNUSED(...) static_cast<void>(__VA_ARGS__)
 
@@ -70,6 +81,7 @@ namespace KHAX
 	struct KDebugThread;
 	struct KThreadLocalPage;
 	class KCodeSet;
+	class KResourceLimit;
 
 	//------------------------------------------------------------------------------------------------
 	// Unofficial name
@@ -177,6 +189,97 @@ namespace KHAX
 	static_assert(offsetof(KThread, m_svcRegisterState) == 0x088,
 		"KThread isn't the expected layout.");
 
+	//------------------------------------------------------------------------------------------------
+	// Kernel's internal structure of a mutex object.
+	class KMutex : public KSynchronizationObject
+	{
+	public:
+		KMutex *m_prev;                                 // +014
+		KMutex *m_next;                                 // +018
+		u32 m_lockCount;                                // +01C
+		KThread *m_owner;                               // +020
+		//...more...
+	};
+	static_assert(offsetof(KMutex, m_owner) == 0x020,
+		"KMutex isn't the expected layout.");
+
+	//------------------------------------------------------------------------------------------------
+	// One segment of a KCodeSet.
+	struct KCodeSegment
+	{
+		u32 m_address;                                  // +000
+		u32 m_pageCount;                                // +004
+		u32 m_blockCount;                               // +008
+		u32 m_blockListCount;                           // +00C
+		KLinkedListNode *m_blockFirst;                  // +010
+		KLinkedListNode *m_blockLast;                   // +014
+	};
+	static_assert(sizeof(KCodeSegment) == 0x018,
+		"KCodeSegment isn't the expected size.");
+
+	//------------------------------------------------------------------------------------------------
+	// Kernel's internal structure of a process's loaded code.
+	class KCodeSet : public KAutoObject
+	{
+	public:
+		KCodeSegment m_text;                            // +008
+		KCodeSegment m_rodata;                          // +020
+		KCodeSegment m_data;                            // +038
+		u32 m_textPages;                                // +050
+		u32 m_rodataPages;                              // +054
+		u32 m_dataPages;                                // +058
+		char m_processName[8];                          // +05C
+		u32 m_unknown064;                               // +064
+		u64 m_titleID;                                  // +068
+	};
+	static_assert(offsetof(KCodeSet, m_processName) == 0x05C,
+		"KCodeSet isn't the expected layout.");
+	static_assert(sizeof(KCodeSet) == 0x070,
+		"KCodeSet isn't the expected size.");
+
+	//------------------------------------------------------------------------------------------------
+	// Kernel's internal structure of a resource limit object.  Values are indexed by
+	// ResourceLimitType; index 0 is the highest thread priority the process may use.
+	class KResourceLimit : public KAutoObject
+	{
+	public:
+		s32 m_limitValues[10];                          // +008
+		s32 m_currentValues[10];                        // +030
+		//...more...
+	};
+	static_assert(offsetof(KResourceLimit, m_currentValues) == 0x030,
+		"KResourceLimit isn't the expected layout.");
+
+	//------------------------------------------------------------------------------------------------
+	// One slot of a process handle table.  A handle is the slot index in bits 0-14 and the
+	// generation the slot had when the handle was made in bits 15-30.  The slot's own m_info keeps
+	// its current generation in bits 16-31, so the two are compared after different shifts.
+	struct KHandleEntry
+	{
+		u32 m_info;                                     // +000 generation in bits 16-31
+		KAutoObject *m_object;                          // +004 null if the slot is free
+	};
+	static_assert(sizeof(KHandleEntry) == 0x008,
+		"KHandleEntry isn't the expected size.");
+
+	//------------------------------------------------------------------------------------------------
+	// Kernel's internal structure of a process's handle table, embedded in KProcess.  m_table
+	// points to m_internalTable unless the process was given more than 0x28 handles.
+	class KProcessHandleTable
+	{
+	public:
+		KHandleEntry *m_table;                          // +000
+		s16 m_maxHandleCount;                           // +004
+		s16 m_highestHandleCount;                       // +006
+		KHandleEntry *m_nextFree;                       // +008
+		s16 m_totalHandles;                             // +00C
+		s16 m_handleCount;                              // +00E
+		u32 m_mutex[2];                                 // +010 KLightMutex; owner first
+		KHandleEntry m_internalTable[0x28];             // +018
+	};
+	static_assert(sizeof(KProcessHandleTable) == 0x158,
+		"KProcessHandleTable isn't the expected size.");
+
 	//------------------------------------------------------------------------------------------------
 	// Kernel's internal structure of a process object.
 	// Version 1.0.0(?) - 7.2.0
@@ -208,7 +311,7 @@ namespace KHAX
 		u32 m_unknown068;                               // +068
 		s32 m_idealProcessor;                           // +06C
 		u32 m_unknown070;                               // +070
-		void *m_resourceLimits;                         // +074
+		KResourceLimit *m_resourceLimits;               // +074
 		u8 m_unknown078;                                // +078
 		u8 m_affinityMask;                              // +079
 		u32 m_threadCount;                              // +07C
@@ -222,8 +325,12 @@ namespace KHAX
 		u32 m_kernelFlags2;                             // +0B0
 		u32 m_unknown0B4;                               // +0B4
 		KThread *m_mainThread;                          // +0B8
+		u32 m_interruptEnabledFlags[0x80 / 32];         // +0BC
+		KProcessHandleTable m_handleTable;              // +0CC
 		//...more...
 	};
+	static_assert(offsetof(KProcess_1_0_0_Old, m_handleTable) == 0x0CC,
+		"KProcess_1_0_0_Old isn't the expected layout.");
 	static_assert(offsetof(KProcess_1_0_0_Old, m_svcAccessControl) == 0x080,
 		"KProcess_1_0_0_Old isn't the expected layout.");
 
@@ -260,7 +367,7 @@ namespace KHAX
 		u32 m_unknown070;                               // +070
 		s32 m_idealProcessor;                           // +074
 		u32 m_unknown078;                               // +078
-		void *m_resourceLimits;                         // +07C
+		KResourceLimit *m_resourceLimits;               // +07C
 		u32 m_unknown080;                               // +080
 		u32 m_threadCount;                              // +084
 		u8 m_svcAccessControl[0x80 / 8];                // +088
@@ -273,8 +380,12 @@ namespace KHAX
 		u32 m_unknown0B8;                               // +0B8
 		u32 m_unknown0BC;                               // +0BC
 		KThread *m_mainThread;                          // +0C0
+		u32 m_interruptEnabledFlags[0x80 / 32];         // +0C4
+		KProcessHandleTable m_handleTable;              // +0D4
 		//...more...
 	};
+	static_assert(offsetof(KProcess_8_0_0_Old, m_handleTable) == 0x0D4,
+		"KProcess_8_0_0_Old isn't the expected layout.");
 	static_assert(offsetof(KProcess_8_0_0_Old, m_svcAccessControl) == 0x088,
 		"KProcess_8_0_0_Old isn't the expected layout.");
 
@@ -313,7 +424,7 @@ namespace KHAX
 		u32 m_unknown078;                               // +078
 		s32 m_idealProcessor;                           // +07C
 		u32 m_unknown080;                               // +080
-		void *m_resourceLimits;                         // +084
+		KResourceLimit *m_resourceLimits;               // +084
 		u32 m_unknown088;                               // +088
 		u32 m_threadCount;                              // +08C
 		u8 m_svcAccessControl[0x80 / 8];                // +090
@@ -326,8 +437,12 @@ namespace KHAX
 		u32 m_unknown0C0;                               // +0C0
 		u32 m_unknown0C4;                               // +0C4
 		KThread *m_mainThread;                          // +0C8
+		u32 m_interruptEnabledFlags[0x80 / 32];         // +0CC
+		KProcessHandleTable m_handleTable;              // +0DC
 		//...more...
 	};
+	static_assert(offsetof(KProcess_8_0_0_New, m_handleTable) == 0x0DC,
+		"KProcess_8_0_0_New isn't the expected layout.");
 	static_assert(offsetof(KProcess_8_0_0_New, m_svcAccessControl) == 0x090,
 		"KProcess_8_0_0_New isn't the expected layout.");
 
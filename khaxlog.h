@@ -0,0 +1,51 @@
+#pragma once
+
+// On-disk format of the khaxInit attempt log.  The log is a sequence of fixed-size records, one
+// appended per attempt.  Only fixed-width types, so that host tools can read logs copied off SD.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// "KHXL"
+#define KHAX_LOG_MAGIC 0x4C58484Bu
+#define KHAX_LOG_VERSION 1
+
+// Values of KhaxLogRecord::failedStep besides the step numbers 1-7.
+#define KHAX_LOG_STEP_NONE 0
+#define KHAX_LOG_STEP_UNKNOWN_VERSION 0xFF
+
+// Values of KhaxLogRecord::layoutCheck.
+#define KHAX_LOG_LAYOUT_OK 0
+#define KHAX_LOG_LAYOUT_NEXT_MISMATCH 1
+#define KHAX_LOG_LAYOUT_PREV_MISMATCH 2
+
+// One khaxInit attempt.  Little-endian, 96 bytes.
+typedef struct KhaxLogRecord
+{
+	uint32_t magic;                                 // +00 KHAX_LOG_MAGIC
+	uint16_t version;                               // +04 KHAX_LOG_VERSION
+	uint16_t size;                                  // +06 sizeof(KhaxLogRecord)
+	uint64_t timestamp;                             // +08 milliseconds since 1900-01-01
+	uint32_t kernelVersion;                         // +10
+	uint32_t firmVersion;                           // +14
+	uint8_t new3DS;                                 // +18
+	uint8_t failedStep;                             // +19 step number, or KHAX_LOG_STEP_*
+	uint8_t layoutCheck;                            // +1A KHAX_LOG_LAYOUT_* from Step4
+	uint8_t reserved1B;                             // +1B
+	int32_t result;                                 // +1C Result returned by khaxInit
+	uint32_t layoutExpected;                        // +20 kernel address Step4 expected
+	uint32_t layoutActual;                          // +24 kernel address Step4 found
+	uint32_t stepTicks[7];                          // +28 time taken by each step
+	uint32_t totalTicks;                            // +44 time taken by the whole attempt
+	uint32_t interruptsOffMaxTicks;                 // +48 in CPU cycles, not system ticks
+	uint32_t gspwnCount;                            // +4C
+	uint32_t layoutAttempts;                        // +50 0 in logs from before retries existed
+	uint32_t reserved54[3];                         // +54
+} KhaxLogRecord;
+
+#ifdef __cplusplus
+}
+#endif
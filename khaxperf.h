@@ -0,0 +1,146 @@
+#pragma once
+
+// The sequence behind khaxEnableNew3DSPerformanceMode: the ptm:sysm calls, and the timing that
+// confirms a clock change.  The service and the clock are reached through functions that the
+// caller supplies, so that this has no dependency on ctrulib and tools/khaxperftest.cpp can run
+// it on the host against a stand-in for ptm:sysm.
+
+#include <stdint.h>
+
+namespace KHAX
+{
+	//------------------------------------------------------------------------------------------------
+	// Switches New 3DS performance mode, and checks that the CPU clock changed.
+	class PerformanceMode
+	{
+	public:
+		// Same values as KHAX_NEW3DS_HIGH_CLOCK and KHAX_NEW3DS_L2_CACHE.
+		enum : uint32_t { HIGH_CLOCK = 1 << 0, L2_CACHE = 1 << 1, ALL_FLAGS = HIGH_CLOCK | L2_CACHE };
+		// Number of spin loop timings taken for one clock measurement.
+		enum : unsigned { SPIN_SAMPLE_COUNT = 8 };
+
+		// What the sequence needs from the system.  Results are 0 on success.
+		struct System
+		{
+			// Open ptm:sysm.
+			int32_t (*m_open)(void *context);
+			// PTMSYSM_ConfigureNew3DSCPU.
+			int32_t (*m_configure)(void *context, uint8_t flags);
+			// Close ptm:sysm.
+			void (*m_close)(void *context);
+			// Time a fixed amount of CPU-bound work once, in system ticks.
+			uint64_t (*m_timeSpin)(void *context);
+			void *m_context;
+		};
+
+		// How the sequence ended.
+		enum Status : unsigned
+		{
+			STATUS_OK,
+			// Unknown flags were given; nothing was done.
+			STATUS_BAD_FLAGS,
+			// Opening or configuring ptm:sysm failed; *serviceResult says why.
+			STATUS_SERVICE_FAILED,
+			// The service accepted the high clock, but the timing didn't speed up.
+			STATUS_NOT_CONFIRMED,
+		};
+
+		// What Enable measured, in system ticks; zero if not measured.
+		struct Measurement
+		{
+			uint64_t m_lowClockTicks;
+			uint64_t m_highClockTicks;
+			int32_t m_serviceResult;
+		};
+
+		// Configure the CPU with flags.  For HIGH_CLOCK, the same work is timed at the low clock
+		// and then at the high clock to confirm the change.
+		static Status Enable(const System &system, uint32_t flags, Measurement *measurement);
+		// Measure the clock: the shortest of SPIN_SAMPLE_COUNT timings.  Being preempted can only
+		// make a timing longer, so the shortest is the one that reflects the clock.
+		static uint64_t MeasureClock(const System &system);
+		// Whether timings show that the high clock took effect.  The system tick runs at 268 MHz
+		// whatever the CPU clock, so 804 MHz should take a third as long; allow for noise by only
+		// asking for half.
+		static bool IsHighClock(uint64_t lowClockTicks, uint64_t highClockTicks);
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Configure the CPU with flags.  The L2 cache can't be checked by timing, so success says
+	// nothing about it beyond the service having accepted the request.
+	inline PerformanceMode::Status PerformanceMode::Enable(const System &system, uint32_t flags,
+		Measurement *measurement)
+	{
+		*measurement = Measurement();
+
+		if (flags & ~static_cast<uint32_t>(ALL_FLAGS))
+		{
+			return STATUS_BAD_FLAGS;
+		}
+
+		if (int32_t result = system.m_open(system.m_context))
+		{
+			measurement->m_serviceResult = result;
+			return STATUS_SERVICE_FAILED;
+		}
+
+		// Drop to the low clock first, keeping the other settings, so that the baseline isn't
+		// taken at whatever clock an earlier call left behind.
+		int32_t result = 0;
+		if (flags & HIGH_CLOCK)
+		{
+			result = system.m_configure(system.m_context, static_cast<uint8_t>(flags & ~HIGH_CLOCK));
+			if (result == 0)
+			{
+				measurement->m_lowClockTicks = MeasureClock(system);
+			}
+		}
+
+		if (result == 0)
+		{
+			result = system.m_configure(system.m_context, static_cast<uint8_t>(flags));
+		}
+
+		system.m_close(system.m_context);
+
+		if (result != 0)
+		{
+			measurement->m_serviceResult = result;
+			return STATUS_SERVICE_FAILED;
+		}
+
+		if (flags & HIGH_CLOCK)
+		{
+			measurement->m_highClockTicks = MeasureClock(system);
+			if (!IsHighClock(measurement->m_lowClockTicks, measurement->m_highClockTicks))
+			{
+				return STATUS_NOT_CONFIRMED;
+			}
+		}
+
+		return STATUS_OK;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Measure the clock: the shortest of SPIN_SAMPLE_COUNT timings.
+	inline uint64_t PerformanceMode::MeasureClock(const System &system)
+	{
+		uint64_t best = ~static_cast<uint64_t>(0);
+		for (unsigned sample = 0; sample < SPIN_SAMPLE_COUNT; ++sample)
+		{
+			uint64_t ticks = system.m_timeSpin(system.m_context);
+			if (ticks < best)
+			{
+				best = ticks;
+			}
+		}
+		return best;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Whether timings show that the high clock took effect.
+	inline bool PerformanceMode::IsHighClock(uint64_t lowClockTicks, uint64_t highClockTicks)
+	{
+		return highClockTicks * 2 <= lowClockTicks;
+	}
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+// Priority arithmetic for khaxBoostThreadPriorities, and where the kernel keeps the fields that it
+// reads and writes.  Works on raw copies of kernel objects rather than on the structures in
+// khaxinternal.h, so that this has no dependency on ctrulib and tools/khaxprioritytest.cpp can
+// exercise it on the host; khaxinit.cpp checks the offsets against those structures.
+
+#include <stdint.h>
+#include <string.h>
+
+namespace KHAX
+{
+	//------------------------------------------------------------------------------------------------
+	// Thread priority rules.  Smaller numbers are higher priorities.
+	class PriorityMath
+	{
+	public:
+		// Range of thread priorities.
+		enum : int32_t { HIGHEST_PRIORITY = 0x00, LOWEST_PRIORITY = 0x3F };
+
+		// KThread: the dynamic priority, which a mutex that the thread holds can raise, and the
+		// base priority, which svcSetThreadPriority sets.
+		enum : uint32_t { KTHREAD_DYNAMIC_PRIORITY = 0x03C, KTHREAD_BASE_PRIORITY = 0x06C };
+		// KResourceLimit: the limit and current values, indexed by ResourceLimitType, and the size
+		// of the whole object.  Index 0 is the highest priority the process may use.
+		enum : uint32_t { RESOURCE_LIMIT_VALUES = 0x008, RESOURCE_LIMIT_CURRENT = 0x030,
+			RESOURCE_LIMIT_SIZE = 0x074 };
+		enum : unsigned { RESOURCE_LIMIT_VALUE_COUNT = 10, PRIORITY_LIMIT = 0 };
+
+		// Check a set of requested priorities.  Returns false if any is out of range; otherwise
+		// *highest gets the highest of them, or LOWEST_PRIORITY if there are none.
+		static bool Validate(const int32_t *priorities, uint32_t count, int32_t *highest);
+		// The priority limit that lets the highest requested priority through: the current limit,
+		// lowered to the request if that is higher.  Never raised, so a lower request changes nothing.
+		static int32_t LiftedLimit(int32_t limit, int32_t highest);
+		// Lift the priority limit in a copy of a KResourceLimit.
+		static void LiftLimit(void *resourceLimit, int32_t highest);
+		// Add to a KResourceLimit the charges that were made against a copy of it while the copy
+		// stood in for it.  before is the copy's current values from when it was made.
+		static void TransferCharges(void *resourceLimit, const void *copy,
+			const int32_t (&before)[RESOURCE_LIMIT_VALUE_COUNT]);
+		// Read a KThread's base and dynamic priorities.
+		static void ReadPriorities(const void *kthread, int32_t *base, int32_t *dynamic);
+		// Whether a thread's priorities show that a request took effect: the base priority is what
+		// was asked for, and the dynamic priority is no lower.
+		static bool IsApplied(int32_t base, int32_t dynamic, int32_t requested);
+
+	private:
+		// Access one s32 field of a raw object.
+		static int32_t Load(const void *object, uint32_t offset);
+		static void Store(void *object, uint32_t offset, int32_t value);
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Check a set of requested priorities.
+	inline bool PriorityMath::Validate(const int32_t *priorities, uint32_t count, int32_t *highest)
+	{
+		int32_t result = LOWEST_PRIORITY;
+		for (uint32_t x = 0; x < count; ++x)
+		{
+			if ((priorities[x] < HIGHEST_PRIORITY) || (priorities[x] > LOWEST_PRIORITY))
+			{
+				return false;
+			}
+			if (priorities[x] < result)
+			{
+				result = priorities[x];
+			}
+		}
+
+		*highest = result;
+		return true;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The priority limit that lets the highest requested priority through.
+	inline int32_t PriorityMath::LiftedLimit(int32_t limit, int32_t highest)
+	{
+		return (highest < limit) ? highest : limit;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Lift the priority limit in a copy of a KResourceLimit.
+	inline void PriorityMath::LiftLimit(void *resourceLimit, int32_t highest)
+	{
+		uint32_t offset = RESOURCE_LIMIT_VALUES + PRIORITY_LIMIT * sizeof(int32_t);
+		Store(resourceLimit, offset, LiftedLimit(Load(resourceLimit, offset), highest));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Add to a KResourceLimit the charges that were made against a copy of it.
+	inline void PriorityMath::TransferCharges(void *resourceLimit, const void *copy,
+		const int32_t (&before)[RESOURCE_LIMIT_VALUE_COUNT])
+	{
+		for (unsigned x = 0; x < RESOURCE_LIMIT_VALUE_COUNT; ++x)
+		{
+			uint32_t offset = RESOURCE_LIMIT_CURRENT + x * sizeof(int32_t);
+			int32_t charged = Load(copy, offset) - before[x];
+			if (charged != 0)
+			{
+				Store(resourceLimit, offset, Load(resourceLimit, offset) + charged);
+			}
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Read a KThread's base and dynamic priorities.
+	inline void PriorityMath::ReadPriorities(const void *kthread, int32_t *base, int32_t *dynamic)
+	{
+		*base = Load(kthread, KTHREAD_BASE_PRIORITY);
+		*dynamic = Load(kthread, KTHREAD_DYNAMIC_PRIORITY);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Whether a thread's priorities show that a request took effect.
+	inline bool PriorityMath::IsApplied(int32_t base, int32_t dynamic, int32_t requested)
+	{
+		return (base == requested) && (dynamic <= requested);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Access one s32 field of a raw object.
+	inline int32_t PriorityMath::Load(const void *object, uint32_t offset)
+	{
+		int32_t value;
+		memcpy(&value, static_cast<const unsigned char *>(object) + offset, sizeof(value));
+		return value;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	inline void PriorityMath::Store(void *object, uint32_t offset, int32_t value)
+	{
+		memcpy(static_cast<unsigned char *>(object) + offset, &value, sizeof(value));
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+// The decisions behind khaxInit's Step4 layout retries: what the layout check records, whether
+// another attempt is allowed, and how each attempt moves the heap.  No dependency on ctrulib, so
+// that tools/khaxretrytest.cpp can run a model of the retry loop on the host.
+
+#include <stdint.h>
+
+#include "khaxlog.h"
+
+namespace KHAX
+{
+	//------------------------------------------------------------------------------------------------
+	// Step4 layout checks and the retries after a mismatch.
+	class LayoutRetry
+	{
+	public:
+		// What the last layout check found, as recorded in KhaxLogRecord.
+		struct Finding
+		{
+			// KHAX_LOG_LAYOUT_*.
+			uint32_t m_check;
+			// Kernel addresses compared; zero when the check passed.
+			uint32_t m_expected;
+			uint32_t m_actual;
+		};
+
+		// Size of a heap page, the unit the spacers grow by.
+		enum : uint32_t { PAGE_SIZE = 0x1000 };
+
+		// Compare one free block link against where it should point.  On a mismatch, *finding
+		// records which check failed and the two addresses, and false is returned.
+		static bool CheckLink(uint32_t check, uint32_t actual, uint32_t expected, Finding *finding);
+		// Forget a finding, before the first attempt and before each retry, so that a mismatch is
+		// only reported if the attempt that ends khaxInit had one.
+		static void Clear(Finding *finding);
+		// Whether another attempt may be made, after attempts attempts so far (counting from 1)
+		// and with retryLimit retries allowed.  Only a layout mismatch is worth retrying.
+		static bool MayRetry(bool mismatch, uint32_t attempts, uint32_t retryLimit);
+		// Size of the spacer allocation held before the given retry (counting from 1): a page more
+		// than before the last, so that each attempt lands somewhere new.  0 if there is no slot
+		// left to track it in, given how many of capacity are taken.
+		static uint32_t SpacerSize(uint32_t retry, unsigned spacerCount, unsigned capacity);
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Compare one free block link against where it should point.
+	inline bool LayoutRetry::CheckLink(uint32_t check, uint32_t actual, uint32_t expected, Finding *finding)
+	{
+		if (actual == expected)
+		{
+			return true;
+		}
+
+		finding->m_check = check;
+		finding->m_expected = expected;
+		finding->m_actual = actual;
+		return false;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Forget a finding.
+	inline void LayoutRetry::Clear(Finding *finding)
+	{
+		finding->m_check = KHAX_LOG_LAYOUT_OK;
+		finding->m_expected = 0;
+		finding->m_actual = 0;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Whether another attempt may be made.
+	inline bool LayoutRetry::MayRetry(bool mismatch, uint32_t attempts, uint32_t retryLimit)
+	{
+		return mismatch && (attempts <= retryLimit);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Size of the spacer allocation held before the given retry.
+	inline uint32_t LayoutRetry::SpacerSize(uint32_t retry, unsigned spacerCount, unsigned capacity)
+	{
+		return (spacerCount < capacity) ? retry * PAGE_SIZE : 0;
+	}
+}
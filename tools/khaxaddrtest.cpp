@@ -0,0 +1,197 @@
+// khaxaddrtest: host tests for KHAX::AddressTranslator (khaxaddress.h).
+//
+// Host tool for Linux.  Build and run with:
+//     g++ -std=c++11 -O2 -o khaxaddrtest khaxaddrtest.cpp && ./khaxaddrtest
+//
+// The region table is the one khaxinit.cpp builds for the 8.0.0 address layout on an Old 3DS.
+// User-mode lookups go through a fake page table: the linear heap and the device regions are
+// mapped linearly, and a small "normal heap" maps its pages out of order, as the kernel's heap
+// does.  Prints each failed check and exits with the number of failures.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "../khaxaddress.h"
+
+namespace
+{
+	using KHAX::AddressTranslator;
+
+	//------------------------------------------------------------------------------------------------
+	// Layout being tested.
+	const uint32_t FCRAM_PHYSICAL = 0x20000000;
+	const uint32_t FCRAM_SIZE = 0x08000000;
+	const uint32_t FCRAM_KERNEL = 0xE0000000;
+	const uint32_t LINEAR_USER = 0x30000000;
+
+	// Fake normal heap: user pages HEAP_USER + n map to physical HEAP_PHYSICAL + s_heapPages[n].
+	const uint32_t HEAP_USER = 0x08000000;
+	const uint32_t HEAP_PHYSICAL = 0x27000000;
+	const uint32_t PAGE_SIZE = 0x1000;
+	const unsigned s_heapPages[] = { 0, 1, 2, 7, 3, 4 };
+
+	const AddressTranslator::Region s_regions[AddressTranslator::REGION_COUNT] =
+	{
+		{ 0x18000000, 0x00600000, FCRAM_KERNEL - 0x08000000, 0x1F000000, 0x00600000 },
+		{ 0x1FF00000, 0x00080000, FCRAM_KERNEL - 0x00100000, 0x1FF00000, 0x00080000 },
+		{ 0x1FF80000, 0x00080000, FCRAM_KERNEL - 0x00080000, 0x1FF80000, 0x00002000 },
+		{ FCRAM_PHYSICAL, FCRAM_SIZE, FCRAM_KERNEL, LINEAR_USER, FCRAM_SIZE },
+	};
+
+	unsigned s_failures = 0;
+
+	//------------------------------------------------------------------------------------------------
+	// The fake user-mode page table.
+	uint32_t UserToPhysical(uint32_t address)
+	{
+		for (const AddressTranslator::Region &region : s_regions)
+		{
+			if ((address >= region.m_userAddress) && (address - region.m_userAddress < region.m_userSize))
+			{
+				return region.m_physicalAddress + (address - region.m_userAddress);
+			}
+		}
+
+		uint32_t page = (address - HEAP_USER) / PAGE_SIZE;
+		if ((address >= HEAP_USER) && (page < sizeof(s_heapPages) / sizeof(s_heapPages[0])))
+		{
+			return HEAP_PHYSICAL + s_heapPages[page] * PAGE_SIZE + (address % PAGE_SIZE);
+		}
+		return 0;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Convert one range with a fresh hint and compare against the expected result.
+	void Check(const AddressTranslator &translator, AddressTranslator::Space from,
+		AddressTranslator::Space to, uint32_t address, uint32_t size, uint32_t expected, int line)
+	{
+		const AddressTranslator::Region *hint = nullptr;
+		uint32_t actual = translator.Convert(from, to, address, size, hint);
+		if (actual != expected)
+		{
+			std::printf("line %d: %u->%u %08X+%X: got %08X, expected %08X\n", line,
+				static_cast<unsigned>(from), static_cast<unsigned>(to), address, size, actual, expected);
+			++s_failures;
+		}
+	}
+
+	#define CHECK(from, to, address, size, expected) \
+		Check(translator, AddressTranslator::from, AddressTranslator::to, address, size, expected, __LINE__)
+
+	//------------------------------------------------------------------------------------------------
+	// First and last bytes of each region, and one past either end.
+	void TestRegionEdges(const AddressTranslator &translator)
+	{
+		CHECK(PHYSICAL, KERNEL, 0x18000000, 1, 0xD8000000);
+		CHECK(PHYSICAL, KERNEL, 0x185FFFFF, 1, 0xD85FFFFF);
+		CHECK(PHYSICAL, KERNEL, 0x17FFFFFF, 1, 0);
+		CHECK(PHYSICAL, KERNEL, 0x18600000, 1, 0);
+
+		CHECK(KERNEL, PHYSICAL, FCRAM_KERNEL, 1, FCRAM_PHYSICAL);
+		CHECK(KERNEL, PHYSICAL, FCRAM_KERNEL + FCRAM_SIZE - 1, 1, FCRAM_PHYSICAL + FCRAM_SIZE - 1);
+		CHECK(KERNEL, PHYSICAL, FCRAM_KERNEL + FCRAM_SIZE, 1, 0);
+		CHECK(KERNEL, PHYSICAL, 0xFFFFFFFF, 1, 0);
+		CHECK(KERNEL, PHYSICAL, 0, 1, 0);
+
+		// The last byte of AXI WRAM is the last byte of the physical address space we know.
+		CHECK(PHYSICAL, KERNEL, 0x1FFFFFFF, 1, 0xDFFFFFFF);
+		CHECK(PHYSICAL, USER, 0x1FF81FFF, 1, 0x1FF81FFF);
+		CHECK(PHYSICAL, USER, 0x1FF82000, 1, 0);
+
+		// Zero-sized ranges convert their start.
+		CHECK(USER, PHYSICAL, LINEAR_USER, 0, FCRAM_PHYSICAL);
+		CHECK(USER, KERNEL, LINEAR_USER + FCRAM_SIZE - 1, 0, FCRAM_KERNEL + FCRAM_SIZE - 1);
+		CHECK(USER, KERNEL, LINEAR_USER + FCRAM_SIZE, 0, 0);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Ranges that don't start or end on any particular boundary.
+	void TestUnaligned(const AddressTranslator &translator)
+	{
+		CHECK(USER, KERNEL, LINEAR_USER + 0x1235, 0x7, FCRAM_KERNEL + 0x1235);
+		CHECK(USER, KERNEL, LINEAR_USER + FCRAM_SIZE - 3, 3, FCRAM_KERNEL + FCRAM_SIZE - 3);
+		CHECK(USER, KERNEL, LINEAR_USER + FCRAM_SIZE - 3, 4, 0);
+		CHECK(KERNEL, USER, FCRAM_KERNEL - 0x00080000 + 0x1FFD, 3, 0x1FF81FFD);
+		CHECK(KERNEL, USER, FCRAM_KERNEL - 0x00080000 + 0x1FFD, 4, 0);
+
+		// Ranges that wrap around the address space.
+		CHECK(KERNEL, PHYSICAL, 0xFFFFFFF0, 0x20, 0);
+		CHECK(PHYSICAL, KERNEL, 0x1FFFFFF0, 0xFFFFFFFF, 0);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Ranges that cross from one region into another, or across user pages.
+	void TestCrossRegion(const AddressTranslator &translator)
+	{
+		// DSP memory and AXI WRAM are adjacent in every space, but are separate regions.
+		CHECK(PHYSICAL, KERNEL, 0x1FF7FFF0, 0x20, 0);
+		CHECK(KERNEL, PHYSICAL, FCRAM_KERNEL - 0x00080010, 0x20, 0);
+		CHECK(USER, PHYSICAL, 0x1FF7FFF0, 0x20, 0);
+
+		// AXI WRAM runs straight into FCRAM's kernel mapping.
+		CHECK(KERNEL, PHYSICAL, FCRAM_KERNEL - 0x10, 0x20, 0);
+
+		// Normal heap: contiguous across the first two page boundaries, not the third.
+		CHECK(USER, PHYSICAL, HEAP_USER + 0x10, 0x2000, HEAP_PHYSICAL + 0x10);
+		CHECK(USER, KERNEL, HEAP_USER + 0x10, 0x2FF0, FCRAM_KERNEL + (HEAP_PHYSICAL - FCRAM_PHYSICAL) + 0x10);
+		CHECK(USER, PHYSICAL, HEAP_USER + 0x10, 0x2FF1, 0);
+		CHECK(USER, PHYSICAL, HEAP_USER + 0x2FFF, 2, 0);
+		// Pages 4 and 5 are contiguous again, but the range also covers page 3.
+		CHECK(USER, PHYSICAL, HEAP_USER + 0x3000, 0x3000, 0);
+		CHECK(USER, PHYSICAL, HEAP_USER + 0x4000, 0x2000, HEAP_PHYSICAL + 0x3000);
+		// Running off the end of the heap.
+		CHECK(USER, PHYSICAL, HEAP_USER + 0x5FFF, 2, 0);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The hint is only a shortcut: a stale one mustn't change the answer.
+	void TestHint(const AddressTranslator &translator)
+	{
+		const AddressTranslator::Region *hint = nullptr;
+		uint32_t first = translator.Convert(AddressTranslator::PHYSICAL, AddressTranslator::KERNEL,
+			0x18000000, 0x10, hint);
+		uint32_t second = translator.Convert(AddressTranslator::PHYSICAL, AddressTranslator::KERNEL,
+			FCRAM_PHYSICAL, 0x10, hint);
+		uint32_t third = translator.Convert(AddressTranslator::PHYSICAL, AddressTranslator::KERNEL,
+			0x1FF00000, 0x10, hint);
+		if ((first != 0xD8000000) || (second != FCRAM_KERNEL) || (third != FCRAM_KERNEL - 0x00100000))
+		{
+			std::printf("hint: got %08X %08X %08X\n", first, second, third);
+			++s_failures;
+		}
+
+		// Copies are independent of the original.
+		AddressTranslator copy = translator;
+		hint = nullptr;
+		if (copy.Convert(AddressTranslator::KERNEL, AddressTranslator::PHYSICAL, FCRAM_KERNEL, 1, hint) !=
+			FCRAM_PHYSICAL)
+		{
+			std::printf("copy: conversion failed\n");
+			++s_failures;
+		}
+
+		// An empty translator converts nothing.
+		AddressTranslator empty;
+		hint = nullptr;
+		if (empty.Convert(AddressTranslator::PHYSICAL, AddressTranslator::KERNEL, FCRAM_PHYSICAL, 1, hint) != 0)
+		{
+			std::printf("empty: converted something\n");
+			++s_failures;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+int main()
+{
+	AddressTranslator translator(s_regions, UserToPhysical);
+
+	TestRegionEdges(translator);
+	TestUnaligned(translator);
+	TestCrossRegion(translator);
+	TestHint(translator);
+
+	std::printf("%u failure%s\n", s_failures, (s_failures == 1) ? "" : "s");
+	return static_cast<int>(s_failures);
+}
@@ -0,0 +1,204 @@
+// khaxbenchtest: host tests for KHAX::BenchmarkStats and KHAX::BenchmarkLoop (khaxbench.h).
+//
+// Host tool for Linux.  Build and run with:
+//     g++ -std=c++11 -O2 -o khaxbenchtest khaxbenchtest.cpp && ./khaxbenchtest
+//
+// Timings are made up to put known values at the ranks that the summary reads, and given out of
+// order, since the harness records them in the order they were taken.  The loop is run against a
+// fake clock that only moves when the function under test says so.  Prints each failed check and
+// exits with the number of failures.
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "../khaxbench.h"
+
+namespace
+{
+	using KHAX::BenchmarkLoop;
+	using KHAX::BenchmarkStats;
+
+	unsigned s_failures = 0;
+
+	#define EXPECT(condition) \
+		((condition) ? (void) 0 : (std::printf("line %d: %s\n", __LINE__, #condition), (void) ++s_failures))
+
+	//------------------------------------------------------------------------------------------------
+	// Summarize a copy of some timings and compare against the expected summary.
+	void Check(std::vector<uint32_t> samples, uint32_t min, uint32_t median, uint32_t p99, uint64_t mean,
+		int line)
+	{
+		BenchmarkStats::Summary summary;
+		BenchmarkStats::Summarize(samples.data(), static_cast<uint32_t>(samples.size()), &summary);
+		if ((summary.m_minTicks != min) || (summary.m_medianTicks != median) || (summary.m_p99Ticks != p99) ||
+			(summary.m_meanTicks != mean))
+		{
+			std::printf("line %d: got %u/%u/%u/%llu, expected %u/%u/%u/%llu\n", line, summary.m_minTicks,
+				summary.m_medianTicks, summary.m_p99Ticks, static_cast<unsigned long long>(summary.m_meanTicks),
+				min, median, p99, static_cast<unsigned long long>(mean));
+			++s_failures;
+		}
+	}
+
+	#define CHECK(samples, min, median, p99, mean) Check(samples, min, median, p99, mean, __LINE__)
+
+	//------------------------------------------------------------------------------------------------
+	// Timings 1 to count in a scrambled order.
+	std::vector<uint32_t> Ramp(uint32_t count)
+	{
+		std::vector<uint32_t> samples(count);
+		for (uint32_t x = 0; x < count; ++x)
+		{
+			samples[(x * 7919) % count] = x + 1;
+		}
+		return samples;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Where the median and the percentile fall for the iteration counts the demo and the CSV use.
+	void TestRanks()
+	{
+		EXPECT(BenchmarkStats::MedianIndex(1) == 0);
+		EXPECT(BenchmarkStats::MedianIndex(2) == 1);
+		EXPECT(BenchmarkStats::MedianIndex(5) == 2);
+		EXPECT(BenchmarkStats::MedianIndex(1000) == 500);
+
+		EXPECT(BenchmarkStats::P99Index(1) == 0);
+		EXPECT(BenchmarkStats::P99Index(10) == 8);
+		EXPECT(BenchmarkStats::P99Index(100) == 98);
+		EXPECT(BenchmarkStats::P99Index(101) == 99);
+		EXPECT(BenchmarkStats::P99Index(1000) == 989);
+		// No overflow in the multiplication for large runs.
+		EXPECT(BenchmarkStats::P99Index(0xFFFFFFFF) == 0xFD70A3D5);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Summaries of small and ordinary runs.
+	void TestSummaries()
+	{
+		CHECK(std::vector<uint32_t>({ 42 }), 42, 42, 42, 42);
+		CHECK(std::vector<uint32_t>({ 9, 3 }), 3, 9, 3, 6);
+		CHECK(std::vector<uint32_t>({ 5, 1, 4, 2, 3 }), 1, 3, 4, 3);
+		CHECK(Ramp(100), 1, 51, 99, 50);
+		CHECK(Ramp(1000), 1, 501, 990, 500);
+
+		// One slow iteration moves the mean, not the median or the percentile.
+		std::vector<uint32_t> spike = Ramp(1000);
+		for (uint32_t &sample : spike)
+		{
+			sample = (sample == 1000) ? 1000000 : sample;
+		}
+		CHECK(spike, 1, 501, 990, (1000 * 1001 / 2 - 1000 + 1000000) / 1000);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The mean is taken over 64 bits: a run of long timings doesn't wrap.
+	void TestLongTimings()
+	{
+		std::vector<uint32_t> samples(16, 0xF0000000u);
+		samples[5] = 0xFFFFFFFFu;
+		CHECK(samples, 0xF0000000u, 0xF0000000u, 0xF0000000u,
+			(15 * static_cast<uint64_t>(0xF0000000u) + 0xFFFFFFFFu) / 16);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The timings are sorted in place, keeping the same values.
+	void TestSortsInPlace()
+	{
+		uint32_t samples[] = { 30, 10, 20 };
+		BenchmarkStats::Summary summary;
+		BenchmarkStats::Summarize(samples, 3, &summary);
+		EXPECT((samples[0] == 10) && (samples[1] == 20) && (samples[2] == 30));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Function under test for the loop, and the fake clock it drives.
+	struct FakeWork
+	{
+		// Ticks each call takes, by call number, repeating; and the call that fails, if any.
+		std::vector<uint64_t> m_costs;
+		uint32_t m_failingCall;
+		uint64_t m_now;
+		uint32_t m_calls;
+		uint32_t m_clockReads;
+
+		FakeWork(std::vector<uint64_t> costs, uint32_t failingCall = 0xFFFFFFFF)
+		:	m_costs(costs),
+			m_failingCall(failingCall),
+			m_now(1000),
+			m_calls(0),
+			m_clockReads(0)
+		{
+		}
+
+		int32_t Run(uint32_t iterations, uint32_t warmup, uint32_t *samples, BenchmarkStats::Summary *summary)
+		{
+			return BenchmarkLoop::Measure(samples, iterations, warmup,
+				[this]() -> int32_t
+				{
+					uint32_t call = m_calls++;
+					m_now += m_costs[call % m_costs.size()];
+					return (call == m_failingCall) ? static_cast<int32_t>(0xD8E007F7) : 0;
+				},
+				[this]() { ++m_clockReads; return m_now; },
+				summary);
+		}
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Warm-up calls are made but not timed, and each timed call is bracketed by two clock reads.
+	void TestLoop()
+	{
+		// The warm-up calls are the expensive ones; none of them may show up in the timings.
+		FakeWork work({ 500, 500, 10, 30, 20, 40 });
+		uint32_t samples[4];
+		BenchmarkStats::Summary summary;
+		int32_t result = work.Run(4, 2, samples, &summary);
+
+		EXPECT(result == 0);
+		EXPECT(work.m_calls == 6);
+		EXPECT(work.m_clockReads == 8);
+		EXPECT((summary.m_minTicks == 10) && (summary.m_medianTicks == 30) && (summary.m_p99Ticks == 30));
+		EXPECT(summary.m_meanTicks == 25);
+
+		// No warm-up at all.
+		FakeWork cold({ 7 });
+		EXPECT((cold.Run(3, 0, samples, &summary) == 0) && (cold.m_calls == 3) && (summary.m_meanTicks == 7));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// A failure stops the run straight away and leaves no times behind.
+	void TestLoopFailure()
+	{
+		uint32_t samples[8];
+		BenchmarkStats::Summary summary;
+
+		// In the warm-up: nothing is timed.
+		FakeWork warmup({ 5 }, 1);
+		EXPECT(warmup.Run(8, 4, samples, &summary) == static_cast<int32_t>(0xD8E007F7));
+		EXPECT((warmup.m_calls == 2) && (warmup.m_clockReads == 0));
+		EXPECT((summary.m_minTicks == 0) && (summary.m_medianTicks == 0) && (summary.m_p99Ticks == 0) &&
+			(summary.m_meanTicks == 0));
+
+		// In the timed run.
+		FakeWork timed({ 5 }, 6);
+		EXPECT(timed.Run(8, 4, samples, &summary) == static_cast<int32_t>(0xD8E007F7));
+		EXPECT((timed.m_calls == 7) && (timed.m_clockReads == 6));
+		EXPECT((summary.m_minTicks == 0) && (summary.m_meanTicks == 0));
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+int main()
+{
+	TestRanks();
+	TestSummaries();
+	TestLongTimings();
+	TestSortsInPlace();
+	TestLoop();
+	TestLoopFailure();
+
+	std::printf("%u failure%s\n", s_failures, (s_failures == 1) ? "" : "s");
+	return static_cast<int>(s_failures);
+}
@@ -0,0 +1,236 @@
+// khaxheaptest: host tests for KHAX::HeapRepair (khaxheap.h).
+//
+// Host tool for Linux.  Build and run with:
+//     g++ -std=c++11 -O2 -o khaxheaptest khaxheaptest.cpp && ./khaxheaptest
+//
+// The kernel heap is simulated as a map of 32-bit words.  The overwrite pages sit at consecutive
+// kernel addresses, with the second page allocated and the third and fifth free and linked, as
+// Step4 leaves them.  Each test corrupts the heap the way Step5 does when it stops at a given
+// point, applies the repairs HeapRepair chooses, and compares the result against what the kernel
+// would have done without the exploit.  Prints each failed check and exits with the number of
+// failures.
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+
+#include "../khaxheap.h"
+
+namespace
+{
+	using KHAX::HeapRepair;
+
+	typedef std::map<uint32_t, uint32_t> Memory;
+
+	//------------------------------------------------------------------------------------------------
+	// Layout being tested.
+	const uint32_t PAGES_KERNEL = 0xE7F40000;
+	const uint32_t PAGE_SIZE = 0x1000;
+	// Where Step5 aims the coalesce's stray write: svcCreateThread's patch location.
+	const uint32_t PATCH_TARGET = 0xFFF07DD4;
+	const uint32_t PATCH_ORIGINAL = 0xE3A00000;
+	// The free blocks on either side of the pages in the free list.
+	const uint32_t PREVIOUS_BLOCK = 0xE7E00000;
+	const uint32_t FOLLOWING_BLOCK = 0xE7F80000;
+
+	unsigned s_failures = 0;
+
+	#define EXPECT(condition) \
+		((condition) ? (void) 0 : (std::printf("line %d: %s\n", __LINE__, #condition), (void) ++s_failures))
+
+	//------------------------------------------------------------------------------------------------
+	// Kernel address of an overwrite page's free block.
+	uint32_t Block(unsigned page)
+	{
+		return PAGES_KERNEL + page * PAGE_SIZE;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Heap as Step4 leaves it.
+	Memory InitialHeap()
+	{
+		Memory memory;
+		memory[PATCH_TARGET] = PATCH_ORIGINAL;
+
+		const uint32_t right = Block(HeapRepair::RIGHT_PAGE);
+		const uint32_t next = Block(HeapRepair::NEXT_PAGE);
+		memory[right + HeapRepair::FREE_BLOCK_COUNT] = 1;
+		memory[right + HeapRepair::FREE_BLOCK_NEXT] = next;
+		memory[right + HeapRepair::FREE_BLOCK_PREV] = PREVIOUS_BLOCK;
+		memory[next + HeapRepair::FREE_BLOCK_COUNT] = 1;
+		memory[next + HeapRepair::FREE_BLOCK_NEXT] = FOLLOWING_BLOCK;
+		memory[next + HeapRepair::FREE_BLOCK_PREV] = right;
+		return memory;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Free the second page: the kernel gives it a one-page free block, then merges the third page
+	// into it.
+	void FreeLeft(Memory &memory)
+	{
+		const uint32_t left = Block(HeapRepair::LEFT_PAGE);
+		const uint32_t right = Block(HeapRepair::RIGHT_PAGE);
+		memory[left + HeapRepair::FREE_BLOCK_COUNT] = 1;
+		memory[left + HeapRepair::FREE_BLOCK_PREV] = memory[right + HeapRepair::FREE_BLOCK_PREV];
+
+		HeapRepair::Write writes[3];
+		HeapRepair::Coalesce(left, memory[left + HeapRepair::FREE_BLOCK_COUNT],
+			memory[right + HeapRepair::FREE_BLOCK_COUNT], memory[right + HeapRepair::FREE_BLOCK_NEXT], writes);
+		for (const HeapRepair::Write &write : writes)
+		{
+			memory[write.m_address] = write.m_value;
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Step5's GSPwn: point right's m_next so that the coalesce writes over the patch target.
+	void Exploit(Memory &memory)
+	{
+		memory[Block(HeapRepair::RIGHT_PAGE) + HeapRepair::FREE_BLOCK_NEXT] = HeapRepair::ExploitLink(PATCH_TARGET);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Apply the repairs for a plan, returning the corruption level left.
+	int Repair(Memory &memory, HeapRepair::Plan plan, int corrupted)
+	{
+		HeapRepair::FixUp fixUps[HeapRepair::MAX_FIXUPS];
+		unsigned count = HeapRepair::FixUps(plan, fixUps);
+		for (unsigned x = 0; x < count; ++x)
+		{
+			memory[Block(fixUps[x].m_page) + fixUps[x].m_offset] = Block(fixUps[x].m_targetPage);
+			corrupted -= fixUps[x].m_weight;
+		}
+		return corrupted;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Compare two heaps word by word, ignoring one address.
+	void CompareHeaps(const Memory &actual, const Memory &expected, uint32_t ignore, const char *what)
+	{
+		for (const Memory::value_type &word : expected)
+		{
+			if (word.first == ignore)
+			{
+				continue;
+			}
+			Memory::const_iterator found = actual.find(word.first);
+			uint32_t value = (found != actual.end()) ? found->second : 0;
+			if (value != word.second)
+			{
+				std::printf("%s: %08X is %08X, expected %08X\n", what, word.first, value, word.second);
+				++s_failures;
+			}
+		}
+		for (const Memory::value_type &word : actual)
+		{
+			if ((word.first != ignore) && (expected.find(word.first) == expected.end()))
+			{
+				std::printf("%s: stray write to %08X\n", what, word.first);
+				++s_failures;
+			}
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The exploit's arithmetic: the coalesce's third write lands exactly on the patch target.
+	void TestCoalesce()
+	{
+		const uint32_t left = Block(HeapRepair::LEFT_PAGE);
+		HeapRepair::Write writes[3];
+		HeapRepair::Coalesce(left, 3, 5, HeapRepair::ExploitLink(PATCH_TARGET), writes);
+
+		EXPECT((writes[0].m_address == left + HeapRepair::FREE_BLOCK_COUNT) && (writes[0].m_value == 8));
+		EXPECT((writes[1].m_address == left + HeapRepair::FREE_BLOCK_NEXT) &&
+			(writes[1].m_value == PATCH_TARGET - HeapRepair::FREE_BLOCK_PREV));
+		EXPECT((writes[2].m_address == PATCH_TARGET) && (writes[2].m_value == left));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Only the two states that Step5 can stop in with a known heap have a plan.
+	void TestChoose()
+	{
+		EXPECT(HeapRepair::Choose(2, true) == HeapRepair::PLAN_RESTORE_RIGHT);
+		EXPECT(HeapRepair::Choose(3, false) == HeapRepair::PLAN_REPAIR_COALESCE);
+
+		EXPECT(HeapRepair::Choose(0, true) == HeapRepair::PLAN_NONE);
+		EXPECT(HeapRepair::Choose(1, false) == HeapRepair::PLAN_NONE);
+		// The free reported success but the level didn't move, or the other way around.
+		EXPECT(HeapRepair::Choose(2, false) == HeapRepair::PLAN_NONE);
+		EXPECT(HeapRepair::Choose(3, true) == HeapRepair::PLAN_NONE);
+		EXPECT(HeapRepair::Choose(4, false) == HeapRepair::PLAN_NONE);
+
+		HeapRepair::FixUp fixUps[HeapRepair::MAX_FIXUPS];
+		EXPECT(HeapRepair::FixUps(HeapRepair::PLAN_NONE, fixUps) == 0);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// m_corrupted == 2: the exploit write landed, and the free failed.  Recovery puts the heap back
+	// exactly as Step4 left it.
+	void TestRestoreRight()
+	{
+		Memory memory = InitialHeap();
+		const Memory before = memory;
+		Exploit(memory);
+
+		HeapRepair::Plan plan = HeapRepair::Choose(2, true);
+		int left = Repair(memory, plan, 2);
+		EXPECT(left == 0);
+		CompareHeaps(memory, before, 0, "restore");
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// m_corrupted == 3: the coalesce happened and patched the target.  Recovery makes the heap what
+	// a clean coalesce would have, and leaves one level, the patch, for Step6b.
+	void TestRepairCoalesce()
+	{
+		Memory clean = InitialHeap();
+		FreeLeft(clean);
+
+		Memory memory = InitialHeap();
+		Exploit(memory);
+		FreeLeft(memory);
+		EXPECT(memory[PATCH_TARGET] == Block(HeapRepair::LEFT_PAGE));
+
+		HeapRepair::Plan plan = HeapRepair::Choose(3, false);
+		int left = Repair(memory, plan, 3);
+		EXPECT(left == 1);
+
+		// Right's header is inside the merged block now, and the kernel never reads it again; it
+		// still holds the exploit's link.
+		for (uint32_t offset = 0; offset < HeapRepair::FREE_BLOCK_SIZE; offset += sizeof(uint32_t))
+		{
+			memory.erase(Block(HeapRepair::RIGHT_PAGE) + offset);
+			clean.erase(Block(HeapRepair::RIGHT_PAGE) + offset);
+		}
+		CompareHeaps(memory, clean, PATCH_TARGET, "repair");
+
+		// The clean heap links left straight to the fifth page.
+		EXPECT(clean[Block(HeapRepair::LEFT_PAGE) + HeapRepair::FREE_BLOCK_NEXT] == Block(HeapRepair::NEXT_PAGE));
+		EXPECT(clean[Block(HeapRepair::NEXT_PAGE) + HeapRepair::FREE_BLOCK_PREV] == Block(HeapRepair::LEFT_PAGE));
+		EXPECT(clean[Block(HeapRepair::LEFT_PAGE) + HeapRepair::FREE_BLOCK_COUNT] == 2);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Step6d makes the same repairs from SVC mode, in the same order: left's link first.
+	void TestRepairOrder()
+	{
+		HeapRepair::FixUp fixUps[HeapRepair::MAX_FIXUPS];
+		unsigned count = HeapRepair::FixUps(HeapRepair::PLAN_REPAIR_COALESCE, fixUps);
+		EXPECT(count == 2);
+		EXPECT((fixUps[0].m_page == HeapRepair::LEFT_PAGE) && (fixUps[0].m_offset == HeapRepair::FREE_BLOCK_NEXT));
+		EXPECT((fixUps[1].m_page == HeapRepair::NEXT_PAGE) && (fixUps[1].m_offset == HeapRepair::FREE_BLOCK_PREV));
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+int main()
+{
+	TestCoalesce();
+	TestChoose();
+	TestRestoreRight();
+	TestRepairCoalesce();
+	TestRepairOrder();
+
+	std::printf("%u failure%s\n", s_failures, (s_failures == 1) ? "" : "s");
+	return static_cast<int>(s_failures);
+}
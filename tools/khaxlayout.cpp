@@ -0,0 +1,575 @@
+// khaxlayout: infer kernel object layouts from KHAX_DEBUG_DUMP_DATA dumps of many units.
+//
+// Host tool for Linux.  Build with:
+//     g++ -std=c++11 -O3 -o khaxlayout khaxlayout.cpp
+// Usage:
+//     khaxlayout [-t threadCount] dumpdir1 dumpdir2 ...
+//
+// Each directory holds what one unit wrote to SD: KProcess-, KThread- and Facts- files for each
+// kernel version it ran on (see khaxdump.h).  Dumps are grouped by kernel version and Old/New
+// 3DS.  Within a group, every offset is compared against the values the facts file knows
+// independently of the layout (process ID, thread ID, kernel addresses and so on), and each word
+// is classified across all dumps: zero, constant, kernel pointer, pointer into the object itself
+// or varying.  A count followed by two kernel pointers is taken as a linked list.  -t gives the
+// thread count of the process that was dumped, if known, since the facts file can't.
+//
+// Each group gets a candidate class in khaxinternal.h style with static_asserts on the fields
+// that were identified, followed by a table of where those fields sit in each group.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+
+#include "../khaxdump.h"
+
+static_assert(sizeof(KhaxDumpFacts) == 0x40, "KhaxDumpFacts isn't the expected size.");
+
+namespace
+{
+	//------------------------------------------------------------------------------------------------
+	// Both dumped objects derive from KSynchronizationObject, whose 0x14 bytes aren't inferred.
+	const std::size_t BASE_SIZE = 0x14;
+	// Lowest address treated as a kernel pointer.  Covers the kernel heap on all versions.
+	const std::uint32_t KERNEL_POINTER_MIN = 0xD0000000u;
+	// Largest value treated as an element count in front of a list.
+	const std::uint32_t LIST_COUNT_MAX = 0x10000u;
+
+	enum ObjectKind
+	{
+		OBJECT_KPROCESS,
+		OBJECT_KTHREAD,
+		OBJECT_COUNT,
+	};
+
+	const char *const s_objectNames[OBJECT_COUNT] = { "KProcess", "KThread" };
+
+	//------------------------------------------------------------------------------------------------
+	// One unit's dumps for one kernel version.
+	struct Dump
+	{
+		std::string m_source;
+		KhaxDumpFacts m_facts;
+		std::vector<std::uint32_t> m_words[OBJECT_COUNT];
+	};
+
+	// Dumps are grouped by (kernel version, New 3DS).
+	typedef std::map<std::pair<std::uint32_t, bool>, std::vector<Dump>> GroupMap;
+
+	//------------------------------------------------------------------------------------------------
+	// A field whose value is known from the facts file.  16-bit fields match half-words.
+	struct KnownField
+	{
+		ObjectKind m_object;
+		const char *m_type;
+		const char *m_name;
+		unsigned m_width;
+		std::uint32_t (*m_value)(const KhaxDumpFacts &facts);
+	};
+
+	// Thread count from the command line, or 0 if unknown.
+	std::uint32_t g_threadCount = 0;
+
+	const KnownField s_knownFields[] =
+	{
+		{ OBJECT_KPROCESS, "u32", "m_processID", 4,
+			[](const KhaxDumpFacts &facts) { return facts.processID; } },
+		{ OBJECT_KPROCESS, "KThread *", "m_mainThread", 4,
+			[](const KhaxDumpFacts &facts) { return facts.kthreadAddress; } },
+		{ OBJECT_KPROCESS, "u32", "m_threadCount", 4,
+			[](const KhaxDumpFacts &) { return g_threadCount; } },
+		{ OBJECT_KPROCESS, "u16", "m_kernelReleaseVersion", 2,
+			[](const KhaxDumpFacts &facts) { return facts.kernelVersion >> 16; } },
+		{ OBJECT_KTHREAD, "void *", "m_process", 4,
+			[](const KhaxDumpFacts &facts) { return facts.kprocessAddress; } },
+		{ OBJECT_KTHREAD, "u32", "m_threadID", 4,
+			[](const KhaxDumpFacts &facts) { return facts.threadID; } },
+		{ OBJECT_KTHREAD, "s32", "m_threadPriority", 4,
+			[](const KhaxDumpFacts &facts) { return static_cast<std::uint32_t>(facts.threadPriority); } },
+		{ OBJECT_KTHREAD, "SVCRegisterState *", "m_svcRegisterState", 4,
+			[](const KhaxDumpFacts &facts) { return facts.svcRegisterState; } },
+		// SVCThreadArea is the last 0xC8 bytes of the page, with the register state at +0x18.
+		{ OBJECT_KTHREAD, "void *", "m_svcPageEnd", 4,
+			[](const KhaxDumpFacts &facts) { return facts.svcRegisterState ? facts.svcRegisterState + 0xC8 - 0x18 : 0; } },
+		{ OBJECT_KTHREAD, "void *", "m_tlsUserMode", 4,
+			[](const KhaxDumpFacts &facts) { return facts.tlsUserMode; } },
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// What every dump in a group agrees on about one word.
+	enum WordClass
+	{
+		WORD_ZERO,
+		WORD_CONSTANT,
+		WORD_SELF_POINTER,
+		WORD_KERNEL_POINTER,
+		WORD_VARIES,
+	};
+
+	const char *const s_wordClassNames[] = { "zero", "constant", "points into itself", "kernel pointer", "varies" };
+
+	// A field placed in the candidate class.
+	struct Field
+	{
+		std::size_t m_offset;
+		unsigned m_width;
+		std::string m_type;
+		std::string m_name;
+		std::string m_comment;
+		bool m_identified;
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Read a whole file.  Returns false if it can't be read.
+	bool ReadFile(const std::string &filename, std::vector<unsigned char> &contents)
+	{
+		FILE *file = std::fopen(filename.c_str(), "rb");
+		if (!file)
+		{
+			return false;
+		}
+
+		unsigned char buffer[4096];
+		std::size_t count;
+		contents.clear();
+		while ((count = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+		{
+			contents.insert(contents.end(), buffer, buffer + count);
+		}
+		std::fclose(file);
+		return true;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Load the dumps that go with one facts file.  "suffix" is the "-%08X-%s.bin" part.
+	bool LoadDump(const std::string &directory, const std::string &suffix, Dump &dump)
+	{
+		std::vector<unsigned char> contents;
+		std::string factsName = directory + "/Facts" + suffix;
+		if (!ReadFile(factsName, contents) || (contents.size() < sizeof(dump.m_facts)))
+		{
+			std::fprintf(stderr, "%s: unreadable or truncated\n", factsName.c_str());
+			return false;
+		}
+
+		std::memcpy(&dump.m_facts, contents.data(), sizeof(dump.m_facts));
+		if ((dump.m_facts.magic != KHAX_DUMP_FACTS_MAGIC) || (dump.m_facts.size < sizeof(dump.m_facts)))
+		{
+			std::fprintf(stderr, "%s: not a facts file\n", factsName.c_str());
+			return false;
+		}
+
+		for (unsigned object = 0; object < OBJECT_COUNT; ++object)
+		{
+			std::string objectName = directory + "/" + s_objectNames[object] + suffix;
+			if (!ReadFile(objectName, contents) || (contents.size() < BASE_SIZE))
+			{
+				std::fprintf(stderr, "%s: unreadable or truncated\n", objectName.c_str());
+				return false;
+			}
+
+			dump.m_words[object].resize(contents.size() / sizeof(std::uint32_t));
+			std::memcpy(dump.m_words[object].data(), contents.data(),
+				dump.m_words[object].size() * sizeof(std::uint32_t));
+		}
+
+		dump.m_source = directory + "/Facts" + suffix;
+		return true;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Add every set of dumps in a directory.  Returns the number added.
+	unsigned ProcessDirectory(GroupMap &groups, const char *directory)
+	{
+		DIR *dir = opendir(directory);
+		if (!dir)
+		{
+			std::perror(directory);
+			return 0;
+		}
+
+		unsigned count = 0;
+		while (struct dirent *entry = readdir(dir))
+		{
+			const char *name = entry->d_name;
+			std::size_t length = std::strlen(name);
+			if ((length <= 10) || (std::strncmp(name, "Facts-", 6) != 0) || (std::strcmp(name + length - 4, ".bin") != 0))
+			{
+				continue;
+			}
+
+			Dump dump;
+			if (LoadDump(directory, name + 5, dump))
+			{
+				groups[std::make_pair(dump.m_facts.kernelVersion, dump.m_facts.new3DS != 0)].push_back(dump);
+				++count;
+			}
+		}
+
+		closedir(dir);
+		return count;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Classify every word of one object across a group.  The loops run over words innermost and
+	// don't branch, so that the compiler vectorizes them.
+	std::vector<WordClass> ClassifyWords(const std::vector<Dump> &dumps, ObjectKind object, std::size_t wordCount)
+	{
+		std::vector<std::uint32_t> differs(wordCount, 0);
+		std::vector<std::uint32_t> nonzero(wordCount, 0);
+		std::vector<std::uint32_t> pointers(wordCount, 0);
+		std::vector<std::uint32_t> selfPointers(wordCount, 0);
+		std::vector<std::uint32_t> nulls(wordCount, 0);
+
+		const std::uint32_t *first = dumps[0].m_words[object].data();
+		for (const Dump &dump : dumps)
+		{
+			const std::uint32_t *words = dump.m_words[object].data();
+			std::uint32_t base = (object == OBJECT_KPROCESS) ? dump.m_facts.kprocessAddress : dump.m_facts.kthreadAddress;
+			std::uint32_t size = static_cast<std::uint32_t>(wordCount * sizeof(std::uint32_t));
+
+			for (std::size_t index = 0; index < wordCount; ++index)
+			{
+				std::uint32_t word = words[index];
+				differs[index] |= word ^ first[index];
+				nonzero[index] |= word;
+				pointers[index] += (word >= KERNEL_POINTER_MIN) & ((word & 3) == 0);
+				selfPointers[index] += (base != 0) & (word - base < size);
+				nulls[index] += (word == 0);
+			}
+		}
+
+		std::uint32_t dumpCount = static_cast<std::uint32_t>(dumps.size());
+		std::vector<WordClass> classes(wordCount);
+		for (std::size_t index = 0; index < wordCount; ++index)
+		{
+			if (nonzero[index] == 0)
+			{
+				classes[index] = WORD_ZERO;
+			}
+			else if (selfPointers[index] + nulls[index] == dumpCount)
+			{
+				classes[index] = WORD_SELF_POINTER;
+			}
+			else if (pointers[index] + nulls[index] == dumpCount)
+			{
+				classes[index] = WORD_KERNEL_POINTER;
+			}
+			else if (differs[index] == 0)
+			{
+				classes[index] = WORD_CONSTANT;
+			}
+			else
+			{
+				classes[index] = WORD_VARIES;
+			}
+		}
+		return classes;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Offsets at which a known field's value appears in every dump of a group.
+	std::vector<std::size_t> FindKnownField(const std::vector<Dump> &dumps, const KnownField &known, std::size_t wordCount)
+	{
+		std::vector<std::size_t> offsets;
+		std::size_t units = wordCount * sizeof(std::uint32_t) / known.m_width;
+		std::vector<unsigned char> matches(units, 1);
+
+		for (const Dump &dump : dumps)
+		{
+			std::uint32_t value = known.m_value(dump.m_facts);
+			if (value == 0)
+			{
+				// Zero matches far too much to tell anything.
+				return offsets;
+			}
+
+			if (known.m_width == 2)
+			{
+				std::vector<std::uint16_t> halves(units);
+				std::memcpy(halves.data(), dump.m_words[known.m_object].data(), units * sizeof(std::uint16_t));
+				for (std::size_t index = 0; index < units; ++index)
+				{
+					matches[index] &= (halves[index] == value);
+				}
+			}
+			else
+			{
+				const std::uint32_t *words = dump.m_words[known.m_object].data();
+				for (std::size_t index = 0; index < units; ++index)
+				{
+					matches[index] &= (words[index] == value);
+				}
+			}
+		}
+
+		for (std::size_t index = BASE_SIZE / known.m_width; index < units; ++index)
+		{
+			if (matches[index])
+			{
+				offsets.push_back(index * known.m_width);
+			}
+		}
+		return offsets;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Whether every dump has a count at "index" and first/last pointers after it that agree with
+	// it: all zero or all nonzero, with at least one nonempty list.
+	bool IsList(const std::vector<Dump> &dumps, ObjectKind object, const std::vector<WordClass> &classes, std::size_t index)
+	{
+		if ((index + 2 >= classes.size()) || (classes[index + 1] != WORD_KERNEL_POINTER) ||
+			(classes[index + 2] != WORD_KERNEL_POINTER))
+		{
+			return false;
+		}
+
+		bool nonempty = false;
+		for (const Dump &dump : dumps)
+		{
+			const std::uint32_t *words = dump.m_words[object].data() + index;
+			if ((words[0] >= LIST_COUNT_MAX) || ((words[0] == 0) != (words[1] == 0)) ||
+				((words[1] == 0) != (words[2] == 0)))
+			{
+				return false;
+			}
+			nonempty = nonempty || (words[0] != 0);
+		}
+		return nonempty;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Format helper.
+	std::string Format(const char *format, unsigned long value)
+	{
+		char buffer[64];
+		std::snprintf(buffer, sizeof(buffer), format, value);
+		return buffer;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Lay out the candidate fields of one object: identified fields first, then lists, then one
+	// unknown word for each remaining word, split around 16-bit fields.
+	std::vector<Field> InferFields(const std::vector<Dump> &dumps, ObjectKind object, std::size_t wordCount,
+		std::map<std::string, std::vector<std::size_t>> &found)
+	{
+		std::vector<WordClass> classes = ClassifyWords(dumps, object, wordCount);
+		std::map<std::size_t, Field> fields;
+
+		for (const KnownField &known : s_knownFields)
+		{
+			if (known.m_object != object)
+			{
+				continue;
+			}
+
+			std::vector<std::size_t> offsets = FindKnownField(dumps, known, wordCount);
+			found[known.m_name] = offsets;
+			for (std::size_t which = 0; which < offsets.size(); ++which)
+			{
+				if (fields.count(offsets[which]))
+				{
+					continue;
+				}
+
+				// Several matches are kept with numbered names, like m_threadPriority2.
+				Field field = { offsets[which], known.m_width, known.m_type, known.m_name,
+					offsets.size() > 1 ? "ambiguous" : "", true };
+				if (which > 0)
+				{
+					field.m_name += Format("%lu", which + 1);
+				}
+				fields[field.m_offset] = field;
+			}
+		}
+
+		for (std::size_t index = BASE_SIZE / 4; index < wordCount; ++index)
+		{
+			std::size_t offset = index * 4;
+			if (fields.count(offset) || fields.count(offset + 2) || fields.count(offset + 4) ||
+				fields.count(offset + 6) || fields.count(offset + 8) || fields.count(offset + 10) ||
+				!IsList(dumps, object, classes, index))
+			{
+				continue;
+			}
+
+			std::string prefix = Format("m_list%03lX", offset);
+			fields[offset] = Field{ offset, 4, "u32", prefix + "Count", "list count", false };
+			fields[offset + 4] = Field{ offset + 4, 4, "KLinkedListNode *", prefix + "First", "list first", false };
+			fields[offset + 8] = Field{ offset + 8, 4, "KLinkedListNode *", prefix + "Last", "list last", false };
+			index += 2;
+		}
+
+		std::vector<Field> layout;
+		for (std::size_t offset = BASE_SIZE; offset < wordCount * 4; )
+		{
+			auto identified = fields.find(offset);
+			if (identified != fields.end())
+			{
+				layout.push_back(identified->second);
+				offset += identified->second.m_width;
+				continue;
+			}
+
+			// A half-word gap before a 16-bit field, or after one.
+			unsigned width = ((offset & 2) || fields.count(offset + 2)) ? 2 : 4;
+			std::uint32_t word = dumps[0].m_words[object][offset / 4];
+			if (width == 2)
+			{
+				word = (word >> ((offset & 2) * 8)) & 0xFFFF;
+			}
+			WordClass wordClass = classes[offset / 4];
+
+			// With a single dump every word is constant, so just show its value.
+			std::string comment = s_wordClassNames[wordClass];
+			if (wordClass == WORD_CONSTANT)
+			{
+				comment = Format((width == 2) ? "%04lX" : "%08lX", word);
+				if (dumps.size() > 1)
+				{
+					comment = "constant " + comment;
+				}
+			}
+
+			std::string type = (width == 2) ? "u16" : "u32";
+			if ((width == 4) && ((wordClass == WORD_SELF_POINTER) || (wordClass == WORD_KERNEL_POINTER)))
+			{
+				type = "void *";
+			}
+			layout.push_back(Field{ offset, width, type, Format("m_unknown%03lX", offset), comment, false });
+			offset += width;
+		}
+		return layout;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Print a candidate class in khaxinternal.h style.
+	void PrintClass(const std::string &className, const std::vector<Field> &layout, std::size_t size,
+		std::size_t dumpCount, const char *description)
+	{
+		std::printf("\t//------------------------------------------------------------------------------------------------\n");
+		std::printf("\t// %s, inferred by khaxlayout from %lu dump(s).\n", description, static_cast<unsigned long>(dumpCount));
+		std::printf("\tclass %s : public KSynchronizationObject\n\t{\n\tpublic:\n", className.c_str());
+
+		for (const Field &field : layout)
+		{
+			std::string declaration = field.m_type;
+			if (declaration.back() != '*')
+			{
+				declaration += ' ';
+			}
+			declaration += field.m_name + ";";
+			std::printf("\t\t%-47s // +%03lX%s%s\n", declaration.c_str(), static_cast<unsigned long>(field.m_offset),
+				field.m_comment.empty() ? "" : " ", field.m_comment.c_str());
+		}
+
+		std::printf("\t};\n");
+		std::printf("\tstatic_assert(sizeof(%s) == 0x%03lX,\n\t\t\"%s isn't the expected size.\");\n",
+			className.c_str(), static_cast<unsigned long>(size), className.c_str());
+		for (const Field &field : layout)
+		{
+			if (field.m_identified)
+			{
+				std::printf("\tstatic_assert(offsetof(%s, %s) == 0x%03lX,\n\t\t\"%s isn't the expected layout.\");\n",
+					className.c_str(), field.m_name.c_str(), static_cast<unsigned long>(field.m_offset), className.c_str());
+			}
+		}
+		std::printf("\n");
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Infer and print both objects for one group.  Records where known fields were found.
+	void PrintGroup(std::uint32_t kernelVersion, bool new3DS, const std::vector<Dump> &dumps,
+		std::map<std::string, std::vector<std::size_t>> &found)
+	{
+		char version[32];
+		std::snprintf(version, sizeof(version), "%u_%u_%u", kernelVersion >> 24, (kernelVersion >> 16) & 0xFF,
+			(kernelVersion >> 8) & 0xFF);
+		char description[64];
+		std::snprintf(description, sizeof(description), "Kernel %u.%u.%u, %s 3DS", kernelVersion >> 24,
+			(kernelVersion >> 16) & 0xFF, (kernelVersion >> 8) & 0xFF, new3DS ? "New" : "Old");
+
+		for (unsigned object = 0; object < OBJECT_COUNT; ++object)
+		{
+			// Only what every dump covers.  Dumps of different sizes come from different builds.
+			std::size_t wordCount = dumps[0].m_words[object].size();
+			for (const Dump &dump : dumps)
+			{
+				wordCount = (std::min)(wordCount, dump.m_words[object].size());
+			}
+
+			std::vector<Field> layout = InferFields(dumps, static_cast<ObjectKind>(object), wordCount, found);
+			std::string className = std::string(s_objectNames[object]) + "_" + version + (new3DS ? "_New" : "_Old");
+			PrintClass(className, layout, wordCount * 4, dumps.size(), description);
+		}
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	int arg = 1;
+	if ((argc > 2) && (std::strcmp(argv[1], "-t") == 0))
+	{
+		g_threadCount = static_cast<std::uint32_t>(std::strtoul(argv[2], nullptr, 0));
+		arg = 3;
+	}
+
+	if (arg >= argc)
+	{
+		std::fprintf(stderr, "usage: %s [-t threadCount] dumpdir...\n", argv[0]);
+		return 2;
+	}
+
+	GroupMap groups;
+	unsigned dumps = 0;
+	for (; arg < argc; ++arg)
+	{
+		dumps += ProcessDirectory(groups, argv[arg]);
+	}
+
+	std::printf("// %u dump sets in %lu groups\n\n", dumps, static_cast<unsigned long>(groups.size()));
+
+	// Field name -> group -> offsets, for the summary.
+	std::map<std::string, std::map<std::pair<std::uint32_t, bool>, std::vector<std::size_t>>> summary;
+	for (auto &entry : groups)
+	{
+		std::map<std::string, std::vector<std::size_t>> found;
+		PrintGroup(entry.first.first, entry.first.second, entry.second, found);
+		for (auto &field : found)
+		{
+			summary[field.first][entry.first] = field.second;
+		}
+	}
+
+	// Where each known field moved between versions.
+	std::printf("// Known fields by group:\n");
+	for (auto &field : summary)
+	{
+		std::printf("//   %-24s", field.first.c_str());
+		for (auto &group : field.second)
+		{
+			std::printf("  %u.%u.%u %s:", group.first.first >> 24, (group.first.first >> 16) & 0xFF,
+				(group.first.first >> 8) & 0xFF, group.first.second ? "New" : "Old");
+			if (group.second.empty())
+			{
+				std::printf(" -");
+			}
+			for (std::size_t offset : group.second)
+			{
+				std::printf(" +%03lX", static_cast<unsigned long>(offset));
+			}
+		}
+		std::printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,257 @@
+// khaxlogstat: aggregate khaxInit attempt logs (see khaxlog.h) gathered from many units.
+//
+// Host tool for Linux.  Build with:
+//     g++ -std=c++11 -O2 -o khaxlogstat khaxlogstat.cpp
+// Usage:
+//     khaxlogstat attempts1.bin attempts2.bin ...
+//
+// Each log is memory-mapped rather than read, since there may be thousands of them.  Output is
+// grouped by kernel version and Old/New 3DS: outcome counts, a histogram of the failing step,
+// the most common Result codes, Step4 layout mismatches and init time percentiles.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../khaxlog.h"
+
+static_assert(sizeof(KhaxLogRecord) == 0x60, "KhaxLogRecord isn't the expected size.");
+
+namespace
+{
+	//------------------------------------------------------------------------------------------------
+	// ARM11 system tick rate.
+	const double TICKS_PER_MICROSECOND = 268.111856;
+
+	//------------------------------------------------------------------------------------------------
+	// Totals for one kernel version and model.
+	struct Group
+	{
+		unsigned m_attempts = 0;
+		unsigned m_successes = 0;
+		// Index 0 is success, 1-7 the failing step, 8 an unrecognized kernel version.
+		unsigned m_failedSteps[9] = { };
+		unsigned m_layoutMismatches[3] = { };
+		// Step4 layout attempts, from records new enough to have them.
+		unsigned m_layoutRecords = 0;
+		unsigned long m_layoutAttempts = 0;
+		unsigned m_layoutRetried = 0;
+		std::map<std::int32_t, unsigned> m_results;
+		std::vector<std::uint32_t> m_successTicks;
+		std::vector<std::uint32_t> m_stepTicks[7];
+	};
+
+	// Groups are keyed by (kernel version, New 3DS).
+	typedef std::map<std::pair<std::uint32_t, bool>, Group> GroupMap;
+
+	//------------------------------------------------------------------------------------------------
+	// Percentile of a set of samples, in microseconds.  Sorts the samples.
+	double Percentile(std::vector<std::uint32_t> &samples, unsigned percent)
+	{
+		if (samples.empty())
+		{
+			return 0.0;
+		}
+
+		std::sort(samples.begin(), samples.end());
+		std::size_t index = (samples.size() * percent + 99) / 100;
+		return samples[index ? index - 1 : 0] / TICKS_PER_MICROSECOND;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Add one record to the totals.
+	void Accumulate(GroupMap &groups, const KhaxLogRecord &record)
+	{
+		Group &group = groups[std::make_pair(record.kernelVersion, record.new3DS != 0)];
+
+		++group.m_attempts;
+		++group.m_results[record.result];
+
+		if (record.failedStep == KHAX_LOG_STEP_NONE)
+		{
+			++group.m_successes;
+			++group.m_failedSteps[0];
+			group.m_successTicks.push_back(record.totalTicks);
+		}
+		else if (record.failedStep <= 7)
+		{
+			++group.m_failedSteps[record.failedStep];
+		}
+		else
+		{
+			++group.m_failedSteps[8];
+		}
+
+		if (record.layoutCheck < 3)
+		{
+			++group.m_layoutMismatches[record.layoutCheck];
+		}
+
+		if (record.layoutAttempts != 0)
+		{
+			++group.m_layoutRecords;
+			group.m_layoutAttempts += record.layoutAttempts;
+			group.m_layoutRetried += record.layoutAttempts > 1;
+		}
+
+		for (unsigned step = 0; step < 7; ++step)
+		{
+			if (record.stepTicks[step] != 0)
+			{
+				group.m_stepTicks[step].push_back(record.stepTicks[step]);
+			}
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Map one log file and add all of its records.  Returns the number of records read.  Stops at
+	// the first record that doesn't look valid, which is normally a truncated final write.
+	unsigned ProcessFile(GroupMap &groups, const char *filename)
+	{
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0)
+		{
+			std::perror(filename);
+			return 0;
+		}
+
+		struct stat info;
+		if ((fstat(fd, &info) != 0) || (info.st_size == 0))
+		{
+			close(fd);
+			return 0;
+		}
+
+		std::size_t size = static_cast<std::size_t>(info.st_size);
+		void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED)
+		{
+			std::perror(filename);
+			return 0;
+		}
+		madvise(mapping, size, MADV_SEQUENTIAL);
+
+		const unsigned char *data = static_cast<const unsigned char *>(mapping);
+		std::size_t offset = 0;
+		unsigned count = 0;
+		while (size - offset >= sizeof(KhaxLogRecord))
+		{
+			// Records may be unaligned if a newer version made them bigger, so copy each one out.
+			KhaxLogRecord record;
+			std::memcpy(&record, data + offset, sizeof(record));
+
+			if ((record.magic != KHAX_LOG_MAGIC) || (record.size < sizeof(record)) ||
+				(record.size > size - offset))
+			{
+				std::fprintf(stderr, "%s: bad record at offset %zu\n", filename, offset);
+				break;
+			}
+
+			Accumulate(groups, record);
+			offset += record.size;
+			++count;
+		}
+
+		munmap(mapping, size);
+		return count;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Print the totals for one group.
+	void PrintGroup(std::uint32_t kernelVersion, bool new3DS, Group &group)
+	{
+		std::printf("kernel %u.%u.%u %s 3DS: %u attempts, %u succeeded (%.1f%%)\n",
+			kernelVersion >> 24, (kernelVersion >> 16) & 0xFF, (kernelVersion >> 8) & 0xFF,
+			new3DS ? "New" : "Old", group.m_attempts, group.m_successes,
+			100.0 * group.m_successes / group.m_attempts);
+
+		for (unsigned step = 1; step <= 7; ++step)
+		{
+			if (group.m_failedSteps[step])
+			{
+				std::printf("  failed at step %u: %u\n", step, group.m_failedSteps[step]);
+			}
+		}
+		if (group.m_failedSteps[8])
+		{
+			std::printf("  unrecognized kernel: %u\n", group.m_failedSteps[8]);
+		}
+
+		if (group.m_layoutMismatches[KHAX_LOG_LAYOUT_NEXT_MISMATCH] ||
+			group.m_layoutMismatches[KHAX_LOG_LAYOUT_PREV_MISMATCH])
+		{
+			std::printf("  step4 layout: [2]->next mismatch %u, [4]->prev mismatch %u\n",
+				group.m_layoutMismatches[KHAX_LOG_LAYOUT_NEXT_MISMATCH],
+				group.m_layoutMismatches[KHAX_LOG_LAYOUT_PREV_MISMATCH]);
+		}
+
+		if (group.m_layoutRecords)
+		{
+			std::printf("  step4 attempts: mean %.2f, retried %u times\n",
+				static_cast<double>(group.m_layoutAttempts) / group.m_layoutRecords, group.m_layoutRetried);
+		}
+
+		// Most common results first.
+		std::vector<std::pair<unsigned, std::int32_t> > results;
+		for (const auto &entry : group.m_results)
+		{
+			results.push_back(std::make_pair(entry.second, entry.first));
+		}
+		std::sort(results.rbegin(), results.rend());
+		for (std::size_t x = 0; (x < results.size()) && (x < 5); ++x)
+		{
+			std::printf("  result %08X: %u\n", static_cast<unsigned>(results[x].second), results[x].first);
+		}
+
+		if (!group.m_successTicks.empty())
+		{
+			std::printf("  init time us: median %.0f p90 %.0f p99 %.0f\n",
+				Percentile(group.m_successTicks, 50), Percentile(group.m_successTicks, 90),
+				Percentile(group.m_successTicks, 99));
+		}
+		for (unsigned step = 0; step < 7; ++step)
+		{
+			if (!group.m_stepTicks[step].empty())
+			{
+				std::printf("  step%u us: median %.0f p99 %.0f\n", step + 1,
+					Percentile(group.m_stepTicks[step], 50), Percentile(group.m_stepTicks[step], 99));
+			}
+		}
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		std::fprintf(stderr, "usage: %s log.bin...\n", argv[0]);
+		return 2;
+	}
+
+	GroupMap groups;
+	unsigned long records = 0;
+	for (int arg = 1; arg < argc; ++arg)
+	{
+		records += ProcessFile(groups, argv[arg]);
+	}
+
+	std::printf("%lu records from %d files\n", records, argc - 1);
+	for (auto &entry : groups)
+	{
+		PrintGroup(entry.first.first, entry.first.second, entry.second);
+	}
+
+	return 0;
+}
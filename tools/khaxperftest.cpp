@@ -0,0 +1,239 @@
+// khaxperftest: host tests for KHAX::PerformanceMode (khaxperf.h).
+//
+// Host tool for Linux.  Build and run with:
+//     g++ -std=c++11 -O2 -o khaxperftest khaxperftest.cpp && ./khaxperftest
+//
+// ptm:sysm is replaced by a stand-in that records the calls made to it and can be told to fail
+// or to ignore the clock setting.  The spin loop timing comes from the stand-in's clock: a fixed
+// number of ticks for the current CPU speed, plus preemption delays scripted per sample.  Prints
+// each failed check and exits with the number of failures.
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "../khaxperf.h"
+
+namespace
+{
+	using KHAX::PerformanceMode;
+
+	//------------------------------------------------------------------------------------------------
+	// Spin loop timings in system ticks at each CPU clock.
+	const uint64_t LOW_CLOCK_TICKS = 0x30000;
+	const uint64_t HIGH_CLOCK_TICKS = 0x10000;
+
+	unsigned s_failures = 0;
+
+	#define EXPECT(condition) \
+		((condition) ? (void) 0 : (std::printf("line %d: %s\n", __LINE__, #condition), (void) ++s_failures))
+
+	//------------------------------------------------------------------------------------------------
+	// Stand-in for ptm:sysm and the CPU clock.
+	struct FakeSysm
+	{
+		// Results to return.
+		int32_t m_openResult;
+		std::vector<int32_t> m_configureResults;
+		// Whether a configuration with HIGH_CLOCK actually speeds the CPU up.
+		bool m_clockWorks;
+		// Extra ticks added to successive timings, repeated.
+		std::vector<uint64_t> m_delays;
+
+		// What happened.
+		bool m_open;
+		unsigned m_closeCount;
+		std::vector<uint8_t> m_configured;
+		bool m_highClock;
+		unsigned m_timings;
+
+		FakeSysm()
+		:	m_openResult(0),
+			m_clockWorks(true),
+			m_open(false),
+			m_closeCount(0),
+			m_highClock(false),
+			m_timings(0)
+		{
+		}
+
+		static int32_t Open(void *context)
+		{
+			FakeSysm *sysm = static_cast<FakeSysm *>(context);
+			sysm->m_open = (sysm->m_openResult == 0);
+			return sysm->m_openResult;
+		}
+
+		static int32_t Configure(void *context, uint8_t flags)
+		{
+			FakeSysm *sysm = static_cast<FakeSysm *>(context);
+			if (!sysm->m_open)
+			{
+				std::printf("configure while closed\n");
+				++s_failures;
+			}
+
+			std::size_t call = sysm->m_configured.size();
+			sysm->m_configured.push_back(flags);
+			int32_t result = (call < sysm->m_configureResults.size()) ? sysm->m_configureResults[call] : 0;
+			if (result == 0)
+			{
+				sysm->m_highClock = sysm->m_clockWorks && (flags & PerformanceMode::HIGH_CLOCK);
+			}
+			return result;
+		}
+
+		static void Close(void *context)
+		{
+			FakeSysm *sysm = static_cast<FakeSysm *>(context);
+			sysm->m_open = false;
+			++sysm->m_closeCount;
+		}
+
+		static uint64_t TimeSpin(void *context)
+		{
+			FakeSysm *sysm = static_cast<FakeSysm *>(context);
+			uint64_t delay = sysm->m_delays.empty() ? 0 : sysm->m_delays[sysm->m_timings % sysm->m_delays.size()];
+			++sysm->m_timings;
+			return (sysm->m_highClock ? HIGH_CLOCK_TICKS : LOW_CLOCK_TICKS) + delay;
+		}
+
+		PerformanceMode::System System()
+		{
+			PerformanceMode::System system = { Open, Configure, Close, TimeSpin, this };
+			return system;
+		}
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// The measurement is the shortest of exactly SPIN_SAMPLE_COUNT timings.
+	void TestMeasureClock()
+	{
+		FakeSysm sysm;
+		// Preempted in every sample but the sixth.
+		sysm.m_delays = { 900, 40000, 3, 70000, 12, 0, 800, 5 };
+		EXPECT(PerformanceMode::MeasureClock(sysm.System()) == LOW_CLOCK_TICKS);
+		EXPECT(sysm.m_timings == PerformanceMode::SPIN_SAMPLE_COUNT);
+
+		// A ninth sample would have been better; it mustn't be taken.
+		sysm.m_timings = 0;
+		sysm.m_delays = { 9, 9, 9, 9, 9, 9, 9, 9, 0 };
+		EXPECT(PerformanceMode::MeasureClock(sysm.System()) == LOW_CLOCK_TICKS + 9);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The high clock has to at least halve the timing.
+	void TestIsHighClock()
+	{
+		EXPECT(PerformanceMode::IsHighClock(LOW_CLOCK_TICKS, HIGH_CLOCK_TICKS));
+		EXPECT(PerformanceMode::IsHighClock(1000, 500));
+		EXPECT(!PerformanceMode::IsHighClock(1000, 501));
+		EXPECT(!PerformanceMode::IsHighClock(LOW_CLOCK_TICKS, LOW_CLOCK_TICKS));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The high clock with the L2 cache: baseline at the low clock with L2 kept, then the request.
+	void TestHighClock()
+	{
+		FakeSysm sysm;
+		sysm.m_delays = { 5000, 0, 20000 };
+		PerformanceMode::Measurement measurement;
+		PerformanceMode::Status status = PerformanceMode::Enable(sysm.System(),
+			PerformanceMode::HIGH_CLOCK | PerformanceMode::L2_CACHE, &measurement);
+
+		EXPECT(status == PerformanceMode::STATUS_OK);
+		EXPECT(sysm.m_configured == std::vector<uint8_t>({ PerformanceMode::L2_CACHE,
+			PerformanceMode::HIGH_CLOCK | PerformanceMode::L2_CACHE }));
+		EXPECT((sysm.m_closeCount == 1) && !sysm.m_open);
+		EXPECT(measurement.m_lowClockTicks == LOW_CLOCK_TICKS);
+		EXPECT(measurement.m_highClockTicks == HIGH_CLOCK_TICKS);
+		EXPECT(sysm.m_timings == 2 * PerformanceMode::SPIN_SAMPLE_COUNT);
+
+		// The baseline is taken at the low clock even if an earlier call left the high clock on.
+		sysm = FakeSysm();
+		sysm.m_highClock = true;
+		status = PerformanceMode::Enable(sysm.System(), PerformanceMode::HIGH_CLOCK, &measurement);
+		EXPECT((status == PerformanceMode::STATUS_OK) && (measurement.m_lowClockTicks == LOW_CLOCK_TICKS));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// ptm:sysm accepts the high clock but nothing speeds up.
+	void TestNotConfirmed()
+	{
+		FakeSysm sysm;
+		sysm.m_clockWorks = false;
+		PerformanceMode::Measurement measurement;
+		PerformanceMode::Status status = PerformanceMode::Enable(sysm.System(), PerformanceMode::HIGH_CLOCK,
+			&measurement);
+
+		EXPECT(status == PerformanceMode::STATUS_NOT_CONFIRMED);
+		EXPECT(measurement.m_lowClockTicks == LOW_CLOCK_TICKS);
+		EXPECT(measurement.m_highClockTicks == LOW_CLOCK_TICKS);
+		EXPECT(sysm.m_closeCount == 1);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Without the high clock there is nothing to time.
+	void TestWithoutHighClock()
+	{
+		FakeSysm sysm;
+		PerformanceMode::Measurement measurement;
+		EXPECT(PerformanceMode::Enable(sysm.System(), PerformanceMode::L2_CACHE, &measurement) ==
+			PerformanceMode::STATUS_OK);
+		EXPECT(sysm.m_configured == std::vector<uint8_t>({ PerformanceMode::L2_CACHE }));
+		EXPECT((sysm.m_timings == 0) && (measurement.m_lowClockTicks == 0) && (measurement.m_highClockTicks == 0));
+
+		// No flags switches everything off.
+		sysm = FakeSysm();
+		EXPECT(PerformanceMode::Enable(sysm.System(), 0, &measurement) == PerformanceMode::STATUS_OK);
+		EXPECT(sysm.m_configured == std::vector<uint8_t>({ 0 }));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Failures: bad flags touch nothing, and the service is closed whenever it was opened.
+	void TestFailures()
+	{
+		FakeSysm sysm;
+		PerformanceMode::Measurement measurement;
+		EXPECT(PerformanceMode::Enable(sysm.System(), 1 << 2, &measurement) == PerformanceMode::STATUS_BAD_FLAGS);
+		EXPECT(sysm.m_configured.empty() && (sysm.m_closeCount == 0));
+
+		sysm = FakeSysm();
+		sysm.m_openResult = static_cast<int32_t>(0xD8E06406);
+		EXPECT(PerformanceMode::Enable(sysm.System(), PerformanceMode::HIGH_CLOCK, &measurement) ==
+			PerformanceMode::STATUS_SERVICE_FAILED);
+		EXPECT(measurement.m_serviceResult == static_cast<int32_t>(0xD8E06406));
+		EXPECT(sysm.m_configured.empty() && (sysm.m_closeCount == 0));
+
+		// The baseline configuration fails: no second attempt, and nothing timed.
+		sysm = FakeSysm();
+		sysm.m_configureResults = { static_cast<int32_t>(0xD8E0F002) };
+		EXPECT(PerformanceMode::Enable(sysm.System(), PerformanceMode::HIGH_CLOCK, &measurement) ==
+			PerformanceMode::STATUS_SERVICE_FAILED);
+		EXPECT(measurement.m_serviceResult == static_cast<int32_t>(0xD8E0F002));
+		EXPECT((sysm.m_configured.size() == 1) && (sysm.m_closeCount == 1) && (sysm.m_timings == 0));
+
+		// The real configuration fails after the baseline.
+		sysm = FakeSysm();
+		sysm.m_configureResults = { 0, static_cast<int32_t>(0xD8E0F003) };
+		EXPECT(PerformanceMode::Enable(sysm.System(), PerformanceMode::HIGH_CLOCK, &measurement) ==
+			PerformanceMode::STATUS_SERVICE_FAILED);
+		EXPECT(measurement.m_serviceResult == static_cast<int32_t>(0xD8E0F003));
+		EXPECT((sysm.m_configured.size() == 2) && (sysm.m_closeCount == 1));
+		EXPECT(sysm.m_timings == PerformanceMode::SPIN_SAMPLE_COUNT);
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+int main()
+{
+	TestMeasureClock();
+	TestIsHighClock();
+	TestHighClock();
+	TestNotConfirmed();
+	TestWithoutHighClock();
+	TestFailures();
+
+	std::printf("%u failure%s\n", s_failures, (s_failures == 1) ? "" : "s");
+	return static_cast<int>(s_failures);
+}
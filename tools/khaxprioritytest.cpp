@@ -0,0 +1,188 @@
+// khaxprioritytest: host tests for KHAX::PriorityMath (khaxpriority.h).
+//
+// Host tool for Linux.  Build and run with:
+//     g++ -std=c++11 -O2 -o khaxprioritytest khaxprioritytest.cpp && ./khaxprioritytest
+//
+// The kernel objects are raw byte images the size of the real ones, with known values planted at
+// the offsets the header names and a filler pattern everywhere else, so that reading the wrong
+// offset shows up.  Prints each failed check and exits with the number of failures.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "../khaxpriority.h"
+
+namespace
+{
+	using KHAX::PriorityMath;
+
+	//------------------------------------------------------------------------------------------------
+	// Sizes of the images.
+	const uint32_t KTHREAD_SIZE = 0xB0;
+	const unsigned char FILLER = 0xA5;
+
+	unsigned s_failures = 0;
+
+	#define EXPECT(condition) \
+		((condition) ? (void) 0 : (std::printf("line %d: %s\n", __LINE__, #condition), (void) ++s_failures))
+
+	//------------------------------------------------------------------------------------------------
+	// Write one s32 into an image.
+	void Plant(unsigned char *image, uint32_t offset, int32_t value)
+	{
+		std::memcpy(image + offset, &value, sizeof(value));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Read one s32 from an image.
+	int32_t Peek(const unsigned char *image, uint32_t offset)
+	{
+		int32_t value;
+		std::memcpy(&value, image + offset, sizeof(value));
+		return value;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The offsets have to match the kernel's KThread and KResourceLimit.  khaxinit.cpp checks them
+	// against khaxinternal.h too, but only when building for the 3DS.
+	void TestOffsets()
+	{
+		EXPECT(PriorityMath::KTHREAD_DYNAMIC_PRIORITY == 0x03C);
+		EXPECT(PriorityMath::KTHREAD_BASE_PRIORITY == 0x06C);
+		EXPECT(PriorityMath::KTHREAD_BASE_PRIORITY + sizeof(int32_t) <= KTHREAD_SIZE);
+		EXPECT(PriorityMath::RESOURCE_LIMIT_VALUES == 0x008);
+		EXPECT(PriorityMath::RESOURCE_LIMIT_CURRENT ==
+			PriorityMath::RESOURCE_LIMIT_VALUES + PriorityMath::RESOURCE_LIMIT_VALUE_COUNT * sizeof(int32_t));
+		EXPECT(PriorityMath::RESOURCE_LIMIT_CURRENT + PriorityMath::RESOURCE_LIMIT_VALUE_COUNT * sizeof(int32_t) <=
+			PriorityMath::RESOURCE_LIMIT_SIZE);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Range checks and the highest priority of a request.
+	void TestValidate()
+	{
+		int32_t highest = -1;
+		const int32_t mixed[] = { 0x30, 0x18, 0x3F, 0x20 };
+		EXPECT(PriorityMath::Validate(mixed, 4, &highest) && (highest == 0x18));
+
+		const int32_t edges[] = { 0x00, 0x3F };
+		EXPECT(PriorityMath::Validate(edges, 2, &highest) && (highest == 0x00));
+
+		// No threads: nothing to lift for.
+		EXPECT(PriorityMath::Validate(nullptr, 0, &highest) && (highest == PriorityMath::LOWEST_PRIORITY));
+
+		// Out of range on either side, anywhere in the list, leaves *highest alone.
+		highest = 0x55;
+		const int32_t tooLow[] = { 0x20, 0x40 };
+		const int32_t negative[] = { -1, 0x20 };
+		EXPECT(!PriorityMath::Validate(tooLow, 2, &highest) && (highest == 0x55));
+		EXPECT(!PriorityMath::Validate(negative, 2, &highest) && (highest == 0x55));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The limit is only ever lowered, to exactly the highest priority requested.
+	void TestLiftedLimit()
+	{
+		EXPECT(PriorityMath::LiftedLimit(0x18, 0x10) == 0x10);
+		EXPECT(PriorityMath::LiftedLimit(0x18, 0x18) == 0x18);
+		EXPECT(PriorityMath::LiftedLimit(0x18, 0x30) == 0x18);
+		EXPECT(PriorityMath::LiftedLimit(0x18, 0x00) == 0x00);
+
+		// In an image, only the priority limit changes.
+		unsigned char limit[PriorityMath::RESOURCE_LIMIT_SIZE];
+		std::memset(limit, FILLER, sizeof(limit));
+		for (unsigned x = 0; x < PriorityMath::RESOURCE_LIMIT_VALUE_COUNT; ++x)
+		{
+			Plant(limit, PriorityMath::RESOURCE_LIMIT_VALUES + x * sizeof(int32_t), 0x18 + static_cast<int32_t>(x));
+		}
+		unsigned char original[sizeof(limit)];
+		std::memcpy(original, limit, sizeof(limit));
+
+		PriorityMath::LiftLimit(limit, 0x30);
+		EXPECT(std::memcmp(limit, original, sizeof(limit)) == 0);
+
+		PriorityMath::LiftLimit(limit, 0x04);
+		EXPECT(Peek(limit, PriorityMath::RESOURCE_LIMIT_VALUES) == 0x04);
+		EXPECT(std::memcmp(limit + PriorityMath::RESOURCE_LIMIT_VALUES + sizeof(int32_t),
+			original + PriorityMath::RESOURCE_LIMIT_VALUES + sizeof(int32_t),
+			sizeof(limit) - PriorityMath::RESOURCE_LIMIT_VALUES - sizeof(int32_t)) == 0);
+		EXPECT(std::memcmp(limit, original, PriorityMath::RESOURCE_LIMIT_VALUES) == 0);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Charges made against the copy end up on the real object, on top of its own.
+	void TestTransferCharges()
+	{
+		unsigned char real[PriorityMath::RESOURCE_LIMIT_SIZE];
+		std::memset(real, FILLER, sizeof(real));
+		int32_t before[PriorityMath::RESOURCE_LIMIT_VALUE_COUNT];
+		for (unsigned x = 0; x < PriorityMath::RESOURCE_LIMIT_VALUE_COUNT; ++x)
+		{
+			before[x] = static_cast<int32_t>(x * 3);
+			Plant(real, PriorityMath::RESOURCE_LIMIT_CURRENT + x * sizeof(int32_t), before[x]);
+		}
+
+		unsigned char copy[sizeof(real)];
+		std::memcpy(copy, real, sizeof(real));
+
+		// While the copy stood in: a thread created (index 2), an event closed (index 4), and the
+		// real object charged for something directly (index 5).
+		Plant(copy, PriorityMath::RESOURCE_LIMIT_CURRENT + 2 * sizeof(int32_t), before[2] + 1);
+		Plant(copy, PriorityMath::RESOURCE_LIMIT_CURRENT + 4 * sizeof(int32_t), before[4] - 1);
+		Plant(real, PriorityMath::RESOURCE_LIMIT_CURRENT + 5 * sizeof(int32_t), before[5] + 7);
+		// The copy's lifted limit mustn't come back with the charges.
+		PriorityMath::LiftLimit(copy, 0x00);
+
+		PriorityMath::TransferCharges(real, copy, before);
+		for (unsigned x = 0; x < PriorityMath::RESOURCE_LIMIT_VALUE_COUNT; ++x)
+		{
+			int32_t expected = before[x] + ((x == 2) ? 1 : (x == 4) ? -1 : (x == 5) ? 7 : 0);
+			int32_t actual = Peek(real, PriorityMath::RESOURCE_LIMIT_CURRENT + x * sizeof(int32_t));
+			if (actual != expected)
+			{
+				std::printf("charges: value %u is %d, expected %d\n", x, actual, expected);
+				++s_failures;
+			}
+		}
+		EXPECT(Peek(real, PriorityMath::RESOURCE_LIMIT_VALUES) == static_cast<int32_t>(0xA5A5A5A5u));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Reading a KThread image, and deciding whether a request took effect.
+	void TestVerify()
+	{
+		unsigned char thread[KTHREAD_SIZE];
+		std::memset(thread, FILLER, sizeof(thread));
+		Plant(thread, PriorityMath::KTHREAD_BASE_PRIORITY, 0x20);
+		Plant(thread, PriorityMath::KTHREAD_DYNAMIC_PRIORITY, 0x1C);
+
+		int32_t base = -1;
+		int32_t dynamic = -1;
+		PriorityMath::ReadPriorities(thread, &base, &dynamic);
+		EXPECT((base == 0x20) && (dynamic == 0x1C));
+
+		// A held mutex may have raised the dynamic priority past the base.
+		EXPECT(PriorityMath::IsApplied(0x20, 0x20, 0x20));
+		EXPECT(PriorityMath::IsApplied(0x20, 0x1C, 0x20));
+		// The base has to be exactly what was asked for, and the dynamic priority no lower.
+		EXPECT(!PriorityMath::IsApplied(0x21, 0x1C, 0x20));
+		EXPECT(!PriorityMath::IsApplied(0x1F, 0x1C, 0x20));
+		EXPECT(!PriorityMath::IsApplied(0x20, 0x24, 0x20));
+		// Fields swapped, as they would be if the offsets were the wrong way around.
+		EXPECT(!PriorityMath::IsApplied(0x1C, 0x20, 0x20));
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+int main()
+{
+	TestOffsets();
+	TestValidate();
+	TestLiftedLimit();
+	TestTransferCharges();
+	TestVerify();
+
+	std::printf("%u failure%s\n", s_failures, (s_failures == 1) ? "" : "s");
+	return static_cast<int>(s_failures);
+}
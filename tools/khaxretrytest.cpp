@@ -0,0 +1,231 @@
+// khaxretrytest: host tests for KHAX::LayoutRetry (khaxretry.h).
+//
+// Host tool for Linux.  Build and run with:
+//     g++ -std=c++11 -O2 -o khaxretrytest khaxretrytest.cpp && ./khaxretrytest
+//
+// khaxInit's retry loop is modelled here around the header's decisions: Step4 reads two free
+// block links per attempt, from a script saying what each attempt finds, and a mismatch sends the
+// model back for another attempt with a bigger spacer, as Initialize and PrepareLayoutRetry do.
+// Prints each failed check and exits with the number of failures.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "../khaxretry.h"
+
+namespace
+{
+	using KHAX::LayoutRetry;
+
+	//------------------------------------------------------------------------------------------------
+	// Kernel addresses of the third and fifth overwrite pages on the first attempt; each attempt
+	// moves them along by the spacer.
+	const uint32_t THIRD_PAGE = 0xE7F42000;
+	const uint32_t FIFTH_PAGE = 0xE7F44000;
+	// Somewhere else in the heap, where a link points when the layout is wrong.
+	const uint32_t ELSEWHERE = 0xE7A00000;
+	// Spacer slots MemChunkHax has.
+	const unsigned SPACER_CAPACITY = 8;
+
+	unsigned s_failures = 0;
+
+	#define EXPECT(condition) \
+		((condition) ? (void) 0 : (std::printf("line %d: %s\n", __LINE__, #condition), (void) ++s_failures))
+
+	//------------------------------------------------------------------------------------------------
+	// What one attempt's Step4 finds.
+	enum Attempt
+	{
+		GOOD,
+		BAD_NEXT,
+		BAD_PREV,
+		// GSPwn failed, so there was no layout to check.
+		GSPWN_FAILED,
+	};
+
+	// Step4 results.
+	enum Step4Result
+	{
+		PASSED,
+		MISMATCH,
+		OTHER_ERROR,
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// How a modelled khaxInit ended.
+	struct Outcome
+	{
+		Step4Result m_result;
+		uint32_t m_attempts;
+		LayoutRetry::Finding m_finding;
+		std::vector<uint32_t> m_spacers;
+	};
+
+	//------------------------------------------------------------------------------------------------
+	// Step4 for one attempt: the two link checks, in order.
+	Step4Result Step4(Attempt attempt, uint32_t shift, LayoutRetry::Finding *finding)
+	{
+		if (attempt == GSPWN_FAILED)
+		{
+			return OTHER_ERROR;
+		}
+
+		uint32_t third = THIRD_PAGE + shift;
+		uint32_t fifth = FIFTH_PAGE + shift;
+		uint32_t thirdNext = (attempt == BAD_NEXT) ? ELSEWHERE + shift : fifth;
+		uint32_t fifthPrev = (attempt == BAD_PREV) ? ELSEWHERE + shift : third;
+
+		if (!LayoutRetry::CheckLink(KHAX_LOG_LAYOUT_NEXT_MISMATCH, thirdNext, fifth, finding))
+		{
+			return MISMATCH;
+		}
+		if (!LayoutRetry::CheckLink(KHAX_LOG_LAYOUT_PREV_MISMATCH, fifthPrev, third, finding))
+		{
+			return MISMATCH;
+		}
+		return PASSED;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The retry loop.  Attempts past the end of the script find the last entry again.
+	Outcome Run(const std::vector<Attempt> &script, uint32_t retryLimit, unsigned spacerCapacity = SPACER_CAPACITY)
+	{
+		Outcome outcome;
+		// A finding from an earlier khaxInit.
+		outcome.m_finding.m_check = KHAX_LOG_LAYOUT_PREV_MISMATCH;
+		outcome.m_finding.m_expected = 1;
+		outcome.m_finding.m_actual = 2;
+		LayoutRetry::Clear(&outcome.m_finding);
+		outcome.m_attempts = 1;
+
+		uint32_t shift = 0;
+		for (;;)
+		{
+			Attempt attempt = script[(std::min)(static_cast<std::size_t>(outcome.m_attempts), script.size()) - 1];
+			outcome.m_result = Step4(attempt, shift, &outcome.m_finding);
+			if (!LayoutRetry::MayRetry(outcome.m_result == MISMATCH, outcome.m_attempts, retryLimit))
+			{
+				return outcome;
+			}
+
+			if (uint32_t size = LayoutRetry::SpacerSize(outcome.m_attempts,
+				static_cast<unsigned>(outcome.m_spacers.size()), spacerCapacity))
+			{
+				outcome.m_spacers.push_back(size);
+				shift += size;
+			}
+			LayoutRetry::Clear(&outcome.m_finding);
+			++outcome.m_attempts;
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// One link check.
+	void TestCheckLink()
+	{
+		LayoutRetry::Finding finding = { 7, 8, 9 };
+		EXPECT(LayoutRetry::CheckLink(KHAX_LOG_LAYOUT_NEXT_MISMATCH, FIFTH_PAGE, FIFTH_PAGE, &finding));
+		EXPECT((finding.m_check == 7) && (finding.m_expected == 8) && (finding.m_actual == 9));
+
+		EXPECT(!LayoutRetry::CheckLink(KHAX_LOG_LAYOUT_PREV_MISMATCH, ELSEWHERE, THIRD_PAGE, &finding));
+		EXPECT((finding.m_check == KHAX_LOG_LAYOUT_PREV_MISMATCH) && (finding.m_expected == THIRD_PAGE) &&
+			(finding.m_actual == ELSEWHERE));
+
+		LayoutRetry::Clear(&finding);
+		EXPECT((finding.m_check == KHAX_LOG_LAYOUT_OK) && (finding.m_expected == 0) && (finding.m_actual == 0));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// The retry limit counts retries, not attempts, and only mismatches are retried.
+	void TestMayRetry()
+	{
+		EXPECT(LayoutRetry::MayRetry(true, 1, 4));
+		EXPECT(LayoutRetry::MayRetry(true, 4, 4));
+		EXPECT(!LayoutRetry::MayRetry(true, 5, 4));
+		EXPECT(!LayoutRetry::MayRetry(true, 1, 0));
+		EXPECT(!LayoutRetry::MayRetry(false, 1, 4));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// A clean first attempt, and a stale finding from before it is cleared.
+	void TestFirstAttempt()
+	{
+		Outcome outcome = Run({ GOOD }, 4);
+		EXPECT((outcome.m_result == PASSED) && (outcome.m_attempts == 1) && outcome.m_spacers.empty());
+		EXPECT(outcome.m_finding.m_check == KHAX_LOG_LAYOUT_OK);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Mismatches that a retry gets past leave no finding behind.
+	void TestRecovered()
+	{
+		Outcome outcome = Run({ BAD_NEXT, BAD_PREV, GOOD }, 4);
+		EXPECT((outcome.m_result == PASSED) && (outcome.m_attempts == 3));
+		EXPECT((outcome.m_finding.m_check == KHAX_LOG_LAYOUT_OK) && (outcome.m_finding.m_expected == 0) &&
+			(outcome.m_finding.m_actual == 0));
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Running out of retries reports the last attempt's mismatch, not the first one's.
+	void TestExhausted()
+	{
+		Outcome outcome = Run({ BAD_NEXT, BAD_NEXT, BAD_PREV }, 2);
+		EXPECT((outcome.m_result == MISMATCH) && (outcome.m_attempts == 3));
+		EXPECT(outcome.m_finding.m_check == KHAX_LOG_LAYOUT_PREV_MISMATCH);
+		uint32_t shift = LayoutRetry::PAGE_SIZE + 2 * LayoutRetry::PAGE_SIZE;
+		EXPECT((outcome.m_finding.m_expected == THIRD_PAGE + shift) && (outcome.m_finding.m_actual == ELSEWHERE + shift));
+
+		outcome = Run({ BAD_NEXT }, 4);
+		EXPECT((outcome.m_result == MISMATCH) && (outcome.m_attempts == 5));
+		EXPECT(outcome.m_finding.m_check == KHAX_LOG_LAYOUT_NEXT_MISMATCH);
+
+		// No retries allowed.
+		outcome = Run({ BAD_PREV, GOOD }, 0);
+		EXPECT((outcome.m_result == MISMATCH) && (outcome.m_attempts == 1) && outcome.m_spacers.empty());
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Any other Step4 failure ends khaxInit at once, even with retries left.
+	void TestOtherError()
+	{
+		Outcome outcome = Run({ GSPWN_FAILED, GOOD }, 4);
+		EXPECT((outcome.m_result == OTHER_ERROR) && (outcome.m_attempts == 1));
+		EXPECT(outcome.m_finding.m_check == KHAX_LOG_LAYOUT_OK);
+
+		outcome = Run({ BAD_NEXT, GSPWN_FAILED, GOOD }, 4);
+		EXPECT((outcome.m_result == OTHER_ERROR) && (outcome.m_attempts == 2));
+		EXPECT(outcome.m_finding.m_check == KHAX_LOG_LAYOUT_OK);
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Spacers grow by a page each retry, until there are no slots left to keep them in.
+	void TestSpacers()
+	{
+		Outcome outcome = Run({ BAD_NEXT }, 4);
+		EXPECT(outcome.m_spacers == std::vector<uint32_t>({ 0x1000, 0x2000, 0x3000, 0x4000 }));
+
+		outcome = Run({ BAD_NEXT }, 4, 2);
+		EXPECT(outcome.m_spacers == std::vector<uint32_t>({ 0x1000, 0x2000 }));
+		EXPECT(outcome.m_attempts == 5);
+
+		EXPECT(LayoutRetry::SpacerSize(3, SPACER_CAPACITY, SPACER_CAPACITY) == 0);
+	}
+}
+
+//------------------------------------------------------------------------------------------------
+int main()
+{
+	TestCheckLink();
+	TestMayRetry();
+	TestFirstAttempt();
+	TestRecovered();
+	TestExhausted();
+	TestOtherError();
+	TestSpacers();
+
+	std::printf("%u failure%s\n", s_failures, (s_failures == 1) ? "" : "s");
+	return static_cast<int>(s_failures);
+}